@@ -0,0 +1,100 @@
+#include "AllocationTags.h"
+
+#if USE_ALLOCATION_TAGS == 1
+AllocationTags::Tag AllocationTags::tags[Constants::MaxAllocationTags]{};
+std::atomic<AllocationTags::SoftBudgetHandler> AllocationTags::softBudgetHandler{ nullptr };
+
+void AllocationTags::SetBudget(uint32_t t, size_t softBytes, size_t hardBytes) {
+    vassert(t < Constants::MaxAllocationTags && "AllocationTags: No such tag!");
+    Tag& tag = tags[t];
+    tag.softBudget.store(softBytes, std::memory_order_relaxed);
+    tag.hardBudget.store(hardBytes, std::memory_order_relaxed);
+    // The handler will be called again, if the tag is over the new soft budget
+    tag.overSoftBudget.store(false, std::memory_order_relaxed);
+}
+
+void AllocationTags::SetSoftBudgetHandler(SoftBudgetHandler handler) {
+    softBudgetHandler.store(handler, std::memory_order_release);
+}
+
+AllocationTags::TagStats AllocationTags::GetStats(uint32_t t) {
+    vassert(t < Constants::MaxAllocationTags && "AllocationTags: No such tag!");
+    const Tag& tag = tags[t];
+    // Memory freed under another tag than it was allocated with may take the count below zero
+    const int64_t live = tag.liveBytes.load(std::memory_order_relaxed);
+    return { (live > 0) ? size_t(live) : 0,
+             size_t(tag.peakBytes.load(std::memory_order_relaxed)),
+             tag.softBudget.load(std::memory_order_relaxed),
+             tag.hardBudget.load(std::memory_order_relaxed),
+             tag.softOverruns.load(std::memory_order_relaxed),
+             tag.rejections.load(std::memory_order_relaxed) };
+}
+
+uint32_t AllocationTags::CurrentTag() {
+    return currentTag;
+}
+
+void AllocationTags::PrintCondition() {
+    std::cout << "AllocationTags:\n";
+    for (uint32_t t = 0; t < Constants::MaxAllocationTags; t++) {
+        const TagStats stats = GetStats(t);
+        if (stats.peakBytes == 0 && stats.softBudget == 0 && stats.hardBudget == 0)
+            continue;
+        std::cout << "  tag " << t << ": " << stats.liveBytes << " bytes live, " << stats.peakBytes << " at peak";
+        if (stats.softBudget != 0)
+            std::cout << ", soft budget " << stats.softBudget << " (exceeded " << stats.softOverruns << " times)";
+        if (stats.hardBudget != 0)
+            std::cout << ", hard budget " << stats.hardBudget << " (" << stats.rejections << " allocations rejected)";
+        std::cout << "\n";
+    }
+}
+
+bool AllocationTags::admitBudgeted(size_t n, size_t hardBudget) {
+    Tag& tag = tags[currentTag];
+    const int64_t live = tag.liveBytes.load(std::memory_order_relaxed) + pendingBytes[currentTag];
+    if (live + int64_t(n) <= int64_t(hardBudget))
+        return true;
+    tag.rejections.fetch_add(1, std::memory_order_relaxed);
+    return false;
+}
+
+void AllocationTags::flush(uint32_t t) {
+    if (!registered) {
+        registered = true;
+        // Its destruction on the thread's exit flushes what's left of the balances
+        static thread_local struct ThreadExit {
+            ~ThreadExit() { flushThread(); }
+        } threadExit;
+        (void)threadExit;
+    }
+    const int64_t delta = pendingBytes[t];
+    pendingBytes[t] = 0;
+    if (delta == 0)
+        return;
+    Tag& tag = tags[t];
+    const int64_t live = tag.liveBytes.fetch_add(delta, std::memory_order_relaxed) + delta;
+    int64_t peak = tag.peakBytes.load(std::memory_order_relaxed);
+    while (live > peak && !tag.peakBytes.compare_exchange_weak(peak, live, std::memory_order_relaxed))
+        ;
+    const size_t softBudget = tag.softBudget.load(std::memory_order_relaxed);
+    if (softBudget == 0)
+        return;
+    if (live > int64_t(softBudget)) {
+        // Only the thread, that takes the tag over the budget, reports it
+        if (!tag.overSoftBudget.exchange(true, std::memory_order_relaxed)) {
+            tag.softOverruns.fetch_add(1, std::memory_order_relaxed);
+            if (SoftBudgetHandler handler = softBudgetHandler.load(std::memory_order_acquire))
+                handler(t, size_t(live));
+        }
+    } else if (tag.overSoftBudget.load(std::memory_order_relaxed)) {
+        tag.overSoftBudget.store(false, std::memory_order_relaxed);
+    }
+}
+
+void AllocationTags::flushThread() {
+    for (uint32_t t = 0; t < Constants::MaxAllocationTags; t++)
+        flush(t);
+}
+#endif // USE_ALLOCATION_TAGS
+
+// iei
@@ -0,0 +1,117 @@
+#pragma once
+#include "Defines.h"
+#include "Utilities.h"
+
+/*
+ - Allocation tags attribute the arenas' memory to the subsystems or tenants of a
+ process. They are compiled in only with USE_ALLOCATION_TAGS. A thread's allocations
+ are charged to its current tag, set with an andi::tag_scope or implied by allocating
+ through an andi::tagged_allocator, and its deallocations are credited to it. Memory
+ should therefore be freed under the tag it was allocated with - the tagged allocator
+ takes care of that by itself. Tag 0 is the one of untagged code.
+ - The tags are process-wide, so a subsystem's figures & budgets cover all the arenas.
+ - The charged size is the one of the block, that serves the request (f.e. 32 bytes
+ for a request of 20, served by a pool), since that's what the arena has given away.
+ - The counters are sharded by thread: each thread keeps its own balance of each tag
+ and adds it to the tag's shared counter only when it exceeds AllocationTagFlushBytes
+ either way, and when the thread exits. So the shared counters are touched rarely, and
+ a tag's live bytes are exact up to AllocationTagFlushBytes per thread.
+ - A tag can have a soft & a hard budget. Going over the soft one calls the handler,
+ once until the tag gets back under it - f.e. to log it, or to have the subsystem shed
+ its caches. Requests, that would go over the hard one, fail (return nullptr) before
+ any allocator is touched, so a runaway subsystem can't drain the pools of the others.
+*/
+#if USE_ALLOCATION_TAGS == 1
+namespace andi {
+    class tag_scope;
+}
+
+class AllocationTags {
+    // forward declarations...
+    friend class MemoryArena;
+    friend class andi::tag_scope;
+
+    struct alignas(64) Tag {
+        std::atomic<int64_t> liveBytes;
+        std::atomic<int64_t> peakBytes;
+        std::atomic<size_t> softBudget; // 0 for none
+        std::atomic<size_t> hardBudget; // 0 for none
+        std::atomic<bool> overSoftBudget;
+        std::atomic<uint64_t> softOverruns;
+        std::atomic<uint64_t> rejections;
+    };
+    static constexpr int64_t FlushBytes = int64_t(Constants::AllocationTagFlushBytes);
+
+    static Tag tags[Constants::MaxAllocationTags];
+    static std::atomic<void(*)(uint32_t, size_t)> softBudgetHandler;
+    // The thread's tag & its balances, that are not in the shared counters yet. A thread's
+    // first flush registers it, so that its balances are flushed when it exits.
+    inline static thread_local uint32_t currentTag = 0;
+    inline static thread_local int64_t pendingBytes[Constants::MaxAllocationTags] = {};
+    inline static thread_local bool registered = false;
+
+    // Whether the current tag may take n more bytes
+    static bool admit(size_t n) {
+        const size_t hardBudget = tags[currentTag].hardBudget.load(std::memory_order_relaxed);
+        return hardBudget == 0 || admitBudgeted(n, hardBudget);
+    }
+    static void charge(size_t n) {
+        add(int64_t(n));
+    }
+    static void credit(size_t n) {
+        add(-int64_t(n));
+    }
+    static void add(int64_t delta) {
+        const int64_t balance = (pendingBytes[currentTag] += delta);
+        if (balance >= FlushBytes || balance <= -FlushBytes || !registered)
+            flush(currentTag);
+    }
+    static bool admitBudgeted(size_t, size_t);
+    static void flush(uint32_t);
+    static void flushThread();
+public:
+    using SoftBudgetHandler = void(*)(uint32_t tag, size_t liveBytes);
+    struct TagStats {
+        size_t liveBytes;
+        size_t peakBytes;
+        size_t softBudget;
+        size_t hardBudget;
+        uint64_t softOverruns;
+        uint64_t rejections; // allocations, that failed due to the hard budget
+    };
+
+    // Sets the tag's budgets in bytes, 0 meaning no budget. They take effect immediately,
+    // even if the tag is already over them - its memory just isn't taken away.
+    static void SetBudget(uint32_t tag, size_t softBytes, size_t hardBytes);
+    // The handler is called on the allocating thread, which may allocate in it
+    static void SetSoftBudgetHandler(SoftBudgetHandler);
+    static TagStats GetStats(uint32_t tag);
+    // The tag, that the thread's allocations are currently charged to
+    static uint32_t CurrentTag();
+    static void PrintCondition();
+
+    // the tags are process-wide, there are no instances
+    AllocationTags() = delete;
+};
+
+namespace andi
+{
+    // Charges the thread's allocations & deallocations to a tag until the end of the scope.
+    // Scopes can be nested, the innermost one counts.
+    class tag_scope {
+        uint32_t previousTag;
+    public:
+        explicit tag_scope(uint32_t tag) : previousTag(AllocationTags::currentTag) {
+            vassert(tag < Constants::MaxAllocationTags && "andi::tag_scope: No such tag!");
+            AllocationTags::currentTag = tag;
+        }
+        ~tag_scope() {
+            AllocationTags::currentTag = previousTag;
+        }
+        tag_scope(const tag_scope&) = delete;
+        tag_scope& operator=(const tag_scope&) = delete;
+    };
+}
+#endif // USE_ALLOCATION_TAGS
+
+// iei
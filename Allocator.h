@@ -1,79 +1,360 @@
-﻿#pragma once
-#include "MemoryArena.h"
-#include <memory>
-
-// This header contains only the methods, needed to integrate with std::allocator_traits
-
-namespace andi
-{
-    template<class T>
-    class allocator;
-
-    template<>
-    class allocator<void> {
-    public:
-        using value_type    = void;
-        using pointer       = void*;
-        using const_pointer = const void*;
-        template<class U> struct rebind { using other = allocator<U>; };
-    };
-
-    template<class T>
-    class allocator {
-    public:
-        using value_type        = T;
-        using pointer           = value_type*;
-        using const_pointer     = const value_type*;
-        using reference         = value_type&;
-        using const_reference   = const value_type&;
-        using size_type         = std::size_t;
-        using difference_type   = std::ptrdiff_t;
-        using is_always_equal   = std::true_type;
-
-        using propagate_on_container_move_assignment = std::true_type;
-        template<class U> struct rebind { using other = allocator<U>; };
-
-        allocator() = default;
-        allocator(const allocator&) = default;
-        allocator& operator=(const allocator&) = default;
-        template<class U>
-        allocator(const allocator<U>&) noexcept {};
-        template<class U>
-        allocator& operator=(const allocator<U>&) noexcept { return *this; };
-
-              pointer address(      reference x) const noexcept { return std::addressof(x); }
-        const_pointer address(const_reference x) const noexcept { return std::addressof(x); }
-
-        pointer allocate(size_type n, allocator<void>::const_pointer = nullptr) {
-            return pointer(MemoryArena::Allocate(n * sizeof(T)));
-        }
-        void deallocate(pointer ptr, size_type = 0) {
-            MemoryArena::Deallocate(ptr);
-        }
-
-        template<class U, class... Args>
-        void construct(U* ptr, Args&&... args) {
-            ::new ((void*)ptr) U(std::forward<Args>(args)...);
-        }
-        template<class U>
-        void destroy(U* ptr) {
-            ptr->~U();
-        }
-
-        size_type max_size() const noexcept {
-            return MemoryArena::MaxSize() / sizeof(allocator<T>::value_type);
-        }
-    };
-}
-
-template<class T1, class T2>
-constexpr bool operator==(const andi::allocator<T1>& lhs, const andi::allocator<T2>& rhs) {
-    return true;
-}
-
-template<class T1, class T2>
-constexpr bool operator!=(const andi::allocator<T1>& lhs, const andi::allocator<T2>& rhs) {
-    return false;
-}
-
-// iei
+﻿#pragma once
+#include "MemoryArena.h"
+#include "OffsetPtr.h"
+#include <memory>
+// for the convenience aliases below
+#include <vector>
+#include <map>
+#include <string>
+
+// This header contains only the methods, needed to integrate with std::allocator_traits
+
+namespace andi
+{
+    // The result of allocate_at_least() - the standard one, where available (C++23)
+#if defined(__cpp_lib_allocate_at_least)
+    template<class Pointer, class SizeType = std::size_t>
+    using allocation_result = std::allocation_result<Pointer, SizeType>;
+#else
+    template<class Pointer, class SizeType = std::size_t>
+    struct allocation_result {
+        Pointer ptr;
+        SizeType count;
+    };
+#endif // __cpp_lib_allocate_at_least
+
+    template<class T>
+    class allocator;
+
+    template<>
+    class allocator<void> {
+    public:
+        using value_type    = void;
+        using pointer       = void*;
+        using const_pointer = const void*;
+        template<class U> struct rebind { using other = allocator<U>; };
+    };
+
+    template<class T>
+    class allocator {
+    public:
+        using value_type        = T;
+        using pointer           = value_type*;
+        using const_pointer     = const value_type*;
+        using reference         = value_type&;
+        using const_reference   = const value_type&;
+        using size_type         = std::size_t;
+        using difference_type   = std::ptrdiff_t;
+        using is_always_equal   = std::true_type;
+
+        using propagate_on_container_move_assignment = std::true_type;
+        template<class U> struct rebind { using other = allocator<U>; };
+
+        allocator() = default;
+        allocator(const allocator&) = default;
+        allocator& operator=(const allocator&) = default;
+        template<class U>
+        allocator(const allocator<U>&) noexcept {};
+        template<class U>
+        allocator& operator=(const allocator<U>&) noexcept { return *this; };
+
+              pointer address(      reference x) const noexcept { return std::addressof(x); }
+        const_pointer address(const_reference x) const noexcept { return std::addressof(x); }
+
+        pointer allocate(size_type n, allocator<void>::const_pointer = nullptr) {
+            // Single objects, f.e. the nodes of lists & maps, go straight to the pool of their size
+            if (n == 1)
+                return pointer(MemoryArena::defaultArena.allocateFixed<sizeof(T)>());
+            return pointer(MemoryArena::defaultArena.Allocate(n * sizeof(T)));
+        }
+        // Returns room for at least n objects, including the slack from rounding up the request
+        allocation_result<pointer, size_type> allocate_at_least(size_type n) {
+            const std::pair<void*, size_t> res = MemoryArena::defaultArena.AllocateUseful(n * sizeof(T));
+            return { pointer(res.first), res.second / sizeof(T) };
+        }
+        void deallocate(pointer ptr, size_type n = 0) {
+            if (n == 1)
+                MemoryArena::defaultArena.deallocateFixed<sizeof(T)>(ptr);
+            else
+                MemoryArena::defaultArena.Deallocate(ptr);
+        }
+
+        template<class U, class... Args>
+        void construct(U* ptr, Args&&... args) {
+            ::new ((void*)ptr) U(std::forward<Args>(args)...);
+        }
+        template<class U>
+        void destroy(U* ptr) {
+            ptr->~U();
+        }
+
+        size_type max_size() const noexcept {
+            return MemoryArena::MaxSize() / sizeof(allocator<T>::value_type);
+        }
+    };
+}
+
+namespace andi
+{
+    // These have to be in the allocator's namespace, so that the containers can find them
+    template<class T1, class T2>
+    constexpr bool operator==(const andi::allocator<T1>& lhs, const andi::allocator<T2>& rhs) {
+        return true;
+    }
+
+    template<class T1, class T2>
+    constexpr bool operator!=(const andi::allocator<T1>& lhs, const andi::allocator<T2>& rhs) {
+        return false;
+    }
+
+    // A stateful version of the allocator above, holding a pointer to the arena it allocates from.
+    // Two of them are equal only if they use the same arena, since memory has to be freed to the
+    // arena it came from. The arena is propagated along with the containers' contents, so that
+    // moving or swapping them never needs to reallocate.
+    template<class T>
+    class arena_allocator {
+        template<class> friend class arena_allocator;
+        MemoryArena* arenaPtr;
+    public:
+        using value_type        = T;
+        using pointer           = value_type*;
+        using const_pointer     = const value_type*;
+        using reference         = value_type&;
+        using const_reference   = const value_type&;
+        using size_type         = std::size_t;
+        using difference_type   = std::ptrdiff_t;
+        using is_always_equal   = std::false_type;
+
+        using propagate_on_container_copy_assignment = std::true_type;
+        using propagate_on_container_move_assignment = std::true_type;
+        using propagate_on_container_swap            = std::true_type;
+        template<class U> struct rebind { using other = arena_allocator<U>; };
+
+        // Allows default construction of the containers, using the default arena
+        arena_allocator() noexcept : arenaPtr(&MemoryArena::defaultArena) {};
+        explicit arena_allocator(MemoryArena& arena) noexcept : arenaPtr(&arena) {};
+        arena_allocator(const arena_allocator&) = default;
+        arena_allocator& operator=(const arena_allocator&) = default;
+        template<class U>
+        arena_allocator(const arena_allocator<U>& other) noexcept : arenaPtr(other.arenaPtr) {};
+        template<class U>
+        arena_allocator& operator=(const arena_allocator<U>& other) noexcept { arenaPtr = other.arenaPtr; return *this; };
+
+              pointer address(      reference x) const noexcept { return std::addressof(x); }
+        const_pointer address(const_reference x) const noexcept { return std::addressof(x); }
+
+        pointer allocate(size_type n, allocator<void>::const_pointer = nullptr) {
+            if (n == 1)
+                return pointer(arenaPtr->allocateFixed<sizeof(T)>());
+            return pointer(arenaPtr->Allocate(n * sizeof(T)));
+        }
+        allocation_result<pointer, size_type> allocate_at_least(size_type n) {
+            const std::pair<void*, size_t> res = arenaPtr->AllocateUseful(n * sizeof(T));
+            return { pointer(res.first), res.second / sizeof(T) };
+        }
+        void deallocate(pointer ptr, size_type n = 0) {
+            if (n == 1)
+                arenaPtr->deallocateFixed<sizeof(T)>(ptr);
+            else
+                arenaPtr->Deallocate(ptr);
+        }
+
+        template<class U, class... Args>
+        void construct(U* ptr, Args&&... args) {
+            ::new ((void*)ptr) U(std::forward<Args>(args)...);
+        }
+        template<class U>
+        void destroy(U* ptr) {
+            ptr->~U();
+        }
+
+        size_type max_size() const noexcept {
+            return MemoryArena::MaxSize() / sizeof(arena_allocator<T>::value_type);
+        }
+
+        MemoryArena& arena() const noexcept { return *arenaPtr; }
+
+        template<class U>
+        bool operator==(const arena_allocator<U>& rhs) const noexcept { return arenaPtr == rhs.arenaPtr; }
+        template<class U>
+        bool operator!=(const arena_allocator<U>& rhs) const noexcept { return arenaPtr != rhs.arenaPtr; }
+    };
+
+#if USE_ALLOCATION_TAGS == 1
+    // A version of andi::allocator, that charges its memory to a tag, whatever the thread's
+    // current one is. The memory is credited back to the same tag, even if a container of a
+    // subsystem is destroyed by someone else.
+    template<class T, uint32_t Tag>
+    class tagged_allocator {
+        static_assert(Tag < Constants::MaxAllocationTags);
+    public:
+        using value_type        = T;
+        using pointer           = value_type*;
+        using const_pointer     = const value_type*;
+        using reference         = value_type&;
+        using const_reference   = const value_type&;
+        using size_type         = std::size_t;
+        using difference_type   = std::ptrdiff_t;
+        using is_always_equal   = std::true_type;
+
+        using propagate_on_container_move_assignment = std::true_type;
+        template<class U> struct rebind { using other = tagged_allocator<U, Tag>; };
+
+        tagged_allocator() = default;
+        tagged_allocator(const tagged_allocator&) = default;
+        tagged_allocator& operator=(const tagged_allocator&) = default;
+        template<class U>
+        tagged_allocator(const tagged_allocator<U, Tag>&) noexcept {};
+        template<class U>
+        tagged_allocator& operator=(const tagged_allocator<U, Tag>&) noexcept { return *this; };
+
+              pointer address(      reference x) const noexcept { return std::addressof(x); }
+        const_pointer address(const_reference x) const noexcept { return std::addressof(x); }
+
+        pointer allocate(size_type n, allocator<void>::const_pointer = nullptr) {
+            tag_scope scope{ Tag };
+            return allocator<T>{}.allocate(n);
+        }
+        allocation_result<pointer, size_type> allocate_at_least(size_type n) {
+            tag_scope scope{ Tag };
+            return allocator<T>{}.allocate_at_least(n);
+        }
+        void deallocate(pointer ptr, size_type n = 0) {
+            tag_scope scope{ Tag };
+            allocator<T>{}.deallocate(ptr, n);
+        }
+
+        template<class U, class... Args>
+        void construct(U* ptr, Args&&... args) {
+            ::new ((void*)ptr) U(std::forward<Args>(args)...);
+        }
+        template<class U>
+        void destroy(U* ptr) {
+            ptr->~U();
+        }
+
+        size_type max_size() const noexcept {
+            return MemoryArena::MaxSize() / sizeof(tagged_allocator<T, Tag>::value_type);
+        }
+    };
+
+    template<class T1, class T2, uint32_t Tag>
+    constexpr bool operator==(const andi::tagged_allocator<T1, Tag>&, const andi::tagged_allocator<T2, Tag>&) {
+        return true;
+    }
+
+    template<class T1, class T2, uint32_t Tag>
+    constexpr bool operator!=(const andi::tagged_allocator<T1, Tag>&, const andi::tagged_allocator<T2, Tag>&) {
+        return false;
+    }
+#endif // USE_ALLOCATION_TAGS
+
+#if USE_HANDLE_SPACE == 1
+    // A version of andi::allocator, that allocates from the default arena's handle space and
+    // returns andi::offset_ptr. std::vector works with it, but the standard library's node-based
+    // containers generally don't support such pointers - the nodes of user structures should
+    // hold andi::offset_ptr links themselves, allocated through this allocator.
+    template<class T>
+    class handle_allocator {
+    public:
+        using value_type         = T;
+        using pointer            = offset_ptr<T>;
+        using const_pointer      = offset_ptr<const T>;
+        using void_pointer       = offset_ptr<void>;
+        using const_void_pointer = offset_ptr<const void>;
+        using reference          = value_type&;
+        using const_reference    = const value_type&;
+        using size_type          = std::size_t;
+        using difference_type    = std::ptrdiff_t;
+        using is_always_equal    = std::true_type;
+
+        using propagate_on_container_move_assignment = std::true_type;
+        template<class U> struct rebind { using other = handle_allocator<U>; };
+
+        handle_allocator() = default;
+        handle_allocator(const handle_allocator&) = default;
+        handle_allocator& operator=(const handle_allocator&) = default;
+        template<class U>
+        handle_allocator(const handle_allocator<U>&) noexcept {};
+        template<class U>
+        handle_allocator& operator=(const handle_allocator<U>&) noexcept { return *this; };
+
+        pointer allocate(size_type n) {
+            return pointer::from_handle(MemoryArena::defaultArena.AllocateHandle(n * sizeof(T)));
+        }
+        void deallocate(pointer ptr, size_type = 0) {
+            MemoryArena::defaultArena.DeallocateHandle(ptr.handle());
+        }
+
+        template<class U, class... Args>
+        void construct(U* ptr, Args&&... args) {
+            ::new ((void*)ptr) U(std::forward<Args>(args)...);
+        }
+        template<class U>
+        void destroy(U* ptr) {
+            ptr->~U();
+        }
+
+        size_type max_size() const noexcept {
+            return Constants::MaxAllocationSize / sizeof(handle_allocator<T>::value_type);
+        }
+    };
+
+    template<class T1, class T2>
+    constexpr bool operator==(const andi::handle_allocator<T1>&, const andi::handle_allocator<T2>&) {
+        return true;
+    }
+
+    template<class T1, class T2>
+    constexpr bool operator!=(const andi::handle_allocator<T1>&, const andi::handle_allocator<T2>&) {
+        return false;
+    }
+#endif // USE_HANDLE_SPACE
+
+    // For convenience: andi::string instead of std::string, andi::vector<int>, andi::map<...>, etc.
+    using string = std::basic_string<char, std::char_traits<char>, andi::allocator<char>>;
+
+    template<class T>
+    using vector = std::vector<T, andi::allocator<T>>;
+
+    template<class Key, class Value, class Pred = std::less<Key>>
+    using map = std::map<Key, Value, Pred, andi::allocator<std::pair<const Key, Value>>>;
+
+    // Growth helpers for the containers, that don't use allocate_at_least() themselves.
+    // The capacity is rounded up to what the arena would hand out anyway, so that
+    // the rounding slack gets used before the next reallocation.
+    template<class T>
+    size_t good_capacity(size_t n) {
+        return MemoryArena::GoodSize(n * sizeof(T)) / sizeof(T);
+    }
+
+    // Reserves room for at least n elements, growing geometrically like the containers do
+    template<class T, class Alloc>
+    void reserve(std::vector<T, Alloc>& v, size_t n) {
+        if (n <= v.capacity())
+            return;
+        v.reserve(good_capacity<T>((n < 2 * v.capacity()) ? 2 * v.capacity() : n));
+    }
+
+    // Same as above - the strings need one more character for the terminating zero
+    template<class CharT, class Traits, class Alloc>
+    void reserve(std::basic_string<CharT, Traits, Alloc>& s, size_t n) {
+        if (n <= s.capacity())
+            return;
+        s.reserve(good_capacity<CharT>(((n < 2 * s.capacity()) ? 2 * s.capacity() : n) + 1) - 1);
+    }
+
+    template<class T, class Alloc, class U>
+    void push_back(std::vector<T, Alloc>& v, U&& value) {
+        andi::reserve(v, v.size() + 1);
+        v.push_back(std::forward<U>(value));
+    }
+
+    template<class CharT, class Traits, class Alloc>
+    void append(std::basic_string<CharT, Traits, Alloc>& s, const CharT* str, size_t count) {
+        andi::reserve(s, s.size() + count);
+        s.append(str, count);
+    }
+}
+
+// iei
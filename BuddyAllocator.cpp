@@ -1,314 +1,730 @@
-#include "BuddyAllocator.h"
-
-BuddyAllocator::BuddyAllocator() {
-    Reset();
-}
-
-void BuddyAllocator::Reset() {
-    poolPtr = nullptr;
-    virtualZero = 0;
-    for (uint32_t k = 0; k < Constants::K + 2; k++) {
-        for (uint32_t i = 0; i < Constants::K + 1; i++) {
-            freeBlocks[k][i].prev = nullptr;
-            freeBlocks[k][i].next = nullptr;
-        }
-        bitvectors[k] = 0;
-        leastSetBits[k] = 0;
-    }
-}
-
-void BuddyAllocator::Initialize() {
-    andi::lock_guard lock{ mtx };
-    // Allocate the pool address space...
-    // The extra space is needed for the header of the first block, so that
-    // the user-returned address of the first block is aligned at 32 bytes.
-    poolPtr = (byte*)andi::aligned_malloc(Constants::BuddyAllocatorSize + Constants::Alignment);
-    virtualZero = uintptr_t(poolPtr) + Constants::Alignment - Constants::HeaderSize;
-    vassert(virtualZero % alignof(Superblock) == 0);
-    // ...initialize the system information...
-    for (uint32_t k = 0; k < Constants::K + 2; k++) {
-        for (uint32_t i = 0; i < Constants::K + 1; i++) {
-            freeBlocks[k][i].prev = &freeBlocks[k][i];
-            freeBlocks[k][i].next = &freeBlocks[k][i];
-            // no need to maintain free,k,i
-        }
-        bitvectors[k] = 0ui64;
-        leastSetBits[k] = 64U;
-    }
-    // ... and add the initial Superblock
-    Superblock* sblk = (Superblock*)virtualZero;
-    sblk->free = 1;
-    sblk->k = Constants::K + 1;
-#if HPC_DEBUG == 1
-    sign(sblk);
-#endif
-    insertFreeSuperblock(sblk);
-}
-
-void BuddyAllocator::Deinitialize() {
-    andi::lock_guard lock{ mtx };
-    andi::aligned_free(poolPtr);
-    Reset();
-}
-
-void* BuddyAllocator::Allocate(size_t n) {
-    if (n > MaxSize())
-        return nullptr;
-    andi::lock_guard lock{ mtx };
-    return allocateSuperblock(n);
-}
-
-void BuddyAllocator::Deallocate(void* ptr) {
-    andi::lock_guard lock{ mtx };
-    vassert((uintptr_t(ptr) % Constants::Alignment == 0)
-        && "MemoryArena: Attempting to free a non-aligned pointer!");
-    vassert(isValidSignature(fromUserAddress(ptr))
-        && "MemoryArena: Pointer is either already freed or is not the one, returned to user!\n");
-    Superblock* sblk = fromUserAddress(ptr);
-    deallocateSuperblock(sblk);
-}
-
-std::pair<void*, size_t> BuddyAllocator::AllocateUseful(size_t n) {
-    void* ptr = Allocate(n);
-    const size_t k = fromUserAddress(ptr)->k;
-    return { ptr, (size_t(1) << (k - 1)) - Constants::HeaderSize };
-}
-
-size_t BuddyAllocator::MaxSize() {
-    return Constants::MaxAllocationSize;
-}
-
-bool BuddyAllocator::Contains(void* ptr) const {
-    // The +Alignment here also compensates for the over-allocation for the first block's header
-    return ptr >= poolPtr && ptr < (poolPtr + Constants::BuddyAllocatorSize + Constants::Alignment);
-}
-
-void BuddyAllocator::PrintCondition() const {
-    std::cout << "Pool address: 0x" << std::hex << (void*)poolPtr << std::dec << "\n";
-    std::cout << "Pool size:  " << Constants::BuddyAllocatorSize << " bytes.\n";
-    std::cout << "Free superblocks of type (k,i):\n";
-    size_t freeSpace = 0;
-    for (uint32_t k = 0; k < Constants::K + 2; k++)
-        for (uint32_t i = 0; i < Constants::K + 1; i++) {
-            size_t counter = 0;
-            const Superblock* headPtr = &freeBlocks[k][i];
-            for (const Superblock* ptr = headPtr->next; ptr != headPtr; ptr = ptr->next)
-                ++counter;
-            if (counter != 0)
-                std::cout << " (" << k << "," << i << "): " << counter << "\n";
-            freeSpace += counter * ((size_t(1) << k) - (size_t(1) << i));
-    }
-    std::cout << "Free space: " << freeSpace << " bytes.\n";
-    std::cout << "Used space: " << Constants::BuddyAllocatorSize - freeSpace << " bytes.\n\n";
-}
-
-#if HPC_DEBUG == 1
-void BuddyAllocator::sign(Superblock* sblk) {
-    sblk->signature = getSignature(sblk);
-}
-
-uint32_t BuddyAllocator::getSignature(Superblock* sblk) {
-    return (~sblk->blueprint) ^ uint32_t(uintptr_t(sblk) >> 8);
-}
-
-bool BuddyAllocator::isValidSignature(Superblock* sblk) {
-    /* The probability of a false positive (a random address containing
-     * a valid signature) is 1/2 * 27/65536 * 1/2^32, or approximately
-     * 1 in 21,000,000,000,000 (!). What's more, since the address of
-     * a Superblock itself is used in generating the Superblock's
-     * signature, at every following run the probability is multiplied
-     * by this number: 1 in 10^13, 1 in 10^26, 1 in 10^40...
-     * in general, practically zero just after the first run */ 
-    return (sblk->free == 0
-         && sblk->k > Constants::MinAllocationSizeLog
-         && sblk->k <= Constants::K + 1
-         && sblk->signature == getSignature(sblk));
-}
-#endif // HPC_DEBUG
-
-void* BuddyAllocator::allocateSuperblock(size_t n) {
-    const uint32_t j = calculateJ(n);
-    Superblock* sblk = findFreeSuperblock(j);
-    if (sblk == nullptr)
-        return nullptr;
-
-    // Remove this super block, we'll add the Superblocks it decomposes to later
-    removeFreeSuperblock(sblk);
-    const uint32_t old_k = sblk->k;
-    const uint32_t old_i = calculateI(sblk);
-
-    // In case splitting the block is needed
-    if (old_i > j) {
-        // split into three smaller Superblocks
-        sblk->free = 0;
-        sblk->k = j + 1;
-
-        // update the system info about their existence
-        Superblock* block1 = (Superblock*)(uintptr_t(sblk) + (uintptr_t(1) << j));
-        block1->free = 1;
-        block1->k = old_i;
-#if HPC_DEBUG == 1
-        sign(block1);
-#endif
-        insertFreeSuperblock(block1);
-
-        if (old_k != old_i + 1) {
-            Superblock* block2 = (Superblock*)(uintptr_t(sblk) + (uintptr_t(1) << old_i));
-            block2->free = 1;
-            block2->k = old_k;
-#if HPC_DEBUG == 1
-            sign(block2);
-#endif
-            insertFreeSuperblock(block2);
-        }
-
-        // In that case, we can simply return sblk + the offset;
-#if HPC_DEBUG == 1
-        sign(sblk);
-#endif
-        return toUserAddress(sblk);
-    }
-
-    // Calculates where in the Superblock the user address should point to
-    Superblock* addr = (Superblock*)(uintptr_t(sblk) + (uintptr_t(1) << j) - (uintptr_t(1) << old_i));
-    // Mark as a used block & save its k,i
-    addr->free = 0;
-    addr->k = j + 1;
-
-    // A "left" Superblock may not exist (!)
-    if (j > old_i) {
-        // This means the Superblock found remains free, but we only update its k
-        sblk->k = j;
-#if HPC_DEBUG == 1
-        sign(sblk);
-#endif
-        // update the system information
-        insertFreeSuperblock(sblk);
-    }
-    // A "right" super block may not be needed, too
-    if (j < old_k - 1) {
-        // Again, mark as free and update its k,i
-        Superblock* rblock = (Superblock*)(uintptr_t(addr) + (uintptr_t(1) << j));
-        rblock->free = 1;
-        rblock->k = old_k;
-#if HPC_DEBUG == 1
-        sign(rblock);
-#endif
-        // update the system info
-        insertFreeSuperblock(rblock);
-    }
-
-    // return the address + offset
-#if HPC_DEBUG == 1
-    sign(addr);
-#endif
-    return toUserAddress(addr);
-}
-
-void BuddyAllocator::deallocateSuperblock(Superblock* sblk) {
-    // Marks the Superblock as free and begins to
-    // merge it upwards, recursively
-    sblk->free = 1;
-    recursiveMerge(sblk);
-}
-
-void BuddyAllocator::insertFreeSuperblock(Superblock* sblk) {
-    // Add this Superblock to the corresponding list in the table
-    const uint32_t k = sblk->k;
-    const uint32_t i = calculateI(sblk);
-    sblk->next = freeBlocks[k][i].next;
-    freeBlocks[k][i].next = sblk;
-    sblk->prev = &freeBlocks[k][i]; // == sblk->next->prev
-    sblk->next->prev = sblk;
-    // Update the bitvector, that a free Superblock of this size now is sure to exist
-    bitvectors[k] |= (1ui64 << i);
-    leastSetBits[k] = leastSetBit(bitvectors[k]);	
-}
-
-void BuddyAllocator::removeFreeSuperblock(Superblock* sblk) {
-    // Remove the Superblock from the system info
-    sblk->prev->next = sblk->next;
-    sblk->next->prev = sblk->prev;
-    //sblk->next = sblk->prev = nullptr;
-    const uint32_t k = sblk->k;
-    const uint32_t i = calculateI(sblk);
-    // If there are no more Superblocks of size (k,i),
-    // indicated by the list having only one element,
-    // we free the i-th bit of the k-th bitvector
-    if (freeBlocks[k][i].next == &freeBlocks[k][i]) {
-        bitvectors[k] &= ~(1ui64 << i);
-        leastSetBits[k] = leastSetBit(bitvectors[k]);
-    }
-}
-
-Superblock* BuddyAllocator::findFreeSuperblock(uint32_t j) const {
-    uint32_t min_i = 64, min_k = 0;
-    for (uint32_t k = j + 1; k < Constants::K + 2; k++)
-        if (leastSetBits[k] < min_i) {
-            min_i = leastSetBits[k];
-            min_k = k;
-    }
-    if (min_i == 64)
-        return nullptr;
-    return freeBlocks[min_k][min_i].next;
-}
-
-Superblock* BuddyAllocator::findBuddySuperblock(Superblock* sblk) const {
-    // Finding a Superblock's buddy is as simple as flipping the i+1-st bit of its virtual address
-    return fromVirtualOffset(toVirtualOffset(sblk) ^ (uintptr_t(1) << calculateI(sblk)));
-}
-
-void BuddyAllocator::recursiveMerge(Superblock* sblk) {
-    // Superblocks are merged only if these three conditions hold:
-    // - there is something left to merge (i.e. the pool isn't completely empty)
-    // - the current Superblock's buddy is free
-    // - the buddy has the appropriate size of 2^k-2^i for some k,
-    //   where 2^i is the size of the current block
-    // Otherwise, the block is simply inserted to its corresponding
-    // list, as a normal block of size 2^j for some j
-    Superblock* buddy = findBuddySuperblock(sblk);
-    if ((uintptr_t(sblk) == virtualZero && sblk->k == Constants::K + 1) ||
-        buddy->free == 0 || calculateI(sblk) != calculateI(buddy)) {
-#if HPC_DEBUG == 1
-        sign(sblk);
-#endif
-        insertFreeSuperblock(sblk);
-        return;
-    }
-    // There will be a merge, so we remove the buddy from the system info
-    removeFreeSuperblock(buddy);
-    const uint32_t buddy_k = buddy->k;	// старото k
-    // Unite the buddies in a block of size 2^k (again, represented as 2^(k+1) - 2^k)
-    if (buddy < sblk)
-        sblk = buddy;
-    sblk->k = buddy_k + 1;
-    // Merge upwards until possible.
-    recursiveMerge(sblk); // Tail recursion optimization should probably take care of this call.
-}
-
-void* BuddyAllocator::toUserAddress(Superblock* sblk) {
-    return (void*)(uintptr_t(sblk) + Constants::HeaderSize);
-}
-
-Superblock* BuddyAllocator::fromUserAddress(void* ptr) {
-    return (Superblock*)(uintptr_t(ptr) - Constants::HeaderSize);
-}
-
-uintptr_t BuddyAllocator::toVirtualOffset(Superblock* sblk) const {
-    return uintptr_t(sblk) - virtualZero;
-}
-
-Superblock* BuddyAllocator::fromVirtualOffset(uintptr_t offset) const {
-    vassert(offset % alignof(Superblock) == 0);
-    return (Superblock*)(virtualZero + offset);
-}
-
-uint32_t BuddyAllocator::calculateI(Superblock* sblk) const {
-    return min(leastSetBit(toVirtualOffset(sblk)), sblk->k - 1);
-}
-
-uint32_t BuddyAllocator::calculateJ(size_t n) {
-    return max(fastlog2(n + Constants::HeaderSize - 1) + 1, uint32_t(Constants::MinAllocationSizeLog));
-}
-
-// iei
+#include "BuddyAllocator.h"
+#include <cstring> // std::memset
+
+BuddyAllocator::BuddyAllocator() {
+    Reset();
+}
+
+void BuddyAllocator::Reset() {
+    blockInfo = nullptr;
+    residentPages = nullptr;
+    poolPtr = nullptr;
+    virtualZero = 0;
+    sharedPages = false;
+#if USE_HARDENING == 1
+    hardened = false;
+#endif // USE_HARDENING
+    for (uint32_t k = 0; k < Constants::K + 2; k++) {
+        for (uint32_t i = 0; i < Constants::K + 1; i++) {
+            freeBlocks[k][i].prev = nullptr;
+            freeBlocks[k][i].next = nullptr;
+#if USE_ADDRESS_ORDERED_BUDDY == 1
+            freeBlocks[k][i].child = nullptr;
+#endif // USE_ADDRESS_ORDERED_BUDDY
+        }
+        bitvectors[k] = 0;
+        leastSetBits[k] = 0;
+        for (uint32_t i = 0; i < Constants::K + 1; i++)
+            freeCounts[k][i] = 0;
+    }
+    nonEmptyBitvectors = 0;
+    freeSpace = 0;
+    publishedFreeSpace = 0;
+    publishedLargestBlock = 0;
+}
+
+bool BuddyAllocator::Initialize([[maybe_unused]] bool hardening) {
+    andi::lock_guard lock{ mtx };
+    // Allocate the pool address space and its (zero-initialized) metadata tables...
+    byte* pool = (byte*)andi::page_alloc_aligned(Constants::BuddyAllocatorSize, Constants::BuddyAllocatorSize);
+    SuperblockInfo* info = (SuperblockInfo*)andi::page_alloc(Constants::SuperblockInfoSize);
+    uint64_t* residency = (uint64_t*)andi::page_alloc(Constants::ResidencyTableSize);
+    if (!pool || !info || !residency) {
+        if (pool)
+            andi::page_free(pool, Constants::BuddyAllocatorSize);
+        if (info)
+            andi::page_free(info, Constants::SuperblockInfoSize);
+        if (residency)
+            andi::page_free(residency, Constants::ResidencyTableSize);
+        Reset();
+        return false;
+    }
+    format(pool, info, residency);
+#if USE_HARDENING == 1
+    hardened = hardening;
+#endif // USE_HARDENING
+    return true;
+}
+
+void BuddyAllocator::format(byte* pool, SuperblockInfo* info, uint64_t* residency) {
+    poolPtr = pool;
+    blockInfo = info;
+    residentPages = residency;
+    virtualZero = uintptr_t(pool);
+    vassert(virtualZero % alignof(Superblock) == 0);
+    // ...initialize the system information...
+    for (uint32_t k = 0; k < Constants::K + 2; k++) {
+        for (uint32_t i = 0; i < Constants::K + 1; i++) {
+            freeBlocks[k][i].prev = &freeBlocks[k][i];
+            freeBlocks[k][i].next = &freeBlocks[k][i];
+#if USE_ADDRESS_ORDERED_BUDDY == 1
+            freeBlocks[k][i].child = &freeBlocks[k][i];
+#endif // USE_ADDRESS_ORDERED_BUDDY
+            // no need to maintain free,k,i
+            freeCounts[k][i] = 0;
+        }
+        bitvectors[k] = 0ui64;
+        leastSetBits[k] = 64U;
+    }
+    nonEmptyBitvectors = 0;
+    freeSpace = 0;
+    // ... and add the initial Superblock
+    // (which has never been touched, so it counts as released)
+    Superblock* sblk = (Superblock*)uintptr_t(virtualZero);
+    setInfo(sblk, Constants::K + 1, 1, 1);
+    insertFreeSuperblock(sblk);
+    publishStatistics();
+}
+
+void BuddyAllocator::Deinitialize() {
+    andi::lock_guard lock{ mtx };
+    // Nothing is reserved, if the initialization has failed
+    if (poolPtr == nullptr)
+        return;
+    andi::page_free(poolPtr, Constants::BuddyAllocatorSize);
+    andi::page_free(blockInfo, Constants::SuperblockInfoSize);
+    andi::page_free(residentPages, Constants::ResidencyTableSize);
+    Reset();
+}
+
+void* BuddyAllocator::Allocate(size_t n) {
+    bool released;
+    return Allocate(n, released);
+}
+
+void* BuddyAllocator::Allocate(size_t n, bool& released) {
+    released = false;
+    if (n > MaxSize())
+        return nullptr;
+    andi::lock_guard lock{ mtx };
+    void* ptr = allocateSuperblock(n, released);
+    publishStatistics();
+    return ptr;
+}
+
+void* BuddyAllocator::AllocateZeroed(size_t n) {
+    bool released;
+    void* ptr = Allocate(n, released);
+    if (ptr == nullptr)
+        return nullptr;
+    // The block is no longer in a free list, so it can be zeroed without locking
+    if (released)
+        zeroDirtyPages(ptr, UsefulSize(ptr), n);
+    else
+        std::memset(ptr, 0, n);
+    return ptr;
+}
+
+void BuddyAllocator::Deallocate(void* ptr) {
+    andi::lock_guard lock{ mtx };
+#if USE_HARDENING == 1
+    // The table tells in O(1) whether a block starts here & is allocated
+    if (hardened && uintptr_t(ptr) % Constants::Alignment != 0) {
+        andi::report_corruption(andi::corruption::misaligned_free, ptr, "BuddyAllocator");
+        return;
+    }
+    if (hardened && !isAllocatedSuperblock((Superblock*)ptr)) {
+        andi::report_corruption(andi::corruption::invalid_free, ptr, "BuddyAllocator");
+        return;
+    }
+#endif // USE_HARDENING
+    vassert((uintptr_t(ptr) % Constants::Alignment == 0)
+        && "MemoryArena: Attempting to free a non-aligned pointer!");
+    vassert(isAllocatedSuperblock((Superblock*)ptr)
+        && "MemoryArena: Pointer is either already freed or is not the one, returned to user!\n");
+    deallocateSuperblock((Superblock*)ptr);
+    publishStatistics();
+}
+
+#if USE_DEFRAGMENTATION == 1
+void* BuddyAllocator::AllocateBelow(size_t n, void* limit) {
+    if (n > MaxSize())
+        return nullptr;
+    andi::lock_guard lock{ mtx };
+    const uint32_t j = calculateJ(n);
+    // Any free Superblock with k > j can fit the request, just like in findFreeSuperblock().
+    // The one, whose block would start lowest, is taken: carveSuperblock() returns the start
+    // of a Superblock with i > j, or else the 2^j bytes at 2^j - 2^i from its start.
+    Superblock* lowest = nullptr;
+    uintptr_t lowestStart = 0;
+    for (uint64_t mask = nonEmptyBitvectors & ~((2ui64 << j) - 1); mask != 0; mask &= mask - 1) {
+        const uint32_t k = leastSetBit(mask);
+        for (uint64_t bits = bitvectors[k]; bits != 0; bits &= bits - 1) {
+            const uint32_t i = leastSetBit(bits);
+            const uintptr_t offset = (i > j) ? 0 : (uintptr_t(1) << j) - (uintptr_t(1) << i);
+            forEachFreeSuperblock(k, i, [&](Superblock* sblk) {
+                if (lowest == nullptr || uintptr_t(sblk) + offset < lowestStart) {
+                    lowest = sblk;
+                    lowestStart = uintptr_t(sblk) + offset;
+                }
+                // A heap's root is its lowest block already
+                return USE_ADDRESS_ORDERED_BUDDY == 0;
+            });
+        }
+    }
+    if (lowest == nullptr || lowestStart + (uintptr_t(1) << j) > uintptr_t(limit))
+        return nullptr;
+    bool released;
+    void* ptr = carveSuperblock(lowest, j, released);
+    vassert(uintptr_t(ptr) == lowestStart);
+    publishStatistics();
+    return ptr;
+}
+#endif // USE_DEFRAGMENTATION
+
+#if USE_HARDENING == 1
+bool BuddyAllocator::IsAllocated(void* ptr) const {
+    return !hardened
+        || (uintptr_t(ptr) % Constants::Alignment == 0 && isAllocatedSuperblock((Superblock*)ptr));
+}
+#endif // USE_HARDENING
+
+std::pair<void*, size_t> BuddyAllocator::AllocateUseful(size_t n) {
+    void* ptr = Allocate(n);
+    if (ptr == nullptr)
+        return { nullptr, 0 };
+    return { ptr, UsefulSize(ptr) };
+}
+
+size_t BuddyAllocator::UsefulSize(void* ptr) const {
+    // The block is no longer in a free list, so its metadata can be read without locking
+    const size_t k = getInfo((Superblock*)ptr).k;
+    return size_t(1) << (k - 1);
+}
+
+size_t BuddyAllocator::GoodSize(size_t n) {
+    return size_t(1) << calculateJ(n);
+}
+
+template<class Func>
+void BuddyAllocator::forEachFreeSuperblock(uint32_t k, uint32_t i, Func func) {
+    Superblock* headPtr = &freeBlocks[k][i];
+#if USE_ADDRESS_ORDERED_BUDDY == 1
+    // A preorder walk of the heap, climbing back through the prev links
+    Superblock* ptr = headPtr->child;
+    while (ptr != headPtr) {
+        if (!func(ptr))
+            return;
+        if (ptr->child != headPtr) {
+            ptr = ptr->child;
+            continue;
+        }
+        while (ptr != headPtr && ptr->next == headPtr) {
+            // prev is the parent only for the leftmost child, so pass its left siblings first
+            Superblock* prev = ptr->prev;
+            while (prev->child != ptr) {
+                ptr = prev;
+                prev = ptr->prev;
+            }
+            ptr = prev;
+        }
+        if (ptr != headPtr)
+            ptr = ptr->next;
+    }
+#else
+    for (Superblock* ptr = headPtr->next; ptr != headPtr; ptr = ptr->next)
+        if (!func(ptr))
+            return;
+#endif // USE_ADDRESS_ORDERED_BUDDY
+}
+
+std::pair<size_t, size_t> BuddyAllocator::Trim(size_t retainBytes, size_t hysteresisBytes) {
+    andi::lock_guard lock{ mtx };
+    // Sum up the resident free memory that can be returned to the system...
+    size_t residentFree = 0;
+    for (uint32_t k = 0; k < Constants::K + 2; k++)
+        for (uint32_t i = 0; i < k; i++) {
+            const size_t size = (size_t(1) << k) - (size_t(1) << i);
+            if (size < Constants::MinTrimSize)
+                continue;
+            forEachFreeSuperblock(k, i, [&](Superblock* ptr) {
+                if (!getInfo(ptr).released)
+                    residentFree += residentBytes(ptr, size);
+                return true;
+            });
+        }
+    if (residentFree <= retainBytes + hysteresisBytes)
+        return { 0, residentFree };
+    // ...and release the largest blocks first, as they need the fewest system calls.
+    // Of the last one only as much is released, as to leave retainBytes resident.
+    size_t released = 0;
+    for (uint32_t k = Constants::K + 2; k-- > 0; )
+        for (uint32_t i = 0; i < k; i++) {
+            const size_t size = (size_t(1) << k) - (size_t(1) << i);
+            if (size < Constants::MinTrimSize)
+                continue;
+            forEachFreeSuperblock(k, i, [&](Superblock* ptr) {
+                if (residentFree <= retainBytes)
+                    return false;
+                if (!getInfo(ptr).released) {
+                    const size_t bytes = releaseResident(ptr, size, residentFree - retainBytes);
+                    released += bytes;
+                    residentFree -= (bytes < residentFree) ? bytes : residentFree;
+                    // Without resident pages the block is all zeroes, except for its links
+                    if (residentFree > retainBytes || residentBytes(ptr, size) == 0)
+                        getInfo(ptr).released = 1;
+                }
+                return true;
+            });
+            if (residentFree <= retainBytes)
+                return { released, residentFree };
+        }
+    return { released, residentFree };
+}
+
+size_t BuddyAllocator::MaxSize() {
+    return Constants::MaxAllocationSize;
+}
+
+bool BuddyAllocator::Contains(void* ptr) const {
+    return ptr >= poolPtr && ptr < (poolPtr + Constants::BuddyAllocatorSize);
+}
+
+void BuddyAllocator::PrintCondition() const {
+#if PROFILE_LOCKS == 1
+    // Taken before locking, so that printing doesn't count as a lock acquisition
+    const andi::lock_stats lockStats = LockStats();
+#endif // PROFILE_LOCKS
+    andi::lock_guard lock{ mtx };
+    std::cout << "Pool address: 0x" << std::hex << (void*)poolPtr << std::dec << "\n";
+    std::cout << "Pool size:  " << Constants::BuddyAllocatorSize << " bytes.\n";
+    std::cout << "Free superblocks of type (k,i):\n";
+    for (uint32_t k = 0; k < Constants::K + 2; k++)
+        for (uint32_t i = 0; i < Constants::K + 1; i++)
+            if (freeCounts[k][i] != 0)
+                std::cout << " (" << k << "," << i << "): " << freeCounts[k][i] << "\n";
+    std::cout << "Free space: " << freeSpace << " bytes.\n";
+    std::cout << "Used space: " << Constants::BuddyAllocatorSize - freeSpace << " bytes.\n";
+    std::cout << "Largest free block: " << LargestFreeBlock() << " bytes.\n";
+    std::cout << "Fragmentation: " << Fragmentation() << "\n";
+#if PROFILE_LOCKS == 1
+    lockStats.print(std::cout);
+#endif // PROFILE_LOCKS
+    std::cout << "\n";
+}
+
+#if PROFILE_LOCKS == 1
+andi::lock_stats BuddyAllocator::LockStats() const {
+    return mtx.stats();
+}
+#endif // PROFILE_LOCKS
+
+size_t BuddyAllocator::FreeSpace() const {
+    return publishedFreeSpace.load(std::memory_order_relaxed);
+}
+
+size_t BuddyAllocator::LargestFreeBlock() const {
+    return publishedLargestBlock.load(std::memory_order_relaxed);
+}
+
+double BuddyAllocator::Fragmentation() const {
+    const size_t free = FreeSpace();
+    return (free == 0) ? 0. : 1. - double(LargestFreeBlock()) / double(free);
+}
+
+size_t BuddyAllocator::LargestFreeBlockBound() const {
+    return LargestFreeBlock();
+}
+
+#if USE_DEFRAGMENTATION == 1
+void BuddyAllocator::MeasureOccupancy(size_t* usedBytes) const {
+    andi::lock_guard lock{ mtx };
+    for (size_t r = 0; r < RegionCount; r++)
+        usedBytes[r] = 0;
+    // The blocks cover the whole pool, each starting right after the previous one
+    for (uintptr_t offset = 0; offset < Constants::BuddyAllocatorSize; ) {
+        Superblock* sblk = fromVirtualOffset(offset);
+        const SuperblockInfo& info = getInfo(sblk);
+        const size_t size = (size_t(1) << info.k) - (size_t(1) << calculateI(sblk));
+        // Allocated blocks are aligned at their size, so a large one covers whole regions
+        if (!info.free && size <= Constants::DefragmentRegionSize)
+            usedBytes[offset / Constants::DefragmentRegionSize] += size;
+        else if (!info.free)
+            for (size_t r = offset / Constants::DefragmentRegionSize; r < (offset + size) / Constants::DefragmentRegionSize; r++)
+                usedBytes[r] = Constants::DefragmentRegionSize;
+        offset += size;
+    }
+}
+#endif // USE_DEFRAGMENTATION
+
+#if HPC_DEBUG == 1 || USE_HARDENING == 1
+bool BuddyAllocator::isAllocatedSuperblock(Superblock* sblk) const {
+    // Addresses inside a block have k == 0 in the table, so a pointer that
+    // was not returned to the user, or was already freed, is always caught.
+    const SuperblockInfo& info = getInfo(sblk);
+    return (info.free == 0
+         && info.k > Constants::MinAllocationSizeLog
+         && info.k <= Constants::K + 1);
+}
+#endif // HPC_DEBUG || USE_HARDENING
+
+void* BuddyAllocator::allocateSuperblock(size_t n, bool& released) {
+    const uint32_t j = calculateJ(n);
+    Superblock* sblk = findFreeSuperblock(j);
+    if (sblk == nullptr)
+        return nullptr;
+    return carveSuperblock(sblk, j, released);
+}
+
+void* BuddyAllocator::carveSuperblock(Superblock* sblk, uint32_t j, bool& released) {
+    // The parts of a released block stay zero, except for their own list links
+    released = getInfo(sblk).released;
+
+    // Remove this super block, we'll add the Superblocks it decomposes to later
+    removeFreeSuperblock(sblk);
+    const uint32_t old_k = getInfo(sblk).k;
+    const uint32_t old_i = calculateI(sblk);
+
+    // In case splitting the block is needed
+    if (old_i > j) {
+        // split into three smaller Superblocks
+        const uint32_t old_released = getInfo(sblk).released;
+        setInfo(sblk, j + 1, 0, 0);
+
+        // update the system info about their existence
+        Superblock* block1 = (Superblock*)(uintptr_t(sblk) + (uintptr_t(1) << j));
+        setInfo(block1, old_i, 1, old_released);
+        insertFreeSuperblock(block1);
+
+        if (old_k != old_i + 1) {
+            Superblock* block2 = (Superblock*)(uintptr_t(sblk) + (uintptr_t(1) << old_i));
+            setInfo(block2, old_k, 1, old_released);
+            insertFreeSuperblock(block2);
+        }
+
+        // In that case, we can simply return sblk
+        markResident(sblk, size_t(1) << j);
+        return sblk;
+    }
+
+    // Calculates where in the Superblock the user address should point to
+    Superblock* addr = (Superblock*)(uintptr_t(sblk) + (uintptr_t(1) << j) - (uintptr_t(1) << old_i));
+    // Mark as a used block & save its k,i
+    const uint32_t old_released = getInfo(sblk).released;
+    setInfo(addr, j + 1, 0, 0);
+
+    // A "left" Superblock may not exist (!)
+    if (j > old_i) {
+        // This means the Superblock found remains free, but we only update its k
+        getInfo(sblk).k = j;
+        // update the system information
+        insertFreeSuperblock(sblk);
+    }
+    // A "right" super block may not be needed, too
+    if (j < old_k - 1) {
+        // Again, mark as free and update its k,i
+        Superblock* rblock = (Superblock*)(uintptr_t(addr) + (uintptr_t(1) << j));
+        setInfo(rblock, old_k, 1, old_released);
+        // update the system info
+        insertFreeSuperblock(rblock);
+    }
+
+    markResident(addr, size_t(1) << j);
+    return addr;
+}
+
+void BuddyAllocator::deallocateSuperblock(Superblock* sblk) {
+    // Marks the Superblock as free and begins to
+    // merge it upwards, recursively
+    setInfo(sblk, getInfo(sblk).k, 1, 0);
+    recursiveMerge(sblk);
+}
+
+void BuddyAllocator::insertFreeSuperblock(Superblock* sblk) {
+    // Add this Superblock to the corresponding list in the table
+    const uint32_t k = getInfo(sblk).k;
+    const uint32_t i = calculateI(sblk);
+#if USE_ADDRESS_ORDERED_BUDDY == 1
+    Superblock* headPtr = &freeBlocks[k][i];
+    sblk->prev = headPtr;
+    sblk->next = headPtr;
+    sblk->child = headPtr;
+    Superblock* root = (headPtr->child == headPtr) ? sblk : linkSuperblocks(headPtr->child, sblk, headPtr);
+    root->prev = headPtr;
+    root->next = headPtr;
+    headPtr->child = root;
+#else
+    sblk->next = freeBlocks[k][i].next;
+    freeBlocks[k][i].next = sblk;
+    sblk->prev = &freeBlocks[k][i]; // == sblk->next->prev
+    sblk->next->prev = sblk;
+#endif // USE_ADDRESS_ORDERED_BUDDY
+    // The links dirty the block's first page
+    markResident(sblk, sizeof(Superblock));
+    // Update the bitvector, that a free Superblock of this size now is sure to exist
+    bitvectors[k] |= (1ui64 << i);
+    leastSetBits[k] = leastSetBit(bitvectors[k]);
+    nonEmptyBitvectors |= (1ui64 << k);
+    // ...and the statistics
+    ++freeCounts[k][i];
+    freeSpace += (size_t(1) << k) - (size_t(1) << i);
+}
+
+void BuddyAllocator::removeFreeSuperblock(Superblock* sblk) {
+    // Remove the Superblock from the system info
+    const uint32_t k = getInfo(sblk).k;
+    const uint32_t i = calculateI(sblk);
+#if USE_ADDRESS_ORDERED_BUDDY == 1
+    // The block's children are merged into one heap, which then takes its place
+    Superblock* headPtr = &freeBlocks[k][i];
+    Superblock* rest = mergeSuperblockPairs(sblk->child, headPtr);
+    Superblock* root = rest;
+    if (sblk != headPtr->child) {
+        // Cut the block's subtree out & merge what was below it back into the heap
+        Superblock* prev = sblk->prev;
+        if (prev->child == sblk)
+            prev->child = sblk->next;
+        else
+            prev->next = sblk->next;
+        if (sblk->next != headPtr)
+            sblk->next->prev = prev;
+        root = (rest == headPtr) ? (Superblock*)headPtr->child : linkSuperblocks(headPtr->child, rest, headPtr);
+    }
+    if (root != headPtr) {
+        root->prev = headPtr;
+        root->next = headPtr;
+    }
+    headPtr->child = root;
+#else
+    sblk->prev->next = sblk->next;
+    sblk->next->prev = sblk->prev;
+    //sblk->next = sblk->prev = nullptr;
+#endif // USE_ADDRESS_ORDERED_BUDDY
+    // If there are no more Superblocks of size (k,i),
+    // indicated by this being the last one counted,
+    // we free the i-th bit of the k-th bitvector
+    if (freeCounts[k][i] == 1) {
+        bitvectors[k] &= ~(1ui64 << i);
+        leastSetBits[k] = leastSetBit(bitvectors[k]);
+        if (bitvectors[k] == 0)
+            nonEmptyBitvectors &= ~(1ui64 << k);
+    }
+    --freeCounts[k][i];
+    freeSpace -= (size_t(1) << k) - (size_t(1) << i);
+}
+
+Superblock* BuddyAllocator::findFreeSuperblock(uint32_t j) const {
+    uint32_t min_i = 64, min_k = 0;
+    // Only look through the non-empty bitvectors for k > j
+    for (uint64_t mask = nonEmptyBitvectors & ~((2ui64 << j) - 1); mask != 0; mask &= mask - 1) {
+        const uint32_t k = leastSetBit(mask);
+        if (leastSetBits[k] < min_i) {
+            min_i = leastSetBits[k];
+            min_k = k;
+        }
+    }
+    if (min_i == 64)
+        return nullptr;
+#if USE_ADDRESS_ORDERED_BUDDY == 1
+    // The heap's root is the block with the lowest address
+    return freeBlocks[min_k][min_i].child;
+#else
+    return freeBlocks[min_k][min_i].next;
+#endif // USE_ADDRESS_ORDERED_BUDDY
+}
+
+#if USE_ADDRESS_ORDERED_BUDDY == 1
+Superblock* BuddyAllocator::linkSuperblocks(Superblock* a, Superblock* b, Superblock* headPtr) {
+    // The heap, whose root has the higher address, becomes the leftmost child of the other one
+    if (b < a)
+        std::swap(a, b);
+    b->next = a->child;
+    if (b->next != headPtr)
+        b->next->prev = b;
+    b->prev = a;
+    a->child = b;
+    return a;
+}
+
+Superblock* BuddyAllocator::mergeSuperblockPairs(Superblock* first, Superblock* headPtr) {
+    // The standard two passes: link the siblings in pairs from left to right,
+    // stacking the results, then link them into one from right to left
+    if (first == headPtr)
+        return headPtr;
+    Superblock* stack = headPtr;
+    while (first != headPtr) {
+        Superblock* a = first;
+        Superblock* b = a->next;
+        if (b == headPtr) {
+            a->next = stack;
+            stack = a;
+            break;
+        }
+        first = b->next;
+        Superblock* pair = linkSuperblocks(a, b, headPtr);
+        pair->next = stack;
+        stack = pair;
+    }
+    Superblock* root = stack;
+    for (stack = stack->next; stack != headPtr; ) {
+        Superblock* next = stack->next;
+        root = linkSuperblocks(root, stack, headPtr);
+        stack = next;
+    }
+    return root;
+}
+#endif // USE_ADDRESS_ORDERED_BUDDY
+
+Superblock* BuddyAllocator::findBuddySuperblock(Superblock* sblk) const {
+    // Finding a Superblock's buddy is as simple as flipping the i+1-st bit of its virtual address
+    return fromVirtualOffset(toVirtualOffset(sblk) ^ (uintptr_t(1) << calculateI(sblk)));
+}
+
+void BuddyAllocator::recursiveMerge(Superblock* sblk) {
+    // Superblocks are merged only if these three conditions hold:
+    // - there is something left to merge (i.e. the pool isn't completely empty)
+    // - the current Superblock's buddy is free
+    // - the buddy has the appropriate size of 2^k-2^i for some k,
+    //   where 2^i is the size of the current block
+    // Otherwise, the block is simply inserted to its corresponding
+    // list, as a normal block of size 2^j for some j
+    Superblock* buddy = findBuddySuperblock(sblk);
+    if ((uintptr_t(sblk) == virtualZero && getInfo(sblk).k == Constants::K + 1) ||
+        getInfo(buddy).free == 0 || calculateI(sblk) != calculateI(buddy)) {
+        insertFreeSuperblock(sblk);
+        return;
+    }
+    // There will be a merge, so we remove the buddy from the system info
+    removeFreeSuperblock(buddy);
+    const uint32_t buddy_k = getInfo(buddy).k;	// старото k
+    // Unite the buddies in a block of size 2^k (again, represented as 2^(k+1) - 2^k)
+    if (buddy < sblk)
+        std::swap(sblk, buddy);
+    // The upper buddy is no longer the start of a block
+    setInfo(buddy, 0, 0, 0);
+    // The freed half is dirty, so the united block isn't released. Which of its pages
+    // are still resident is in residentPages, so Trim() doesn't count the rest.
+    setInfo(sblk, buddy_k + 1, 1, 0);
+    // Merge upwards until possible.
+    recursiveMerge(sblk); // Tail recursion optimization should probably take care of this call.
+}
+
+void BuddyAllocator::publishStatistics() {
+    // The largest free block has the largest k, and for it - the smallest i
+    size_t largest = 0;
+    if (nonEmptyBitvectors != 0) {
+        const uint32_t k = fastlog2(nonEmptyBitvectors);
+        largest = (size_t(1) << k) - (size_t(1) << leastSetBits[k]);
+    }
+    publishedFreeSpace.store(freeSpace, std::memory_order_relaxed);
+    publishedLargestBlock.store(largest, std::memory_order_relaxed);
+}
+
+void BuddyAllocator::markResident(void* ptr, size_t size) {
+    // Most of the pages are already marked, so the words are only read
+    const size_t first = (uintptr_t(ptr) - virtualZero) / Constants::PageSize;
+    const size_t last = (uintptr_t(ptr) - virtualZero + size - 1) / Constants::PageSize;
+    for (size_t w = first / 64; w <= last / 64; w++) {
+        const uint64_t mask = pageMask(w, first, last);
+        if ((residentPages[w] & mask) != mask)
+            residentPages[w] |= mask;
+    }
+}
+
+size_t BuddyAllocator::residentBytes(Superblock* sblk, size_t size) const {
+    const std::pair<size_t, size_t> pages = releasablePages(sblk, size);
+    if (pages.first >= pages.second)
+        return 0;
+    size_t count = 0;
+    for (size_t w = pages.first / 64; w <= (pages.second - 1) / 64; w++)
+        count += popCount(residentPages[w] & pageMask(w, pages.first, pages.second - 1));
+    return count * Constants::PageSize;
+}
+
+size_t BuddyAllocator::releaseResident(Superblock* sblk, size_t size, size_t maxBytes) {
+    // Consecutive resident pages are released together, with a single system call
+    const std::pair<size_t, size_t> pages = releasablePages(sblk, size);
+    size_t released = 0;
+    for (size_t p = pages.second; p > pages.first && released < maxBytes; ) {
+        if (p % 64 == 0 && p - 64 >= pages.first && residentPages[p / 64 - 1] == 0) {
+            p -= 64;
+            continue;
+        }
+        if (!(residentPages[(p - 1) / 64] & (1ui64 << ((p - 1) % 64)))) {
+            --p;
+            continue;
+        }
+        const size_t to = p;
+        for (; p > pages.first && (residentPages[(p - 1) / 64] & (1ui64 << ((p - 1) % 64)))
+               && released + (to - p)*Constants::PageSize < maxBytes; p--)
+            residentPages[(p - 1) / 64] &= ~(1ui64 << ((p - 1) % 64));
+        void* from = (void*)(virtualZero + p*Constants::PageSize);
+        if (sharedPages)
+            andi::page_remove(from, (to - p)*Constants::PageSize);
+        else
+            andi::page_release(from, (to - p)*Constants::PageSize);
+        released += (to - p)*Constants::PageSize;
+    }
+    return released;
+}
+
+std::pair<size_t, size_t> BuddyAllocator::releasablePages(Superblock* sblk, size_t size) const {
+    // Only the whole pages after the list links can be released
+    const uintptr_t offset = toVirtualOffset(sblk);
+    return { (offset + sizeof(Superblock) + Constants::PageSize - 1) / Constants::PageSize,
+             (offset + size) / Constants::PageSize };
+}
+
+uint64_t BuddyAllocator::pageMask(size_t word, size_t first, size_t last) {
+    // The bits of pages [first, last] in the given word of the table
+    uint64_t mask = ~0ui64;
+    if (word == first / 64)
+        mask &= ~0ui64 << (first % 64);
+    if (word == last / 64)
+        mask &= ~0ui64 >> (63 - last % 64);
+    return mask;
+}
+
+void BuddyAllocator::zeroDirtyPages(void* ptr, size_t size, size_t n) {
+    // Only the whole pages after the list links of a released block are sure to be zero
+    const uintptr_t begin = uintptr_t(ptr);
+    const uintptr_t from = (begin + sizeof(Superblock) + Constants::PageSize - 1) & ~uintptr_t(Constants::PageSize - 1);
+    const uintptr_t to = (begin + size) & ~uintptr_t(Constants::PageSize - 1);
+    if (from >= to || from >= begin + n) {
+        std::memset(ptr, 0, n);
+        return;
+    }
+    std::memset(ptr, 0, from - begin);
+    if (begin + n > to)
+        std::memset((void*)to, 0, begin + n - to);
+}
+
+SuperblockInfo& BuddyAllocator::getInfo(Superblock* sblk) const {
+    return blockInfo[toVirtualOffset(sblk) >> Constants::MinAllocationSizeLog];
+}
+
+void BuddyAllocator::setInfo(Superblock* sblk, uint32_t k, uint32_t free, uint32_t released) {
+    SuperblockInfo& info = getInfo(sblk);
+    info.k = k;
+    info.free = free;
+    info.released = released;
+}
+
+uintptr_t BuddyAllocator::toVirtualOffset(Superblock* sblk) const {
+    return uintptr_t(sblk) - virtualZero;
+}
+
+Superblock* BuddyAllocator::fromVirtualOffset(uintptr_t offset) const {
+    vassert(offset % alignof(Superblock) == 0);
+    return (Superblock*)(virtualZero + offset);
+}
+
+uint32_t BuddyAllocator::calculateI(Superblock* sblk) const {
+    return min(leastSetBit(toVirtualOffset(sblk)), getInfo(sblk).k - 1);
+}
+
+uint32_t BuddyAllocator::calculateJ(size_t n) {
+    return max(fastlog2(n - 1) + 1, uint32_t(Constants::MinAllocationSizeLog));
+}
+
+// iei
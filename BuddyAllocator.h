@@ -1,76 +1,170 @@
-#pragma once
-#include "Defines.h"
-#include "Utilities.h"
-
-/*
- - The memory returned to the user is allocated from a large address space (pool)
- with a power of two size (f.e. 4GB). This address space is allocated from the
- system once, on initialization and never changes before deinitialization.
- - The pool's state is cotrolled by a table of Superblocks, in which at
- position (k,i) we keep a list of Superblocks of size 2^k-2^i bytes,
- containing all other free Superblocks of the same size.
- - The free Superblocks of a given size are linked in a doubly-connected
- cyclic (!) linked list, since merging requires removing of a block at a
- random position in its list. Being cyclic and always non-empty alleviates
- some nullptr checks, speeding up adding and removing blocks. The largest
- Superblock captures the entire address space and has size 2^largePoolSizeLog,
- internally represented as 2^(largePoolSizeLog+1) - 2^largePoolSizeLog
- - For each k there is a bitvector, where the i-th bit is toggled iff
- there exists a free Superblock of size 2^k-2^i. They are used to select
- the most proper Superblock size, for a given allocation request.
- - Finally, for each bitvector we keep the lowest toggled bit. This is
- used during searching for a suitable block of memory
-*/
-class BuddyAllocator {
-    // forward declaration...
-    friend class MemoryArena;
-    using byte = uint8_t;
-
-private:
-    Superblock freeBlocks[Constants::K + 2][Constants::K + 1];
-    uint64_t bitvectors[Constants::K + 2];
-    uint32_t leastSetBits[Constants::K + 2];
-    byte* poolPtr;
-    uintptr_t virtualZero;
-    andi::mutex mtx;
-
-    BuddyAllocator(); // no destructor, we rely on Deinitialize
-    void Reset();
-    void Initialize();
-    void Deinitialize();
-
-    void* Allocate(size_t);
-    void Deallocate(void*);
-    std::pair<void*, size_t> AllocateUseful(size_t);
-    static size_t MaxSize();
-    bool Contains(void*) const;
-    void PrintCondition() const;
-#if HPC_DEBUG == 1
-    static void sign(Superblock*);
-    static uint32_t getSignature(Superblock*);
-    static bool isValidSignature(Superblock*);
-#endif // HPC_DEBUG
-
-    void* allocateSuperblock(size_t);
-    void deallocateSuperblock(Superblock*);
-    void insertFreeSuperblock(Superblock*);
-    void removeFreeSuperblock(Superblock*);
-    Superblock* findFreeSuperblock(uint32_t) const;
-    Superblock* findBuddySuperblock(Superblock*) const;
-    void recursiveMerge(Superblock*);
-    static void* toUserAddress(Superblock*);
-    static Superblock* fromUserAddress(void*);
-    uintptr_t toVirtualOffset(Superblock*) const;
-    Superblock* fromVirtualOffset(uintptr_t) const;
-    uint32_t calculateI(Superblock*) const;
-    static uint32_t calculateJ(size_t);
-
-public:
-    // moving or copying of pools is forbidden
-    BuddyAllocator(const BuddyAllocator&) = delete;
-    BuddyAllocator& operator=(const BuddyAllocator&) = delete;
-    BuddyAllocator(BuddyAllocator&&) = delete;
-    BuddyAllocator& operator=(BuddyAllocator&&) = delete;
-};
-
-// iei
+#pragma once
+#include "Defines.h"
+#include "Utilities.h"
+
+/*
+ - The memory returned to the user is allocated from a large address space (pool)
+ with a power of two size (f.e. 4GB). This address space is allocated from the
+ system once, on initialization and never changes before deinitialization.
+ - The pool's state is cotrolled by a table of Superblocks, in which at
+ position (k,i) we keep a list of Superblocks of size 2^k-2^i bytes,
+ containing all other free Superblocks of the same size.
+ - The free Superblocks of a given size are linked in a doubly-connected
+ cyclic (!) linked list, since merging requires removing of a block at a
+ random position in its list. Being cyclic and always non-empty alleviates
+ some nullptr checks, speeding up adding and removing blocks. The largest
+ Superblock captures the entire address space and has size 2^largePoolSizeLog,
+ internally represented as 2^(largePoolSizeLog+1) - 2^largePoolSizeLog
+ - With USE_ADDRESS_ORDERED_BUDDY the free Superblocks of each size form a pairing
+ heap, ordered by address, instead of a list. The lowest free block of the chosen
+ size is then used, instead of the most recently freed one, so the allocations stay
+ packed at the start of the pool & the free space at its end merges into large blocks,
+ that can be trimmed. Inserting is O(1), removing O(log n) amortized. The position's
+ sentinel is the heap's parent & stands in for all the missing links.
+ - For each k there is a bitvector, where the i-th bit is toggled iff
+ there exists a free Superblock of size 2^k-2^i. They are used to select
+ the most proper Superblock size, for a given allocation request.
+ - Finally, for each bitvector we keep the lowest toggled bit. This is
+ used during searching for a suitable block of memory
+ - The number of free Superblocks of each size and their total size are
+ maintained on every insertion & removal. Together with a mask of the non-empty
+ bitvectors they give the free space & the largest free block in O(1), which
+ are published for lock-free reading after every operation.
+ - Each block's k and free flag are kept out-of-band, in a byte table indexed
+ by the block's offset from virtualZero in minimum-size blocks. This way a block
+ needs no header and power-of-two requests fit exactly in their Superblock.
+ - The address space is reserved directly from the system, aligned at its size
+ so that the MemoryArena can quickly find a pointer's owner. The whole pages
+ inside large free Superblocks can be returned to it by Trim(). A bitmap keeps which
+ pages may be resident - they are marked when allocated or written a block's list
+ links to - so that Trim() counts & releases only those. The free blocks, that have
+ no resident pages left, are marked as released, and so are the parts they are
+ later split into.
+ - All addresses in the state (the list links included) are kept relative, so the
+ allocator can also be placed in a shared mapping together with its table & pool,
+ which different processes may map at different addresses (see SharedArena).
+*/
+class BuddyAllocator {
+    // forward declaration...
+    friend class MemoryArena;
+    friend class SlabAllocator;
+    friend class SharedArena;
+    using byte = uint8_t;
+
+private:
+    Superblock freeBlocks[Constants::K + 2][Constants::K + 1];
+    uint64_t bitvectors[Constants::K + 2];
+    uint32_t leastSetBits[Constants::K + 2];
+    uint32_t freeCounts[Constants::K + 2][Constants::K + 1];
+    uint64_t nonEmptyBitvectors;
+    size_t freeSpace;
+    std::atomic<size_t> publishedFreeSpace;
+    std::atomic<size_t> publishedLargestBlock;
+    andi::self_relative<SuperblockInfo*> blockInfo;
+    andi::self_relative<uint64_t*> residentPages;  // one bit per page, set while it may be backed by memory
+    andi::self_relative<byte*> poolPtr;
+    andi::self_relative<uintptr_t> virtualZero;
+    // Set for the shared mappings, whose released pages have to be removed from the file
+    bool sharedPages;
+#if USE_HARDENING == 1
+    // Set when the invalid frees have to be caught & reported (see MemoryArena::SetHardening)
+    bool hardened;
+#endif // USE_HARDENING
+    mutable andi::mutex mtx;
+
+    BuddyAllocator(); // no destructor, we rely on Deinitialize
+    void Reset();
+    bool Initialize(bool hardening = false);
+    void Deinitialize();
+
+    void* Allocate(size_t);
+    // Also tells whether the block has been released, i.e. all its whole pages
+    // after the first sizeof(Superblock) bytes are known to contain only zeroes
+    void* Allocate(size_t, bool& released);
+    // Zeroes only the parts of the block, that are not known to be zero already
+    void* AllocateZeroed(size_t);
+#if USE_DEFRAGMENTATION == 1
+    // Allocates the lowest block, that can fit n bytes, if it ends before limit. Walks the free lists.
+    void* AllocateBelow(size_t n, void* limit);
+#endif // USE_DEFRAGMENTATION
+    void Deallocate(void*);
+#if USE_HARDENING == 1
+    // Whether Deallocate() would accept the pointer - checked without locking, so it's exact
+    // only for the caller's own block, whose entry in the table cannot change meanwhile. Two
+    // threads freeing the same block may both see it allocated (see MemoryArena::acceptsFree).
+    bool IsAllocated(void*) const;
+#endif // USE_HARDENING
+    std::pair<void*, size_t> AllocateUseful(size_t);
+    size_t UsefulSize(void*) const;
+    // The size of the block, that a request for n bytes gets
+    static size_t GoodSize(size_t);
+    // Returns the pages of free Superblocks to the system, until no more than retainBytes
+    // of free memory remain resident. Does nothing if the resident free memory does not
+    // exceed retainBytes + hysteresisBytes. Returns { released, retained } bytes.
+    std::pair<size_t, size_t> Trim(size_t, size_t);
+    static size_t MaxSize();
+    bool Contains(void*) const;
+    void PrintCondition() const;
+#if PROFILE_LOCKS == 1
+    andi::lock_stats LockStats() const;
+#endif // PROFILE_LOCKS
+    // Occupancy statistics - these are lock-free and O(1), but may lag behind by an operation
+    size_t FreeSpace() const;
+    size_t LargestFreeBlock() const;
+    // 0 when all the free space is in a single block, approaching 1 as it gets scattered
+    double Fragmentation() const;
+    // The same as LargestFreeBlock() here - the lock-free engine can only bound it in O(1)
+    size_t LargestFreeBlockBound() const;
+#if USE_DEFRAGMENTATION == 1
+    static constexpr size_t RegionCount = Constants::BuddyAllocatorSize / Constants::DefragmentRegionSize;
+    // Stores the allocated bytes in each DefragmentRegionSize region of the pool to usedBytes,
+    // which has room for RegionCount counters. Walks all the blocks, under the lock.
+    void MeasureOccupancy(size_t* usedBytes) const;
+#endif // USE_DEFRAGMENTATION
+#if HPC_DEBUG == 1 || USE_HARDENING == 1
+    bool isAllocatedSuperblock(Superblock*) const;
+#endif // HPC_DEBUG || USE_HARDENING
+
+    // Sets up the state for a pool & zero-initialized tables, that are already mapped
+    void format(byte*, SuperblockInfo*, uint64_t*);
+    void* allocateSuperblock(size_t, bool&);
+    // Takes a block of 2^j bytes from the free Superblock, splitting off the rest
+    void* carveSuperblock(Superblock*, uint32_t, bool&);
+    void deallocateSuperblock(Superblock*);
+    void insertFreeSuperblock(Superblock*);
+    void removeFreeSuperblock(Superblock*);
+    Superblock* findFreeSuperblock(uint32_t) const;
+    // Calls the function for the free Superblocks of size (k,i) until it returns false
+    template<class Func>
+    void forEachFreeSuperblock(uint32_t, uint32_t, Func);
+#if USE_ADDRESS_ORDERED_BUDDY == 1
+    static Superblock* linkSuperblocks(Superblock*, Superblock*, Superblock*);
+    static Superblock* mergeSuperblockPairs(Superblock*, Superblock*);
+#endif // USE_ADDRESS_ORDERED_BUDDY
+    Superblock* findBuddySuperblock(Superblock*) const;
+    void recursiveMerge(Superblock*);
+    void publishStatistics();
+    void markResident(void*, size_t);
+    // The resident bytes in the whole pages of a free Superblock after its list links
+    size_t residentBytes(Superblock*, size_t) const;
+    // Releases those pages from the Superblock's end until at least maxBytes are released
+    size_t releaseResident(Superblock*, size_t, size_t maxBytes);
+    std::pair<size_t, size_t> releasablePages(Superblock*, size_t) const;
+    static uint64_t pageMask(size_t word, size_t first, size_t last);
+    static void zeroDirtyPages(void*, size_t, size_t);
+    SuperblockInfo& getInfo(Superblock*) const;
+    void setInfo(Superblock*, uint32_t, uint32_t, uint32_t);
+    uintptr_t toVirtualOffset(Superblock*) const;
+    Superblock* fromVirtualOffset(uintptr_t) const;
+    uint32_t calculateI(Superblock*) const;
+    static uint32_t calculateJ(size_t);
+
+public:
+    // moving or copying of pools is forbidden
+    BuddyAllocator(const BuddyAllocator&) = delete;
+    BuddyAllocator& operator=(const BuddyAllocator&) = delete;
+    BuddyAllocator(BuddyAllocator&&) = delete;
+    BuddyAllocator& operator=(BuddyAllocator&&) = delete;
+};
+
+// iei
@@ -1,45 +1,114 @@
-#pragma once
-// These definitions control the allocator behaviour (see README.md)
-#define HPC_DEBUG 1
-#define USE_POOL_ALLOCATORS 1
-
-#include "Utilities.h"
-
-enum Constants : size_t {
-    // Minimum alignment for allocation requests
-    Alignment = 32,
-    // Logarithm of the buddy allocator address space size in bytes
-    K = (sizeof(void*) == 8) ? 31 : 29,
-    // The buddy allocators need to have their size a power of 2:
-    // 2GB in 64-bit mode, 512MB in 32-bit
-    BuddyAllocatorSize = size_t(1) << K,
-    // Superblock header size, in bytes
-    HeaderSize = sizeof(SuperblockHeader),
-    // Invalid block index for the small pools
-    InvalidIdx = ~size_t(0),
-    // Logarithm of the smallest allocation size, in bytes
-    MinAllocationSizeLog = 5,
-    // Minimum allocation size, in bytes
-    MinAllocationSize = size_t(1) << MinAllocationSizeLog,
-    // The upper limit for a single allocation
-    MaxAllocationSize = (Constants::BuddyAllocatorSize / 4) - Constants::HeaderSize,
-    // Number of blocks in the fixed-size pools:
-    PoolSize0 = 1'500'000, //   32B
-    PoolSize1 = 1'500'000, //   64B
-    PoolSize2 =   500'000, //  128B
-    PoolSize3 =   250'000, //  256B
-    PoolSize4 =   200'000, //  512B
-    PoolSize5 =   200'000, // 1024B
-};
-// Scoped enums are nice, but require overly verbose conversions to the underlying type...
-
-// Sanity checks for global constants' validity
-static_assert(Constants::HeaderSize < Constants::Alignment);
-static_assert(Constants::Alignment % alignof(Superblock) == 0); // virtualZero should be a valid Superblock address
-static_assert(Constants::K <= 63); // we want (2^largePoolSizeLog) to fit in 64 bits
-static_assert(Constants::HeaderSize < Constants::MinAllocationSize); // otherwise headers overlap and mayhem ensues
-static_assert(Constants::MinAllocationSizeLog >= 5
-           && Constants::MinAllocationSizeLog <= Constants::K);
-static_assert(Constants::MaxAllocationSize <= Constants::BuddyAllocatorSize
-           && Constants::MaxAllocationSize + Constants::HeaderSize <= 0x1'0000'0000ui64);
-static_assert(offsetof(Superblock, prev) == Constants::HeaderSize); // fun fact: this causes undefined behaviour
+#pragma once
+// These definitions control the allocator behaviour (see README.md)
+#define HPC_DEBUG 1
+#define USE_POOL_ALLOCATORS 1
+#define USE_SLAB_ALLOCATOR 1
+#define PROFILE_LOCKS 0
+#define USE_LOCKFREE_BUDDY 0
+#define USE_HANDLE_SPACE 1
+#define USE_ADDRESS_ORDERED_BUDDY 0
+#define PROFILE_HEAP 0
+#define USE_ALLOCATION_TAGS 0
+#define USE_HARDENING 1
+#define USE_DEFRAGMENTATION 1
+
+#include "Utilities.h"
+
+enum Constants : size_t {
+    // Minimum alignment for allocation requests, except for the smallest pools,
+    // whose blocks are aligned at their size (and so, at the size of any object in them)
+    Alignment = 32,
+    // Logarithm of the buddy allocator address space size in bytes
+    K = (sizeof(void*) == 8) ? 31 : 29,
+    // The buddy allocators need to have their size a power of 2:
+    // 2GB in 64-bit mode, 512MB in 32-bit
+    BuddyAllocatorSize = size_t(1) << K,
+    // System page size, in bytes
+    PageSize = 4096,
+    // Free buddy blocks smaller than this are never returned to the system
+    MinTrimSize = 64 * 1024,
+    // Logarithm of the smallest allocation size, in bytes
+    MinAllocationSizeLog = 5,
+    // Minimum allocation size, in bytes
+    MinAllocationSize = size_t(1) << MinAllocationSizeLog,
+    // The upper limit for a single buddy allocation, larger ones are mapped directly from the system
+    MaxAllocationSize = Constants::BuddyAllocatorSize / 4,
+    // The upper limit for a single allocation at all
+    MaxHugeAllocationSize = (~size_t(0) >> 1) - Constants::PageSize,
+    // The number of buddy allocators, created on initialization, and the most the arena can grow to
+    InitialBuddyAllocators = 2,
+    MaxBuddyAllocators = (sizeof(void*) == 8) ? 64 : 4,
+    // Size of the buddy allocators' out-of-band metadata table: one byte per minimum-size block
+    SuperblockInfoSize = (Constants::BuddyAllocatorSize >> Constants::MinAllocationSizeLog) * sizeof(SuperblockInfo),
+    // ...and of their residency table: one bit per page, set while the page may be backed by memory
+    ResidencyTableSize = (Constants::BuddyAllocatorSize / Constants::PageSize) / 8,
+    // Default settings for the background scavenger: how often it wakes up (in ms),
+    // how much free memory it leaves resident, and how much more is tolerated before trimming
+    ScavengerInterval = 1000,
+    ScavengerRetainedBytes = 64 * 1024 * 1024,
+    ScavengerHysteresisBytes = 32 * 1024 * 1024,
+    // Default settings for the background refiller: how often it wakes up (in ms), and the free
+    // memory of each pool & slab class, below which it's refilled & above which it's trimmed
+    RefillerInterval = 10,
+    RefillerLowWatermark = 256 * 1024,
+    RefillerHighWatermark = 16 * 1024 * 1024,
+    // How far above the high watermark the free memory may get, so that it isn't trimmed on every tick
+    RefillerHysteresisBytes = 4 * 1024 * 1024,
+    // Heap profiling (PROFILE_HEAP): on average one allocation per this many bytes is sampled,
+    // at most this many samples are live & this many distinct stacks recorded at once
+    HeapProfileInterval = 512 * 1024,
+    HeapProfileMaxSamples = 1 << 16,
+    HeapProfileMaxStacks = 1 << 14,
+    HeapProfileStackDepth = 32,
+    // Logarithm of the size of the filter, that spares most deallocations the profiler's lock
+    HeapProfileFilterSizeLog = 18,
+    // Allocation tags (USE_ALLOCATION_TAGS): their number, and the balance each thread
+    // accumulates in a tag, before adding it to the tag's shared counter
+    MaxAllocationTags = 64,
+    AllocationTagFlushBytes = 64 * 1024,
+    // Defragmentation (USE_DEFRAGMENTATION): the most relocatable allocations tracked at once, and
+    // the regions, in which the buddy allocators' occupancy is measured. The regions & pool pages,
+    // no more than this many percent of which are in use, are sparse & get emptied.
+    MaxRelocatableAllocations = 1 << 18,
+    DefragmentRegionSize = 1024 * 1024,
+    DefragmentMaxOccupancy = 25,
+    // Logarithm of the slab size in bytes - slabs are carved from a dedicated buddy allocator
+    SlabSizeLog = 20,
+    SlabSize = size_t(1) << SlabSizeLog,
+    // The slab allocator serves sizes in (MinSlabAllocationSize, MaxSlabAllocationSize] with
+    // 4 size classes per power of two: 1280, 1536, 1792, 2048, 2560, ..., 65536 bytes.
+    MinSlabAllocationSize = 1024,
+    MaxSlabAllocationSize = 64 * 1024,
+    SlabClassCount = 4 * 6,
+    // Number of blocks in the fixed-size pools:
+    PoolSize0 = 2'000'000, //    8B
+    PoolSize1 = 2'000'000, //   16B
+    PoolSize2 = 1'500'000, //   32B
+    PoolSize3 = 1'500'000, //   64B
+    PoolSize4 =   500'000, //  128B
+    PoolSize5 =   250'000, //  256B
+    PoolSize6 =   200'000, //  512B
+    PoolSize7 =   200'000, // 1024B
+};
+// Scoped enums are nice, but require overly verbose conversions to the underlying type...
+
+// Sanity checks for global constants' validity
+static_assert(Constants::Alignment % alignof(Superblock) == 0); // virtualZero should be a valid Superblock address
+static_assert(Constants::K <= 63); // we want (2^largePoolSizeLog) to fit in 64 bits
+static_assert(Constants::K + 1 < (1 << 6)); // k should fit in SuperblockInfo
+static_assert(sizeof(Superblock) <= Constants::MinAllocationSize); // free blocks should fit their list links
+static_assert(Constants::MinAllocationSizeLog >= 5
+           && Constants::MinAllocationSizeLog <= Constants::K);
+static_assert(Constants::MaxAllocationSize <= Constants::BuddyAllocatorSize
+           && Constants::MaxAllocationSize <= 0x1'0000'0000ui64);
+static_assert(sizeof(SuperblockInfo) == 1);
+static_assert(Constants::MinSlabAllocationSize << (Constants::SlabClassCount / 4) == Constants::MaxSlabAllocationSize);
+static_assert(Constants::SlabSize >= 8 * Constants::MaxSlabAllocationSize // each slab should fit at least a few objects
+           && Constants::SlabSize <= Constants::MaxAllocationSize);
+static_assert(Constants::MinTrimSize >= 2 * Constants::PageSize); // each trimmed block should have some whole pages
+static_assert(Constants::InitialBuddyAllocators >= 1
+           && Constants::InitialBuddyAllocators <= Constants::MaxBuddyAllocators);
+static_assert(!(Constants::DefragmentRegionSize & (Constants::DefragmentRegionSize - 1)) // the regions should be aligned blocks
+           && Constants::DefragmentRegionSize >= Constants::PageSize
+           && Constants::DefragmentRegionSize <= Constants::BuddyAllocatorSize);
+static_assert(Constants::DefragmentMaxOccupancy < 100);
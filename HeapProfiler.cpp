@@ -0,0 +1,194 @@
+#include "HeapProfiler.h"
+#include <chrono>
+#include <cmath>   // std::log
+#include <cstring> // std::memcmp
+#include <fstream>
+
+#if PROFILE_HEAP == 1
+HeapProfiler::HeapProfiler() {
+    Reset();
+}
+
+void HeapProfiler::Reset() {
+    samples = nullptr;
+    stacks = nullptr;
+    filter = nullptr;
+    liveSamples = 0;
+    usedStacks = 0;
+    droppedSamples = 0;
+}
+
+bool HeapProfiler::Initialize() {
+    andi::lock_guard lock{ mtx };
+    // All the tables start zeroed, i.e. empty
+    samples = (Sample*)andi::page_alloc(SampleSlots*sizeof(Sample));
+    stacks = (Stack*)andi::page_alloc(StackSlots*sizeof(Stack));
+    filter = (std::atomic<uint8_t>*)andi::page_alloc(FilterSize*sizeof(std::atomic<uint8_t>));
+    if (!samples || !stacks || !filter) {
+        if (samples)
+            andi::page_free(samples, SampleSlots*sizeof(Sample));
+        if (stacks)
+            andi::page_free(stacks, StackSlots*sizeof(Stack));
+        if (filter)
+            andi::page_free(filter, FilterSize*sizeof(std::atomic<uint8_t>));
+        Reset();
+        return false;
+    }
+    liveSamples = 0;
+    usedStacks = 0;
+    droppedSamples = 0;
+    return true;
+}
+
+void HeapProfiler::Deinitialize() {
+    andi::lock_guard lock{ mtx };
+    // Nothing is reserved, if the initialization has failed
+    if (samples == nullptr)
+        return;
+    andi::page_free(samples, SampleSlots*sizeof(Sample));
+    andi::page_free(stacks, StackSlots*sizeof(Stack));
+    andi::page_free(filter, FilterSize*sizeof(std::atomic<uint8_t>));
+    Reset();
+}
+
+void HeapProfiler::Dump(std::ostream& os) const {
+    {
+        andi::lock_guard lock{ mtx };
+        uint64_t liveObjects = 0, liveBytes = 0, totalObjects = 0, totalBytes = 0;
+        for (size_t s = 0; s < StackSlots; s++) {
+            liveObjects += stacks[s].liveObjects;
+            liveBytes += stacks[s].liveBytes;
+            totalObjects += stacks[s].totalObjects;
+            totalBytes += stacks[s].totalBytes;
+        }
+        // The figures are the sampled ones - pprof scales them by the sampling interval
+        os << "heap profile: " << liveObjects << ": " << liveBytes << " [" << totalObjects << ": "
+           << totalBytes << "] @ heap_v2/" << size_t(Constants::HeapProfileInterval) << "\n";
+        for (size_t s = 0; s < StackSlots; s++) {
+            const Stack& stack = stacks[s];
+            if (stack.hash == 0)
+                continue;
+            os << stack.liveObjects << ": " << stack.liveBytes << " ["
+               << stack.totalObjects << ": " << stack.totalBytes << "] @" << std::hex;
+            for (uint32_t f = 0; f < stack.depth; f++)
+                os << " 0x" << uintptr_t(stack.frames[f]);
+            os << std::dec << "\n";
+        }
+    }
+    // The mappings let pprof find the binary & the libraries the addresses belong to
+    os << "\nMAPPED_LIBRARIES:\n";
+#if !defined(_MSC_VER)
+    std::ifstream maps{ "/proc/self/maps" };
+    os << maps.rdbuf();
+#endif
+}
+
+void HeapProfiler::PrintCondition() const {
+    andi::lock_guard lock{ mtx };
+    std::cout << "HeapProfiler: " << liveSamples << " live samples, " << usedStacks << " stacks, "
+              << droppedSamples << " samples dropped\n";
+}
+
+void HeapProfiler::sampleAllocation(void* ptr, size_t n) {
+    // A new thread draws its first distance without sampling, as it has no random state yet
+    const bool started = (randomState != 0);
+    bytesUntilSample = nextSampleDistance();
+    if (!started || ptr == nullptr)
+        return;
+    // The profiler's own frames are skipped, the first one is the arena's method
+    void* frames[Constants::HeapProfileStackDepth];
+    const uint32_t depth = uint32_t(andi::capture_stack(frames, Constants::HeapProfileStackDepth, 1));
+
+    andi::lock_guard lock{ mtx };
+    const uint32_t s = (liveSamples < Constants::HeapProfileMaxSamples) ? findStack(frames, depth) : InvalidStackIdx;
+    if (s == InvalidStackIdx) {
+        ++droppedSamples;
+        return;
+    }
+    Stack& stack = stacks[s];
+    ++stack.liveObjects;
+    stack.liveBytes += n;
+    ++stack.totalObjects;
+    stack.totalBytes += n;
+    size_t idx = sampleIndex(uintptr_t(ptr));
+    while (samples[idx].ptr != 0)
+        idx = (idx + 1) & (SampleSlots - 1);
+    samples[idx] = { uintptr_t(ptr), n, s };
+    ++liveSamples;
+    // A saturated counter stays so, its frees just always look the sample up
+    std::atomic<uint8_t>& count = filter[filterIndex(ptr)];
+    if (count.load(std::memory_order_relaxed) != 0xFF)
+        count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
+
+void HeapProfiler::removeSample(void* ptr) {
+    andi::lock_guard lock{ mtx };
+    size_t idx = sampleIndex(uintptr_t(ptr));
+    while (samples[idx].ptr != uintptr_t(ptr)) {
+        if (samples[idx].ptr == 0)
+            return; // the filter gave a false positive
+        idx = (idx + 1) & (SampleSlots - 1);
+    }
+    Stack& stack = stacks[samples[idx].stack];
+    --stack.liveObjects;
+    stack.liveBytes -= samples[idx].size;
+    --liveSamples;
+    std::atomic<uint8_t>& count = filter[filterIndex(ptr)];
+    if (count.load(std::memory_order_relaxed) != 0xFF)
+        count.store(count.load(std::memory_order_relaxed) - 1, std::memory_order_relaxed);
+    // Backward-shift deletion: the following entries, which may move into the
+    // hole without passing their home slot, do so. No tombstones are needed.
+    size_t hole = idx;
+    for (size_t next = (hole + 1) & (SampleSlots - 1); samples[next].ptr != 0; next = (next + 1) & (SampleSlots - 1)) {
+        const size_t home = sampleIndex(samples[next].ptr);
+        if (((next - home) & (SampleSlots - 1)) >= ((next - hole) & (SampleSlots - 1))) {
+            samples[hole] = samples[next];
+            hole = next;
+        }
+    }
+    samples[hole].ptr = 0;
+}
+
+int64_t HeapProfiler::nextSampleDistance() {
+    // xorshift64*, seeded from the thread's address & the time
+    if (randomState == 0)
+        randomState = (uintptr_t(&randomState) ^ uint64_t(std::chrono::steady_clock::now().time_since_epoch().count())) | 1;
+    randomState ^= randomState >> 12;
+    randomState ^= randomState << 25;
+    randomState ^= randomState >> 27;
+    // Exponentially distributed, since the distances between the sampled bytes are geometric
+    const double u = double(((randomState * 0x2545F4914F6CDD1Dui64) >> 11) + 1) / double(1ui64 << 53);
+    return int64_t(-std::log(u) * double(Constants::HeapProfileInterval));
+}
+
+uint32_t HeapProfiler::findStack(void* const* frames, uint32_t depth) {
+    // FNV-1a over the frames; 0 marks the empty slots
+    uint64_t hash = 0xCBF29CE484222325ui64;
+    for (uint32_t f = 0; f < depth; f++)
+        hash = (hash ^ uintptr_t(frames[f])) * 0x100000001B3ui64;
+    hash |= 1;
+    size_t idx = size_t(hash) & (StackSlots - 1);
+    for (; stacks[idx].hash != 0; idx = (idx + 1) & (StackSlots - 1))
+        if (stacks[idx].hash == hash && stacks[idx].depth == depth
+            && std::memcmp(stacks[idx].frames, frames, depth*sizeof(void*)) == 0)
+            return uint32_t(idx);
+    if (usedStacks == Constants::HeapProfileMaxStacks)
+        return InvalidStackIdx;
+    Stack& stack = stacks[idx];
+    stack.hash = hash;
+    stack.depth = depth;
+    std::memcpy(stack.frames, frames, depth*sizeof(void*));
+    ++usedStacks;
+    return uint32_t(idx);
+}
+
+size_t HeapProfiler::filterIndex(const void* ptr) {
+    return size_t((uint64_t(uintptr_t(ptr)) * 0x9E3779B97F4A7C15ui64) >> (64 - Constants::HeapProfileFilterSizeLog));
+}
+
+size_t HeapProfiler::sampleIndex(uintptr_t ptr) {
+    return size_t((uint64_t(ptr) * 0xC2B2AE3D27D4EB4Fui64) >> 32) & (SampleSlots - 1);
+}
+#endif // PROFILE_HEAP
+
+// iei
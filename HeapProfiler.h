@@ -0,0 +1,96 @@
+#pragma once
+#include "Defines.h"
+#include "Utilities.h"
+
+/*
+ - A sampling heap profiler, telling which call sites own the arena's memory. It
+ is compiled in only with PROFILE_HEAP, and each arena has its own.
+ - On average one allocation per HeapProfileInterval bytes is sampled: every thread
+ counts down the bytes it allocates, and when the counter goes below zero, the
+ allocation that crossed it is sampled & the next distance is drawn from an
+ exponential distribution. Large allocations are then sampled proportionally more
+ often, and the unsampled ones cost a single thread-local subtraction.
+ - The sampled allocation's stack is captured and looked up in a table of stacks,
+ which accumulate the live & the total sampled objects & bytes. The live samples
+ are kept in an open-addressing hash table, keyed by address.
+ - On deallocation, a counting filter indexed by a hash of the address tells
+ whether it may have been sampled at all, so that most frees need only a byte
+ load. Only the others take the profiler's lock.
+ - The tables have fixed capacities and are reserved from the system on
+ initialization, so the profiler never allocates from the arena it observes.
+ Samples, that don't fit anymore, are dropped & counted.
+ - The profile is written in the legacy pprof heap format: pprof scales the samples
+ back to the estimated totals, and symbolizes the stacks with the binary.
+*/
+#if PROFILE_HEAP == 1
+class HeapProfiler {
+    // forward declaration...
+    friend class MemoryArena;
+
+    struct Sample {
+        uintptr_t ptr; // 0 for an empty slot
+        size_t size;
+        uint32_t stack;
+    };
+    struct Stack {
+        uint64_t hash;  // 0 for an empty slot
+        uint32_t depth;
+        uint64_t liveObjects;
+        uint64_t liveBytes;
+        uint64_t totalObjects;
+        uint64_t totalBytes;
+        void* frames[Constants::HeapProfileStackDepth];
+    };
+    static constexpr size_t SampleSlots = 2 * Constants::HeapProfileMaxSamples;
+    static constexpr size_t StackSlots = 2 * Constants::HeapProfileMaxStacks;
+    static constexpr size_t FilterSize = size_t(1) << Constants::HeapProfileFilterSizeLog;
+    static constexpr uint32_t InvalidStackIdx = ~uint32_t(0);
+    static_assert(Constants::HeapProfileMaxStacks < InvalidStackIdx);
+
+    // Bytes left until the thread's next sample. A new thread samples nothing
+    // until its first distance is drawn.
+    inline static thread_local int64_t bytesUntilSample = 0;
+    inline static thread_local uint64_t randomState = 0;
+
+    Sample* samples;
+    Stack* stacks;
+    std::atomic<uint8_t>* filter;
+    size_t liveSamples;
+    size_t usedStacks;
+    uint64_t droppedSamples;
+    mutable andi::mutex mtx;
+
+    HeapProfiler(); // no destructor, we rely on Deinitialize
+    void Reset();
+    bool Initialize();
+    void Deinitialize();
+
+    void RecordAllocation(void* ptr, size_t n) {
+        if ((bytesUntilSample -= int64_t(n)) < 0)
+            sampleAllocation(ptr, n);
+    }
+    void RecordDeallocation(void* ptr) {
+        if (ptr != nullptr && filter[filterIndex(ptr)].load(std::memory_order_relaxed) != 0)
+            removeSample(ptr);
+    }
+    // Writes the live & the total samples by stack, in the legacy pprof heap format
+    void Dump(std::ostream&) const;
+    void PrintCondition() const;
+
+    void sampleAllocation(void*, size_t);
+    void removeSample(void*);
+    static int64_t nextSampleDistance();
+    uint32_t findStack(void* const*, uint32_t);
+    static size_t filterIndex(const void*);
+    static size_t sampleIndex(uintptr_t);
+
+public:
+    // moving or copying of profilers is forbidden
+    HeapProfiler(const HeapProfiler&) = delete;
+    HeapProfiler& operator=(const HeapProfiler&) = delete;
+    HeapProfiler(HeapProfiler&&) = delete;
+    HeapProfiler& operator=(HeapProfiler&&) = delete;
+};
+#endif // PROFILE_HEAP
+
+// iei
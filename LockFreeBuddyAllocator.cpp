@@ -0,0 +1,437 @@
+#include "LockFreeBuddyAllocator.h"
+#include <cstring> // std::memset
+
+// Each thread starts searching for free nodes from a different part of the
+// address space, so that threads rarely compete for the same subtrees
+static constexpr uint32_t SearchRegions = 16;
+static std::atomic<uint32_t> nextSearchRegion{ 0 };
+static thread_local const uint32_t searchRegion = nextSearchRegion.fetch_add(1, std::memory_order_relaxed) % SearchRegions;
+
+LockFreeBuddyAllocator::LockFreeBuddyAllocator() {
+    Reset();
+}
+
+void LockFreeBuddyAllocator::Reset() {
+    tree = nullptr;
+    leafDepths = nullptr;
+    residentGranules = nullptr;
+    freeSpace = 0;
+    poolPtr = nullptr;
+#if USE_HARDENING == 1
+    hardened = false;
+#endif // USE_HARDENING
+}
+
+bool LockFreeBuddyAllocator::Initialize([[maybe_unused]] bool hardening) {
+    // Allocate the pool address space and the (zero-initialized) tables - all nodes are free
+    poolPtr = (byte*)andi::page_alloc_aligned(Constants::BuddyAllocatorSize, Constants::BuddyAllocatorSize);
+    tree = (std::atomic<byte>*)andi::page_alloc(NodeCount);
+    leafDepths = (std::atomic<byte>*)andi::page_alloc(LeafCount);
+    residentGranules = (std::atomic<byte>*)andi::page_alloc(GranuleCount);
+    if (!poolPtr || !tree || !leafDepths || !residentGranules) {
+        Deinitialize();
+        return false;
+    }
+    freeSpace = Constants::BuddyAllocatorSize;
+#if USE_HARDENING == 1
+    hardened = hardening;
+#endif // USE_HARDENING
+    return true;
+}
+
+void LockFreeBuddyAllocator::Deinitialize() {
+    if (poolPtr)
+        andi::page_free(poolPtr, Constants::BuddyAllocatorSize);
+    if (tree)
+        andi::page_free(tree, NodeCount);
+    if (leafDepths)
+        andi::page_free(leafDepths, LeafCount);
+    if (residentGranules)
+        andi::page_free(residentGranules, GranuleCount);
+    Reset();
+}
+
+void* LockFreeBuddyAllocator::Allocate(size_t n) {
+    return allocateBlock(n, false);
+}
+
+void* LockFreeBuddyAllocator::AllocateZeroed(size_t n) {
+    return allocateBlock(n, true);
+}
+
+#if USE_DEFRAGMENTATION == 1
+void* LockFreeBuddyAllocator::AllocateBelow(size_t n, void* limit) {
+    return allocateBlock(n, false, (byte*)limit - poolPtr);
+}
+#endif // USE_DEFRAGMENTATION
+
+void* LockFreeBuddyAllocator::allocateBlock(size_t n, bool zeroed, size_t limitOffset) {
+    if (n > MaxSize())
+        return nullptr;
+    const uint32_t d = calculateDepth(n);
+    const size_t size = nodeSize(d);
+    // Don't even search, if the request surely cannot fit
+    if (freeSpace.load(std::memory_order_relaxed) < size)
+        return nullptr;
+    // Each thread starts searching from its own part of the address space, unless the
+    // block has to be below the limit - then the lowest free one is taken
+    const size_t first = size_t(1) << d;
+    const size_t below = limitOffset >> (Constants::K - d);
+    const size_t node = (below >= first)
+        ? allocateNode(d, (first * searchRegion) / SearchRegions, first)
+        : allocateNode(d, 0, below);
+    if (node == 0)
+        return nullptr;
+    freeSpace.fetch_sub(size, std::memory_order_relaxed);
+    byte* ptr = nodeAddress(node);
+    const size_t offset = ptr - poolPtr;
+    leafDepths[offset >> LeafSizeLog].store(byte(d + 1), std::memory_order_relaxed);
+    // The granules have to be checked before they're marked
+    if (zeroed)
+        zeroResident(offset, n);
+    markResident(offset, size);
+    return ptr;
+}
+
+void LockFreeBuddyAllocator::Deallocate(void* ptr) {
+#if USE_HARDENING == 1
+    // A block starts at a page with its depth recorded, which is cleared once it's freed
+    if (hardened && uintptr_t(ptr) % Constants::PageSize != 0) {
+        andi::report_corruption(andi::corruption::misaligned_free, ptr, "LockFreeBuddyAllocator");
+        return;
+    }
+    if (hardened && leafDepths[((byte*)ptr - poolPtr) >> LeafSizeLog].load(std::memory_order_relaxed) == 0) {
+        andi::report_corruption(andi::corruption::invalid_free, ptr, "LockFreeBuddyAllocator");
+        return;
+    }
+#endif // USE_HARDENING
+    vassert((uintptr_t(ptr) % Constants::PageSize == 0)
+        && "MemoryArena: Attempting to free a non-aligned pointer!");
+    const size_t offset = (byte*)ptr - poolPtr;
+    const byte leafDepth = leafDepths[offset >> LeafSizeLog].load(std::memory_order_relaxed);
+    vassert(leafDepth != 0
+        && "MemoryArena: Pointer is either already freed or is not the one, returned to user!\n");
+    const uint32_t d = leafDepth - 1;
+    leafDepths[offset >> LeafSizeLog].store(0, std::memory_order_relaxed);
+    const size_t node = (size_t(1) << d) + (offset >> (Constants::K - d));
+    vassert((tree[node].load() & OCC) && "MemoryArena: Freeing a block, that is not allocated!");
+    // The space is counted as free before it actually is, so that it's never underestimated
+    freeSpace.fetch_add(nodeSize(d), std::memory_order_relaxed);
+    freeNode(node, 0);
+}
+
+#if USE_HARDENING == 1
+bool LockFreeBuddyAllocator::IsAllocated(void* ptr) const {
+    return !hardened
+        || (uintptr_t(ptr) % Constants::PageSize == 0
+            && leafDepths[((byte*)ptr - poolPtr) >> LeafSizeLog].load(std::memory_order_relaxed) != 0);
+}
+#endif // USE_HARDENING
+
+std::pair<void*, size_t> LockFreeBuddyAllocator::AllocateUseful(size_t n) {
+    void* ptr = Allocate(n);
+    if (ptr == nullptr)
+        return { nullptr, 0 };
+    return { ptr, UsefulSize(ptr) };
+}
+
+size_t LockFreeBuddyAllocator::UsefulSize(void* ptr) const {
+    return nodeSize(leafDepths[((byte*)ptr - poolPtr) >> LeafSizeLog].load(std::memory_order_relaxed) - 1);
+}
+
+size_t LockFreeBuddyAllocator::GoodSize(size_t n) {
+    return nodeSize(calculateDepth(n));
+}
+
+std::pair<size_t, size_t> LockFreeBuddyAllocator::Trim(size_t retainBytes, size_t hysteresisBytes) {
+    // Only the blocks of at least MinTrimSize bytes are considered
+    const uint32_t maxDepth = calculateDepth(Constants::MinTrimSize);
+    // Sum up the free memory that can be returned to the system...
+    size_t residentFree = 0;
+    forEachFreeBlock(maxDepth, [&](size_t node) {
+        residentFree += residentBytes(nodeAddress(node) - poolPtr, nodeSize(depth(node)));
+    });
+    if (residentFree <= retainBytes + hysteresisBytes)
+        return { 0, residentFree };
+    // ...and release it, claiming each block for the time being, so that no one allocates from it
+    size_t released = 0;
+    forEachFreeBlock(maxDepth, [&](size_t node) {
+        const size_t offset = nodeAddress(node) - poolPtr;
+        const size_t size = nodeSize(depth(node));
+        if (residentFree <= retainBytes || residentBytes(offset, size) == 0)
+            return;
+        if (tryAllocateNode(node) != 0)
+            return;
+        const size_t bytes = releaseResident(offset, size);
+        freeNode(node, 0);
+        released += bytes;
+        residentFree -= (bytes < residentFree) ? bytes : residentFree;
+    });
+    return { released, residentFree };
+}
+
+size_t LockFreeBuddyAllocator::MaxSize() {
+    return Constants::MaxAllocationSize;
+}
+
+bool LockFreeBuddyAllocator::Contains(void* ptr) const {
+    return ptr >= poolPtr && ptr < (poolPtr + Constants::BuddyAllocatorSize);
+}
+
+void LockFreeBuddyAllocator::PrintCondition() const {
+    size_t freeCounts[MaxDepth + 1] = {};
+    forEachFreeBlock(MaxDepth, [&](size_t node) { ++freeCounts[depth(node)]; });
+    const size_t free = FreeSpace();
+    const size_t largest = LargestFreeBlock();
+    std::cout << "Pool address: 0x" << std::hex << (void*)poolPtr << std::dec << "\n";
+    std::cout << "Pool size:  " << Constants::BuddyAllocatorSize << " bytes (lock-free).\n";
+    std::cout << "Free blocks of size 2^k:\n";
+    for (uint32_t d = 0; d <= MaxDepth; d++)
+        if (freeCounts[d] != 0)
+            std::cout << " (" << Constants::K - d << "): " << freeCounts[d] << "\n";
+    std::cout << "Free space: " << free << " bytes.\n";
+    std::cout << "Used space: " << Constants::BuddyAllocatorSize - free << " bytes.\n";
+    std::cout << "Largest free block: " << largest << " bytes.\n";
+    std::cout << "Fragmentation: " << ((free == 0) ? 0. : 1. - double(largest) / double(free)) << "\n\n";
+}
+
+#if PROFILE_LOCKS == 1
+andi::lock_stats LockFreeBuddyAllocator::LockStats() const {
+    return {};
+}
+#endif // PROFILE_LOCKS
+
+size_t LockFreeBuddyAllocator::FreeSpace() const {
+    return freeSpace.load(std::memory_order_relaxed);
+}
+
+size_t LockFreeBuddyAllocator::LargestFreeBlock() const {
+    // A depth-first search for the free node at the lowest depth. The nodes at or below
+    // the lowest depth found so far can't hold a larger block, so they are skipped.
+    uint32_t minDepth = MaxDepth + 1;
+    size_t stack[Constants::K + 2];
+    size_t top = 0;
+    stack[top++] = 1;
+    while (top != 0) {
+        const size_t node = stack[--top];
+        if (depth(node) >= minDepth)
+            continue;
+        const byte val = tree[node].load(std::memory_order_relaxed);
+        if (val == 0)
+            minDepth = depth(node);
+        else if (!(val & OCC) && depth(node) + 1 < minDepth) {
+            stack[top++] = 2 * node + 1;
+            stack[top++] = 2 * node;
+        }
+    }
+    return (minDepth > MaxDepth) ? 0 : nodeSize(minDepth);
+}
+
+double LockFreeBuddyAllocator::Fragmentation() const {
+    const size_t free = FreeSpace();
+    return (free == 0) ? 0. : 1. - double(LargestFreeBlock()) / double(free);
+}
+
+size_t LockFreeBuddyAllocator::LargestFreeBlockBound() const {
+    const size_t free = FreeSpace();
+    return (free == 0) ? 0 : size_t(1) << fastlog2(free);
+}
+
+#if USE_DEFRAGMENTATION == 1
+void LockFreeBuddyAllocator::MeasureOccupancy(size_t* usedBytes) const {
+    for (size_t r = 0; r < RegionCount; r++)
+        usedBytes[r] = 0;
+    // Only the allocated blocks have their depths recorded, the free pages are skipped one by one
+    for (size_t page = 0; page < LeafCount; ) {
+        const byte leafDepth = leafDepths[page].load(std::memory_order_relaxed);
+        if (leafDepth == 0) {
+            page++;
+            continue;
+        }
+        // The blocks are aligned at their size, so a large one covers whole regions
+        const size_t offset = page << LeafSizeLog;
+        const size_t size = nodeSize(leafDepth - 1);
+        if (size <= Constants::DefragmentRegionSize)
+            usedBytes[offset / Constants::DefragmentRegionSize] += size;
+        else
+            for (size_t r = offset / Constants::DefragmentRegionSize; r < (offset + size) / Constants::DefragmentRegionSize; r++)
+                usedBytes[r] = Constants::DefragmentRegionSize;
+        page += size >> LeafSizeLog;
+    }
+}
+#endif // USE_DEFRAGMENTATION
+
+size_t LockFreeBuddyAllocator::allocateNode(uint32_t d, size_t start, size_t count) {
+    const size_t first = size_t(1) << d;
+    for (size_t i = 0; i < count; ) {
+        const size_t node = first + ((start + i) & (first - 1));
+        if (tree[node].load(std::memory_order_relaxed) != 0) {
+            ++i;
+            continue;
+        }
+        const size_t failedAt = tryAllocateNode(node);
+        if (failedAt == 0)
+            return node;
+        else if (failedAt == node)
+            ++i;
+        else // An ancestor is allocated, so none of the nodes below it can be
+            i += ((failedAt + 1) << (d - depth(failedAt))) - node;
+    }
+    return 0;
+}
+
+size_t LockFreeBuddyAllocator::tryAllocateNode(size_t node) {
+    byte expected = 0;
+    if (!tree[node].compare_exchange_strong(expected, BUSY))
+        return node;
+    // Mark the path up to the root, unless the node turns out to be inside an allocated block
+    for (size_t child = node, current = node >> 1; current != 0; child = current, current >>= 1) {
+        byte curVal = tree[current].load();
+        byte newVal;
+        do {
+            if (curVal & OCC) {
+                freeNode(node, depth(child));
+                return current;
+            }
+            newVal = byte((curVal & ~coalescingBit(child)) | occupiedBit(child));
+        } while (!tree[current].compare_exchange_weak(curVal, newVal));
+    }
+    return 0;
+}
+
+void LockFreeBuddyAllocator::freeNode(size_t node, uint32_t topDepth) {
+    // The path is marked up to the ancestors at depth topDepth. First mark it as coalescing,
+    // up to where the other subtree stays occupied, since the marks above will stay anyway...
+    for (size_t runner = node; depth(runner) > topDepth; runner >>= 1) {
+        const byte oldVal = tree[runner >> 1].fetch_or(coalescingBit(runner));
+        if (isBuddyOccupied(oldVal, runner) && !isBuddyCoalescing(oldVal, runner))
+            break;
+    }
+    // ...then free the node itself...
+    tree[node].store(0);
+    // ...and finally clear the marks
+    if (depth(node) > topDepth)
+        unmarkPath(node, topDepth);
+}
+
+void LockFreeBuddyAllocator::unmarkPath(size_t node, uint32_t topDepth) {
+    for (size_t child = node, current = node >> 1; depth(child) > topDepth; child = current, current >>= 1) {
+        byte curVal = tree[current].load();
+        byte newVal;
+        do {
+            // A block in this subtree has been allocated meanwhile, so the rest of the path stays marked
+            if (!(curVal & coalescingBit(child)))
+                return;
+            newVal = byte(curVal & ~(occupiedBit(child) | coalescingBit(child)));
+        } while (!tree[current].compare_exchange_weak(curVal, newVal));
+        if (isBuddyOccupied(newVal, child))
+            return;
+    }
+}
+
+template<class Func>
+void LockFreeBuddyAllocator::forEachFreeBlock(uint32_t maxDepth, Func func) const {
+    // A depth-first search, that doesn't descend into the free or allocated nodes. Since
+    // the tree may change meanwhile, the blocks found are not guaranteed to still be free.
+    size_t stack[Constants::K + 2];
+    size_t top = 0;
+    stack[top++] = 1;
+    while (top != 0) {
+        const size_t node = stack[--top];
+        const byte val = tree[node].load(std::memory_order_relaxed);
+        if (val == 0)
+            func(node);
+        else if (!(val & OCC) && depth(node) < maxDepth) {
+            stack[top++] = 2 * node + 1;
+            stack[top++] = 2 * node;
+        }
+    }
+}
+
+void LockFreeBuddyAllocator::markResident(size_t offset, size_t size) {
+    // Most of the granules are already marked, so they are only read
+    const size_t last = (offset + size - 1) / Constants::MinTrimSize;
+    for (size_t g = offset / Constants::MinTrimSize; g <= last; g++)
+        if (residentGranules[g].load(std::memory_order_relaxed) == 0)
+            residentGranules[g].store(1, std::memory_order_relaxed);
+}
+
+void LockFreeBuddyAllocator::zeroResident(size_t offset, size_t n) {
+    // The granules, not touched since they were released, are still zero
+    for (size_t from = offset; from < offset + n; ) {
+        const size_t g = from / Constants::MinTrimSize;
+        const size_t granuleEnd = (g + 1)*Constants::MinTrimSize;
+        const size_t to = (granuleEnd < offset + n) ? granuleEnd : offset + n;
+        if (residentGranules[g].load(std::memory_order_relaxed))
+            std::memset(poolPtr + from, 0, to - from);
+        from = to;
+    }
+}
+
+size_t LockFreeBuddyAllocator::residentBytes(size_t offset, size_t size) const {
+    size_t res = 0;
+    for (size_t g = offset / Constants::MinTrimSize; g < (offset + size) / Constants::MinTrimSize; g++)
+        if (residentGranules[g].load(std::memory_order_relaxed))
+            res += Constants::MinTrimSize;
+    return res;
+}
+
+size_t LockFreeBuddyAllocator::releaseResident(size_t offset, size_t size) {
+    // Consecutive resident granules are released together, with a single system call
+    size_t released = 0;
+    const size_t last = (offset + size) / Constants::MinTrimSize;
+    for (size_t g = offset / Constants::MinTrimSize; g < last; ) {
+        if (!residentGranules[g].load(std::memory_order_relaxed)) {
+            ++g;
+            continue;
+        }
+        const size_t from = g;
+        for (; g < last && residentGranules[g].load(std::memory_order_relaxed); g++)
+            residentGranules[g].store(0, std::memory_order_relaxed);
+        andi::page_release(poolPtr + from*Constants::MinTrimSize, (g - from)*Constants::MinTrimSize);
+        released += (g - from)*Constants::MinTrimSize;
+    }
+    return released;
+}
+
+LockFreeBuddyAllocator::byte* LockFreeBuddyAllocator::nodeAddress(size_t node) const {
+    const uint32_t d = depth(node);
+    return poolPtr + ((node - (size_t(1) << d)) << (Constants::K - d));
+}
+
+uint32_t LockFreeBuddyAllocator::depth(size_t node) {
+    return fastlog2(node);
+}
+
+size_t LockFreeBuddyAllocator::nodeSize(uint32_t d) {
+    return size_t(1) << (Constants::K - d);
+}
+
+uint32_t LockFreeBuddyAllocator::calculateDepth(size_t n) {
+    // The depth of the smallest block, that can fit n bytes
+    if (n <= Constants::PageSize)
+        return MaxDepth;
+    return Constants::K - (fastlog2(n - 1) + 1);
+}
+
+bool LockFreeBuddyAllocator::isLeft(size_t node) {
+    return (node & 1) == 0;
+}
+
+LockFreeBuddyAllocator::byte LockFreeBuddyAllocator::occupiedBit(size_t child) {
+    return isLeft(child) ? OCC_LEFT : OCC_RIGHT;
+}
+
+LockFreeBuddyAllocator::byte LockFreeBuddyAllocator::coalescingBit(size_t child) {
+    return isLeft(child) ? COAL_LEFT : COAL_RIGHT;
+}
+
+bool LockFreeBuddyAllocator::isBuddyOccupied(byte val, size_t child) {
+    return val & (isLeft(child) ? OCC_RIGHT : OCC_LEFT);
+}
+
+bool LockFreeBuddyAllocator::isBuddyCoalescing(byte val, size_t child) {
+    return val & (isLeft(child) ? COAL_RIGHT : COAL_LEFT);
+}
+
+// iei
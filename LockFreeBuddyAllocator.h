@@ -0,0 +1,144 @@
+#pragma once
+#include "Defines.h"
+#include "Utilities.h"
+
+/*
+ - An alternative to the BuddyAllocator, which takes no locks. It manages an
+ address space of the same size, but its blocks are exact powers of two, no
+ smaller than a page.
+ - The state is kept in a complete binary tree, with a byte per node. The root
+ is the whole address space and the children of a node are its two halves. Nodes
+ are numbered like in a binary heap, so node n at depth d covers the addresses
+ [(n - 2^d) << (K - d), (n - 2^d + 1) << (K - d)).
+ - A node is OCC when it is allocated as a block. Its parent additionally keeps
+ an OCC_LEFT/OCC_RIGHT bit for each child, whose subtree contains an allocation,
+ and a COAL_LEFT/COAL_RIGHT bit, while a block there is being released.
+ - Allocation claims a free node with a CAS, and then marks the path up to the
+ root. If an allocated ancestor is found on the way, the marks are undone and
+ another node is tried, skipping over the ancestor's whole subtree.
+ - Deallocation first marks the path as coalescing, then frees the node and
+ finally clears the marks, for as long as the other child is unoccupied. A CAS
+ that finds the coalescing mark gone means the subtree has been allocated from
+ in the meantime, so the rest of the path stays marked.
+ - Different threads only ever meet on the shared ancestors of their blocks,
+ where they retry a CAS instead of waiting for each other. They start searching
+ from different parts of the address space, so they rarely meet below the top levels.
+ - The depth of each allocated block is kept in a byte per page, so that it can
+ be found on deallocation. It's atomic, as MeasureOccupancy() reads all of them
+ while other threads allocate & free. Which 64KB granules have been touched is tracked in
+ another byte table, so that Trim() knows what is worth returning to the system.
+ - The free space is exact, but the largest free block cannot be maintained without
+ locking, so LargestFreeBlock() searches the tree for it. For skipping the allocators,
+ that surely can't serve a request, the largest power of two not exceeding the free
+ space is used instead - it's O(1) & never below the largest free block.
+ (see "NBBS: A Non-Blocking Buddy System for Multi-core Machines", Marotta et al.)
+*/
+class LockFreeBuddyAllocator {
+    // forward declaration...
+    friend class MemoryArena;
+    using byte = uint8_t;
+
+    enum NodeState : byte {
+        OCC_RIGHT  = 0x1,
+        OCC_LEFT   = 0x2,
+        COAL_RIGHT = 0x4,
+        COAL_LEFT  = 0x8,
+        OCC        = 0x10,
+        BUSY       = OCC | OCC_LEFT | OCC_RIGHT,
+    };
+    static constexpr uint32_t LeafSizeLog = 12;
+    static_assert((size_t(1) << LeafSizeLog) == Constants::PageSize);
+    // Depth of the leaves, i.e. the single page blocks
+    static constexpr uint32_t MaxDepth = Constants::K - LeafSizeLog;
+    static constexpr size_t NodeCount = size_t(2) << MaxDepth;
+    static constexpr size_t LeafCount = size_t(1) << MaxDepth;
+    static constexpr size_t GranuleCount = Constants::BuddyAllocatorSize / Constants::MinTrimSize;
+
+    std::atomic<byte>* tree;
+    std::atomic<byte>* leafDepths;        // depth + 1 of the block, starting at each page, or 0
+    std::atomic<byte>* residentGranules;  // set for the granules, that may be backed by memory
+    std::atomic<size_t> freeSpace;
+    byte* poolPtr;
+#if USE_HARDENING == 1
+    // Set when the invalid frees have to be caught & reported (see MemoryArena::SetHardening)
+    bool hardened;
+#endif // USE_HARDENING
+
+    LockFreeBuddyAllocator(); // no destructor, we rely on Deinitialize
+    void Reset();
+    bool Initialize(bool hardening = false);
+    void Deinitialize();
+
+    void* Allocate(size_t);
+    // Zeroes only the granules, that may have been touched since they were last released
+    void* AllocateZeroed(size_t);
+#if USE_DEFRAGMENTATION == 1
+    // Allocates the lowest block, that can fit n bytes, if it ends before limit
+    void* AllocateBelow(size_t n, void* limit);
+#endif // USE_DEFRAGMENTATION
+    void Deallocate(void*);
+#if USE_HARDENING == 1
+    // Whether Deallocate() would accept the pointer - always, unless hardened
+    bool IsAllocated(void*) const;
+#endif // USE_HARDENING
+    std::pair<void*, size_t> AllocateUseful(size_t);
+    size_t UsefulSize(void*) const;
+    static size_t GoodSize(size_t);
+    // Returns the pages of free blocks to the system, until no more than retainBytes
+    // of free memory remain resident. Does nothing if the resident free memory does not
+    // exceed retainBytes + hysteresisBytes. Returns { released, retained } bytes.
+    std::pair<size_t, size_t> Trim(size_t, size_t);
+    static size_t MaxSize();
+    bool Contains(void*) const;
+    void PrintCondition() const;
+#if PROFILE_LOCKS == 1
+    // There are no locks here, so these are always empty
+    andi::lock_stats LockStats() const;
+#endif // PROFILE_LOCKS
+    // Occupancy statistics - lock-free, but only the free space is O(1): the largest free block
+    // is searched for in the tree, so it's meant for monitoring, not for the allocation path
+    size_t FreeSpace() const;
+    size_t LargestFreeBlock() const;
+    double Fragmentation() const;
+    // An upper bound of the largest free block in O(1), see above
+    size_t LargestFreeBlockBound() const;
+#if USE_DEFRAGMENTATION == 1
+    static constexpr size_t RegionCount = Constants::BuddyAllocatorSize / Constants::DefragmentRegionSize;
+    // Stores the allocated bytes in each DefragmentRegionSize region of the pool to usedBytes,
+    // which has room for RegionCount counters. The blocks are found by their depths, without
+    // stopping the other threads, so the figures are only a snapshot.
+    void MeasureOccupancy(size_t* usedBytes) const;
+#endif // USE_DEFRAGMENTATION
+
+    // Only the blocks below limitOffset are considered, if it's given
+    void* allocateBlock(size_t, bool, size_t = Constants::BuddyAllocatorSize);
+    // Tries count nodes at the depth, starting from the start-th one & wrapping around
+    size_t allocateNode(uint32_t, size_t, size_t);
+    size_t tryAllocateNode(size_t);
+    void freeNode(size_t, uint32_t);
+    void unmarkPath(size_t, uint32_t);
+    template<class Func>
+    void forEachFreeBlock(uint32_t, Func) const;
+    void markResident(size_t, size_t);
+    void zeroResident(size_t, size_t);
+    size_t residentBytes(size_t, size_t) const;
+    size_t releaseResident(size_t, size_t);
+    byte* nodeAddress(size_t) const;
+    static uint32_t depth(size_t);
+    static size_t nodeSize(uint32_t);
+    static uint32_t calculateDepth(size_t);
+    static bool isLeft(size_t);
+    static byte occupiedBit(size_t);
+    static byte coalescingBit(size_t);
+    static bool isBuddyOccupied(byte, size_t);
+    static bool isBuddyCoalescing(byte, size_t);
+
+public:
+    // moving or copying of pools is forbidden
+    LockFreeBuddyAllocator(const LockFreeBuddyAllocator&) = delete;
+    LockFreeBuddyAllocator& operator=(const LockFreeBuddyAllocator&) = delete;
+    LockFreeBuddyAllocator(LockFreeBuddyAllocator&&) = delete;
+    LockFreeBuddyAllocator& operator=(LockFreeBuddyAllocator&&) = delete;
+};
+
+// iei
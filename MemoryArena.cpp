@@ -1,167 +1,1074 @@
-﻿#include "MemoryArena.h"
-
-MemoryArena MemoryArena::arena{};
-
-MemoryArena::MemoryArena() : initialized(false) {}
-
-bool MemoryArena::Initialize() {
-    andi::lock_guard lock{ arena.initializationmtx };
-    if (arena.initialized) {
-        vassert(false && "MemoryArena has already been initialized!");
-        return false;
-    }
-
-#if USE_POOL_ALLOCATORS == 1
-    arena.pool0.Initialize();
-    arena.pool1.Initialize();
-    arena.pool2.Initialize();
-    arena.pool3.Initialize();
-    arena.pool4.Initialize();
-    arena.pool5.Initialize();
-#endif // USE_POOL_ALLOCATORS
-    
-    arena.buddyAlloc[0].Initialize();
-    arena.buddyAlloc[1].Initialize();
-    arena.initialized = true;
-    return true;
-}
-
-bool MemoryArena::Deinitialize() {
-    andi::lock_guard lock{ arena.initializationmtx };
-    if (!arena.initialized) {
-        vassert(false && "MemoryArena has already been deinitialized!");
-        return false;
-    }
-
-#if USE_POOL_ALLOCATORS == 1
-    arena.pool0.Deinitialize();
-    arena.pool1.Deinitialize();
-    arena.pool2.Deinitialize();
-    arena.pool3.Deinitialize();
-    arena.pool4.Deinitialize();
-    arena.pool5.Deinitialize();
-#endif // USE_POOL_ALLOCATORS
-    
-    arena.buddyAlloc[0].Deinitialize();
-    arena.buddyAlloc[1].Deinitialize();
-    arena.initialized = false;
-    return true;
-}
-
-void* MemoryArena::Allocate(size_t n) {
-    if (n == 0)
-        return nullptr;
-    vassert(arena.initialized && "MemoryArena must be initialized before allocation!");
-
-    void* ptr = nullptr;
-#if USE_POOL_ALLOCATORS == 1
-    if (n <= 32)
-        ptr = arena.pool0.Allocate();
-    else if (n <= 64)
-        ptr = arena.pool1.Allocate();
-    else if (n <= 128)
-        ptr = arena.pool2.Allocate();
-    else if (n <= 256)
-        ptr = arena.pool3.Allocate();
-    else if (n <= 512)
-        ptr = arena.pool4.Allocate();
-    else if (n <= 1024)
-        ptr = arena.pool5.Allocate();
-    // In case allocation has been unsuccessful due to a full memory pool
-    if (ptr == nullptr) {
-#endif // USE_POOL_ALLOCATORS
-        const uint32_t idx = arena.toggle.fetch_add(1) & 1;
-        ptr = arena.buddyAlloc[idx].Allocate(n);
-#if USE_POOL_ALLOCATORS == 1
-    }
-#endif // USE_POOL_ALLOCATORS
-    vassert(ptr);
-    return ptr;
-}
-
-void MemoryArena::Deallocate(void* ptr) {
-    if (!ptr)
-        return;
-    vassert(arena.initialized && "MemoryArena must be initialized before deallocation!");
-    vassert(arena.Contains(ptr) && "MemoryArena: pointer is outside of the address space!");
-
-#if USE_POOL_ALLOCATORS == 1
-    if (arena.pool0.Contains(ptr))
-        arena.pool0.Deallocate(ptr);
-    else if (arena.pool1.Contains(ptr))
-        arena.pool1.Deallocate(ptr);
-    else if (arena.pool2.Contains(ptr))
-        arena.pool2.Deallocate(ptr);
-    else if (arena.pool3.Contains(ptr))
-        arena.pool3.Deallocate(ptr);
-    else if (arena.pool4.Contains(ptr))
-        arena.pool4.Deallocate(ptr);
-    else if (arena.pool5.Contains(ptr))
-        arena.pool5.Deallocate(ptr);
-    else
-#endif // USE_POOL_ALLOCATORS
-    if (arena.buddyAlloc[0].Contains(ptr))
-        arena.buddyAlloc[0].Deallocate(ptr);
-    else
-        arena.buddyAlloc[1].Deallocate(ptr);
-}
-
-std::pair<void*, size_t> MemoryArena::AllocateUseful(size_t n){
-    if (n == 0)
-        return { nullptr, 0 };
-    vassert(arena.initialized && "MemoryArena must be initialized before allocation!");
-
-    std::pair<void*, size_t> res{ nullptr, 0 };
-#if USE_POOL_ALLOCATORS == 1
-    if (n <= 32)
-        res = arena.pool0.AllocateUseful();
-    else if (n <= 64)
-        res = arena.pool1.AllocateUseful();
-    else if (n <= 128)
-        res = arena.pool2.AllocateUseful();
-    else if (n <= 256)
-        res = arena.pool3.AllocateUseful();
-    else if (n <= 512)
-        res = arena.pool4.AllocateUseful();
-    else if (n <= 1024)
-        res = arena.pool5.AllocateUseful();
-    // In case allocation has been unsuccessful due to a full memory pool
-    if (res.first == nullptr) {
-#endif // USE_POOL_ALLOCATORS
-        const uint32_t idx = arena.toggle.fetch_add(1) & 1;
-        res = arena.buddyAlloc[idx].AllocateUseful(n);
-#if USE_POOL_ALLOCATORS == 1
-    }
-#endif // USE_POOL_ALLOCATORS
-    return res;
-}
-
-void MemoryArena::PrintCondition() {
-#if USE_POOL_ALLOCATORS == 1
-    arena.pool0.PrintCondition();
-    arena.pool1.PrintCondition();
-    arena.pool2.PrintCondition();
-    arena.pool3.PrintCondition();
-    arena.pool4.PrintCondition();
-    arena.pool5.PrintCondition();
-#endif // USE_POOL_ALLOCATORS
-
-    arena.buddyAlloc[0].PrintCondition();
-    arena.buddyAlloc[1].PrintCondition();
-}
-
-size_t MemoryArena::MaxSize() {
-    return BuddyAllocator::MaxSize();
-}
-
-bool MemoryArena::Contains(void* ptr) {
-    return (
-#if USE_POOL_ALLOCATORS == 1
-            arena.pool0.Contains(ptr) || arena.pool1.Contains(ptr) ||
-            arena.pool2.Contains(ptr) || arena.pool3.Contains(ptr) ||
-            arena.pool4.Contains(ptr) || arena.pool5.Contains(ptr) ||
-#endif // USE_POOL_ALLOCATORS
-            arena.buddyAlloc[0].Contains(ptr) || arena.buddyAlloc[1].Contains(ptr));
-}
-
-// iei
+﻿#include "MemoryArena.h"
+#include <algorithm> // std::sort
+#include <new> // placement new
+
+MemoryArena MemoryArena::defaultArena{};
+
+MemoryArena::MemoryArena() : buddyCount(0), initialized(false), scavengerStop(false), refillerStop(false) {
+#if USE_HANDLE_SPACE == 1
+    handleBase = 0;
+#endif // USE_HANDLE_SPACE
+#if USE_HARDENING == 1
+    hardening = false;
+#endif // USE_HARDENING
+}
+
+MemoryArena& MemoryArena::Default() {
+    return defaultArena;
+}
+
+#if USE_HARDENING == 1
+bool MemoryArena::SetHardening(bool enabled) {
+    andi::lock_guard lock{ initializationmtx };
+    if (initialized) {
+        vassert(false && "MemoryArena: Hardening has to be selected before initialization!");
+        return false;
+    }
+    hardening = enabled;
+    return true;
+}
+#endif // USE_HARDENING
+
+bool MemoryArena::Initialize() {
+    andi::lock_guard lock{ initializationmtx };
+    if (initialized) {
+        vassert(false && "MemoryArena has already been initialized!");
+        return false;
+    }
+
+#if USE_HARDENING == 1
+    [[maybe_unused]] const bool hardened = hardening;
+#else
+    [[maybe_unused]] const bool hardened = false;
+#endif // USE_HARDENING
+    // All the tiers reserve their address space or tables from the system, which may fail
+    bool reserved = true;
+#if USE_POOL_ALLOCATORS == 1
+    reserved = reserved && pool0.Initialize(hardened);
+    reserved = reserved && pool1.Initialize(hardened);
+    reserved = reserved && pool2.Initialize(hardened);
+    reserved = reserved && pool3.Initialize(hardened);
+    reserved = reserved && pool4.Initialize(hardened);
+    reserved = reserved && pool5.Initialize(hardened);
+    reserved = reserved && pool6.Initialize(hardened);
+    reserved = reserved && pool7.Initialize(hardened);
+#endif // USE_POOL_ALLOCATORS
+#if USE_SLAB_ALLOCATOR == 1
+    reserved = reserved && slabs.Initialize(hardened);
+#endif // USE_SLAB_ALLOCATOR
+#if USE_HANDLE_SPACE == 1
+    reserved = reserved && handleSpace.Initialize(hardened);
+    handleBase = handleSpace.virtualZero;
+#endif // USE_HANDLE_SPACE
+#if PROFILE_HEAP == 1
+    reserved = reserved && heapProfile.Initialize();
+#endif // PROFILE_HEAP
+#if USE_DEFRAGMENTATION == 1
+    reserved = reserved && relocations.Initialize();
+#endif // USE_DEFRAGMENTATION
+
+    hugeAllocs.prev = hugeAllocs.next = &hugeAllocs;
+    for (size_t i = 0; reserved && i < Constants::InitialBuddyAllocators; i++)
+        reserved = (addBuddyAllocator(i) != nullptr);
+    if (!reserved) {
+        // Undo whatever has been set up - the allocators, that failed, have nothing to undo
+        deinitializeAllocators();
+        return false;
+    }
+    initialized = true;
+    return true;
+}
+
+bool MemoryArena::Deinitialize() {
+    andi::lock_guard lock{ initializationmtx };
+    if (!initialized) {
+        vassert(false && "MemoryArena has already been deinitialized!");
+        return false;
+    }
+    StopScavenger();
+    StopRefiller();
+    deinitializeAllocators();
+    initialized = false;
+    return true;
+}
+
+void MemoryArena::deinitializeAllocators() {
+#if USE_POOL_ALLOCATORS == 1
+    pool0.Deinitialize();
+    pool1.Deinitialize();
+    pool2.Deinitialize();
+    pool3.Deinitialize();
+    pool4.Deinitialize();
+    pool5.Deinitialize();
+    pool6.Deinitialize();
+    pool7.Deinitialize();
+#endif // USE_POOL_ALLOCATORS
+#if USE_SLAB_ALLOCATOR == 1
+    slabs.Deinitialize();
+#endif // USE_SLAB_ALLOCATOR
+#if USE_HANDLE_SPACE == 1
+    handleSpace.Deinitialize();
+    handleBase = 0;
+#endif // USE_HANDLE_SPACE
+#if PROFILE_HEAP == 1
+    heapProfile.Deinitialize();
+#endif // PROFILE_HEAP
+#if USE_DEFRAGMENTATION == 1
+    relocations.Deinitialize();
+#endif // USE_DEFRAGMENTATION
+    
+    const size_t count = buddyCount;
+    for (size_t i = 0; i < count; i++) {
+        buddyAlloc[i]->Deinitialize();
+        andi::aligned_free(buddyAlloc[i]);
+        buddyAlloc[i] = nullptr;
+    }
+    buddyCount = 0;
+    // Huge allocations, still in use, are simply unmapped
+    while (hugeAllocs.next != &hugeAllocs)
+        deallocateHuge((void*)(uintptr_t(hugeAllocs.next) + Constants::PageSize));
+}
+
+void* MemoryArena::Allocate(size_t n) {
+    if (n == 0)
+        return nullptr;
+    vassert(initialized && "MemoryArena must be initialized before allocation!");
+#if USE_ALLOCATION_TAGS == 1
+    if (!AllocationTags::admit(n))
+        return nullptr;
+#endif // USE_ALLOCATION_TAGS
+
+    void* ptr = nullptr;
+#if USE_POOL_ALLOCATORS == 1
+    if (n <= 8)
+        ptr = pool0.Allocate();
+    else if (n <= 16)
+        ptr = pool1.Allocate();
+    else if (n <= 32)
+        ptr = pool2.Allocate();
+    else if (n <= 64)
+        ptr = pool3.Allocate();
+    else if (n <= 128)
+        ptr = pool4.Allocate();
+    else if (n <= 256)
+        ptr = pool5.Allocate();
+    else if (n <= 512)
+        ptr = pool6.Allocate();
+    else if (n <= 1024)
+        ptr = pool7.Allocate();
+#endif // USE_POOL_ALLOCATORS
+#if USE_SLAB_ALLOCATOR == 1
+    // The smaller requests, that overflow a full pool, would waste most of a slab object
+    if (ptr == nullptr && n > Constants::MinSlabAllocationSize && n <= SlabAllocator::MaxSize())
+        ptr = slabs.Allocate(n);
+#endif // USE_SLAB_ALLOCATOR
+    // In case allocation has been unsuccessful due to a full memory pool
+    if (ptr == nullptr)
+        ptr = allocateBuddy(n);
+    vassert(ptr);
+#if USE_ALLOCATION_TAGS == 1
+    if (ptr != nullptr)
+        AllocationTags::charge(usefulSize(ptr));
+#endif // USE_ALLOCATION_TAGS
+#if PROFILE_HEAP == 1
+    heapProfile.RecordAllocation(ptr, n);
+#endif // PROFILE_HEAP
+    return ptr;
+}
+
+void* MemoryArena::AllocateZeroed(size_t n) {
+    if (n == 0)
+        return nullptr;
+    vassert(initialized && "MemoryArena must be initialized before allocation!");
+#if USE_ALLOCATION_TAGS == 1
+    if (!AllocationTags::admit(n))
+        return nullptr;
+#endif // USE_ALLOCATION_TAGS
+
+    void* ptr = nullptr;
+#if USE_POOL_ALLOCATORS == 1
+    if (n <= 8)
+        ptr = pool0.AllocateZeroed();
+    else if (n <= 16)
+        ptr = pool1.AllocateZeroed();
+    else if (n <= 32)
+        ptr = pool2.AllocateZeroed();
+    else if (n <= 64)
+        ptr = pool3.AllocateZeroed();
+    else if (n <= 128)
+        ptr = pool4.AllocateZeroed();
+    else if (n <= 256)
+        ptr = pool5.AllocateZeroed();
+    else if (n <= 512)
+        ptr = pool6.AllocateZeroed();
+    else if (n <= 1024)
+        ptr = pool7.AllocateZeroed();
+#endif // USE_POOL_ALLOCATORS
+#if USE_SLAB_ALLOCATOR == 1
+    if (ptr == nullptr && n > Constants::MinSlabAllocationSize && n <= SlabAllocator::MaxSize())
+        ptr = slabs.AllocateZeroed(n);
+#endif // USE_SLAB_ALLOCATOR
+    // In case allocation has been unsuccessful due to a full memory pool
+    if (ptr == nullptr)
+        ptr = allocateBuddy(n, true);
+    vassert(ptr);
+#if USE_ALLOCATION_TAGS == 1
+    if (ptr != nullptr)
+        AllocationTags::charge(usefulSize(ptr));
+#endif // USE_ALLOCATION_TAGS
+#if PROFILE_HEAP == 1
+    heapProfile.RecordAllocation(ptr, n);
+#endif // PROFILE_HEAP
+    return ptr;
+}
+
+void MemoryArena::Deallocate(void* ptr) {
+    if (!ptr)
+        return;
+    vassert(initialized && "MemoryArena must be initialized before deallocation!");
+#if USE_HARDENING == 1
+    // A hardened arena reports the foreign pointers below, instead of asserting
+    vassert((hardening || Contains(ptr)) && "MemoryArena: pointer is outside of the arena's address space!");
+#else
+    vassert(Contains(ptr) && "MemoryArena: pointer is outside of the arena's address space!");
+#endif // USE_HARDENING
+#if USE_ALLOCATION_TAGS == 1 || PROFILE_HEAP == 1
+    if (acceptsFree(ptr)) {
+#if USE_ALLOCATION_TAGS == 1
+        // The block's size has to be read before it's freed & possibly merged
+        AllocationTags::credit(usefulSize(ptr));
+#endif // USE_ALLOCATION_TAGS
+#if PROFILE_HEAP == 1
+        heapProfile.RecordDeallocation(ptr);
+#endif // PROFILE_HEAP
+    }
+#endif // USE_ALLOCATION_TAGS || PROFILE_HEAP
+
+#if USE_POOL_ALLOCATORS == 1
+    if (pool0.Contains(ptr))
+        pool0.Deallocate(ptr);
+    else if (pool1.Contains(ptr))
+        pool1.Deallocate(ptr);
+    else if (pool2.Contains(ptr))
+        pool2.Deallocate(ptr);
+    else if (pool3.Contains(ptr))
+        pool3.Deallocate(ptr);
+    else if (pool4.Contains(ptr))
+        pool4.Deallocate(ptr);
+    else if (pool5.Contains(ptr))
+        pool5.Deallocate(ptr);
+    else if (pool6.Contains(ptr))
+        pool6.Deallocate(ptr);
+    else if (pool7.Contains(ptr))
+        pool7.Deallocate(ptr);
+    else
+#endif // USE_POOL_ALLOCATORS
+#if USE_SLAB_ALLOCATOR == 1
+    if (slabs.Contains(ptr))
+        slabs.Deallocate(ptr);
+    else
+#endif // USE_SLAB_ALLOCATOR
+#if USE_HANDLE_SPACE == 1
+    if (handleSpace.Contains(ptr))
+        handleSpace.Deallocate(ptr);
+    else
+#endif // USE_HANDLE_SPACE
+    if (BuddyEngine* buddy = findBuddyAllocator(ptr))
+        buddy->Deallocate(ptr);
+#if USE_HARDENING == 1
+    // Anything else would be unmapped as a huge allocation, so it's looked up first
+    else if (hardening && !isHugeAllocation(ptr))
+        andi::report_corruption(andi::corruption::invalid_free, ptr, "MemoryArena");
+#endif // USE_HARDENING
+    else
+        deallocateHuge(ptr);
+}
+
+std::pair<void*, size_t> MemoryArena::AllocateUseful(size_t n){
+    if (n == 0)
+        return { nullptr, 0 };
+    vassert(initialized && "MemoryArena must be initialized before allocation!");
+#if USE_ALLOCATION_TAGS == 1
+    if (!AllocationTags::admit(n))
+        return { nullptr, 0 };
+#endif // USE_ALLOCATION_TAGS
+
+    std::pair<void*, size_t> res{ nullptr, 0 };
+#if USE_POOL_ALLOCATORS == 1
+    if (n <= 8)
+        res = pool0.AllocateUseful();
+    else if (n <= 16)
+        res = pool1.AllocateUseful();
+    else if (n <= 32)
+        res = pool2.AllocateUseful();
+    else if (n <= 64)
+        res = pool3.AllocateUseful();
+    else if (n <= 128)
+        res = pool4.AllocateUseful();
+    else if (n <= 256)
+        res = pool5.AllocateUseful();
+    else if (n <= 512)
+        res = pool6.AllocateUseful();
+    else if (n <= 1024)
+        res = pool7.AllocateUseful();
+#endif // USE_POOL_ALLOCATORS
+#if USE_SLAB_ALLOCATOR == 1
+    if (res.first == nullptr && n > Constants::MinSlabAllocationSize && n <= SlabAllocator::MaxSize())
+        res = slabs.AllocateUseful(n);
+#endif // USE_SLAB_ALLOCATOR
+    // In case allocation has been unsuccessful due to a full memory pool
+    if (res.first == nullptr) {
+        res.first = allocateBuddy(n);
+        if (BuddyEngine* buddy = findBuddyAllocator(res.first))
+            res.second = buddy->UsefulSize(res.first);
+        else if (res.first != nullptr) // a huge allocation uses whole pages
+            res.second = (n + Constants::PageSize - 1) & ~size_t(Constants::PageSize - 1);
+    }
+#if USE_ALLOCATION_TAGS == 1
+    if (res.first != nullptr)
+        AllocationTags::charge(res.second);
+#endif // USE_ALLOCATION_TAGS
+#if PROFILE_HEAP == 1
+    heapProfile.RecordAllocation(res.first, n);
+#endif // PROFILE_HEAP
+    return res;
+}
+
+size_t MemoryArena::GoodSize(size_t n) {
+    if (n == 0)
+        return 0;
+#if USE_POOL_ALLOCATORS == 1
+    if (n <= 8)
+        return 8;
+    else if (n <= 1024) // the pools have sizes of consecutive powers of two
+        return size_t(1) << (fastlog2(n - 1) + 1);
+#endif // USE_POOL_ALLOCATORS
+#if USE_SLAB_ALLOCATOR == 1
+    if (n > Constants::MinSlabAllocationSize && n <= SlabAllocator::MaxSize())
+        return SlabAllocator::GoodSize(n);
+#endif // USE_SLAB_ALLOCATOR
+    if (n <= BuddyEngine::MaxSize())
+        return BuddyEngine::GoodSize(n);
+    // a huge allocation uses whole pages
+    return (n + Constants::PageSize - 1) & ~size_t(Constants::PageSize - 1);
+}
+
+#if USE_HANDLE_SPACE == 1
+uint32_t MemoryArena::AllocateHandle(size_t n) {
+    if (n == 0)
+        return NullHandle;
+    vassert(initialized && "MemoryArena must be initialized before allocation!");
+#if USE_ALLOCATION_TAGS == 1
+    if (!AllocationTags::admit(n))
+        return NullHandle;
+#endif // USE_ALLOCATION_TAGS
+    void* ptr = handleSpace.Allocate(n);
+#if USE_ALLOCATION_TAGS == 1
+    if (ptr != nullptr)
+        AllocationTags::charge(handleSpace.UsefulSize(ptr));
+#endif // USE_ALLOCATION_TAGS
+#if PROFILE_HEAP == 1
+    heapProfile.RecordAllocation(ptr, n);
+#endif // PROFILE_HEAP
+    return ToHandle(ptr);
+}
+
+uint32_t MemoryArena::AllocateZeroedHandle(size_t n) {
+    if (n == 0)
+        return NullHandle;
+    vassert(initialized && "MemoryArena must be initialized before allocation!");
+#if USE_ALLOCATION_TAGS == 1
+    if (!AllocationTags::admit(n))
+        return NullHandle;
+#endif // USE_ALLOCATION_TAGS
+    void* ptr = handleSpace.AllocateZeroed(n);
+#if USE_ALLOCATION_TAGS == 1
+    if (ptr != nullptr)
+        AllocationTags::charge(handleSpace.UsefulSize(ptr));
+#endif // USE_ALLOCATION_TAGS
+#if PROFILE_HEAP == 1
+    heapProfile.RecordAllocation(ptr, n);
+#endif // PROFILE_HEAP
+    return ToHandle(ptr);
+}
+
+void MemoryArena::DeallocateHandle(uint32_t handle) {
+    if (handle == NullHandle)
+        return;
+    vassert(initialized && "MemoryArena must be initialized before deallocation!");
+    // The handle space's tables cover only its own range, so a bad handle must not reach them
+    if (handle >= Constants::BuddyAllocatorSize) {
+#if USE_HARDENING == 1
+        if (hardening) {
+            andi::report_corruption(andi::corruption::invalid_free, (void*)(handleBase + handle), "MemoryArena");
+            return;
+        }
+#endif // USE_HARDENING
+        vassert(false && "MemoryArena: handle is outside of the handle space!");
+        return;
+    }
+#if USE_ALLOCATION_TAGS == 1 || PROFILE_HEAP == 1
+    if (acceptsFree(FromHandle(handle))) {
+#if USE_ALLOCATION_TAGS == 1
+        AllocationTags::credit(handleSpace.UsefulSize(FromHandle(handle)));
+#endif // USE_ALLOCATION_TAGS
+#if PROFILE_HEAP == 1
+        heapProfile.RecordDeallocation(FromHandle(handle));
+#endif // PROFILE_HEAP
+    }
+#endif // USE_ALLOCATION_TAGS || PROFILE_HEAP
+    handleSpace.Deallocate(FromHandle(handle));
+}
+
+void* MemoryArena::FromHandle(uint32_t handle) const {
+    vassert((handle == NullHandle || handle < Constants::BuddyAllocatorSize)
+        && "MemoryArena: handle is outside of the handle space!");
+    return (handle == NullHandle) ? nullptr : (void*)(handleBase + handle);
+}
+
+uint32_t MemoryArena::ToHandle(const void* ptr) const {
+    if (ptr == nullptr)
+        return NullHandle;
+    vassert(uintptr_t(ptr) - handleBase < Constants::BuddyAllocatorSize
+        && "MemoryArena: pointer is outside of the handle space!");
+    return uint32_t(uintptr_t(ptr) - handleBase);
+}
+#endif // USE_HANDLE_SPACE
+
+size_t MemoryArena::Trim(size_t retainBytes) {
+    vassert(initialized && "MemoryArena must be initialized before trimming!");
+    return trim(retainBytes, 0);
+}
+
+void MemoryArena::Prefault(size_t n, size_t count) {
+    if (n == 0 || count == 0)
+        return;
+    vassert(initialized && "MemoryArena must be initialized before prefaulting!");
+#if USE_POOL_ALLOCATORS == 1
+    if (n <= 8)
+        return pool0.Prefault(count);
+    else if (n <= 16)
+        return pool1.Prefault(count);
+    else if (n <= 32)
+        return pool2.Prefault(count);
+    else if (n <= 64)
+        return pool3.Prefault(count);
+    else if (n <= 128)
+        return pool4.Prefault(count);
+    else if (n <= 256)
+        return pool5.Prefault(count);
+    else if (n <= 512)
+        return pool6.Prefault(count);
+    else if (n <= 1024)
+        return pool7.Prefault(count);
+#endif // USE_POOL_ALLOCATORS
+#if USE_SLAB_ALLOCATOR == 1
+    if (n > Constants::MinSlabAllocationSize && n <= SlabAllocator::MaxSize())
+        return slabs.Prefault(n, count);
+#endif // USE_SLAB_ALLOCATOR
+    // Huge allocations are mapped on demand, there's nothing to prepare
+    if (n <= BuddyEngine::MaxSize())
+        prefaultBuddy(n, count);
+}
+
+void MemoryArena::Reserve(size_t bytes) {
+    vassert(initialized && "MemoryArena must be initialized before prefaulting!");
+    const size_t chunk = BuddyEngine::MaxSize();
+    prefaultBuddy(chunk, bytes / chunk);
+    if (bytes % chunk != 0)
+        prefaultBuddy(bytes % chunk, 1);
+}
+
+#if USE_DEFRAGMENTATION == 1
+void* MemoryArena::AllocateRelocatable(size_t n, void* context) {
+    void* ptr = Allocate(n);
+    // If the table is full, the allocation just stays where it is
+    if (ptr != nullptr)
+        relocations.Insert(ptr, n, context);
+    return ptr;
+}
+
+void MemoryArena::DeallocateRelocatable(void* ptr) {
+    if (!ptr)
+        return;
+    relocations.Remove(ptr);
+    Deallocate(ptr);
+}
+
+size_t MemoryArena::Defragment(andi::relocate_callback callback, size_t budgetBytes) {
+    vassert(initialized && "MemoryArena must be initialized before defragmentation!");
+    // The candidates are a snapshot of the table, sorted from the highest addresses down
+    const size_t capacity = relocations.Count();
+    if (capacity == 0 || budgetBytes == 0)
+        return 0;
+    RelocationTable::Entry* candidates = (RelocationTable::Entry*)andi::page_alloc(capacity*sizeof(RelocationTable::Entry));
+    if (candidates == nullptr)
+        return 0;
+    const size_t count = relocations.Snapshot(candidates, capacity);
+    std::sort(candidates, candidates + count,
+        [](const RelocationTable::Entry& a, const RelocationTable::Entry& b) { return a.ptr > b.ptr; });
+
+    size_t moved = 0;
+#if USE_POOL_ALLOCATORS == 1
+    moved += defragmentPool(pool0, candidates, count, callback, budgetBytes);
+    moved += defragmentPool(pool1, candidates, count, callback, budgetBytes);
+    moved += defragmentPool(pool2, candidates, count, callback, budgetBytes);
+    moved += defragmentPool(pool3, candidates, count, callback, budgetBytes);
+    moved += defragmentPool(pool4, candidates, count, callback, budgetBytes);
+    moved += defragmentPool(pool5, candidates, count, callback, budgetBytes);
+    moved += defragmentPool(pool6, candidates, count, callback, budgetBytes);
+    moved += defragmentPool(pool7, candidates, count, callback, budgetBytes);
+#endif // USE_POOL_ALLOCATORS
+    moved += defragmentBuddies(candidates, count, callback, budgetBytes);
+    andi::page_free(candidates, capacity*sizeof(RelocationTable::Entry));
+    return moved;
+}
+#endif // USE_DEFRAGMENTATION
+
+bool MemoryArena::StartScavenger(std::chrono::milliseconds interval, size_t retainBytes, size_t hysteresisBytes) {
+    vassert(initialized && "MemoryArena must be initialized before starting the scavenger!");
+    std::lock_guard<std::mutex> lock{ scavengermtx };
+    if (scavenger.joinable())
+        return false;
+    scavengerStop = false;
+    scavenger = std::thread{ &MemoryArena::scavengerLoop, this, interval, retainBytes, hysteresisBytes };
+    return true;
+}
+
+void MemoryArena::StopScavenger() {
+    {
+        std::lock_guard<std::mutex> lock{ scavengermtx };
+        if (!scavenger.joinable())
+            return;
+        scavengerStop = true;
+    }
+    scavengercv.notify_all();
+    scavenger.join();
+}
+
+bool MemoryArena::StartRefiller(std::chrono::milliseconds interval, size_t lowBytes, size_t highBytes) {
+    vassert(initialized && "MemoryArena must be initialized before starting the refiller!");
+    vassert(lowBytes <= highBytes && "MemoryArena: The refiller's low watermark is above the high one!");
+    std::lock_guard<std::mutex> lock{ refillermtx };
+    if (refiller.joinable())
+        return false;
+    refillerStop = false;
+    refiller = std::thread{ &MemoryArena::refillerLoop, this, interval, lowBytes, highBytes };
+    return true;
+}
+
+void MemoryArena::StopRefiller() {
+    {
+        std::lock_guard<std::mutex> lock{ refillermtx };
+        if (!refiller.joinable())
+            return;
+        refillerStop = true;
+    }
+    refillercv.notify_all();
+    refiller.join();
+}
+
+void MemoryArena::PrintCondition() {
+#if USE_POOL_ALLOCATORS == 1
+    pool0.PrintCondition();
+    pool1.PrintCondition();
+    pool2.PrintCondition();
+    pool3.PrintCondition();
+    pool4.PrintCondition();
+    pool5.PrintCondition();
+    pool6.PrintCondition();
+    pool7.PrintCondition();
+#endif // USE_POOL_ALLOCATORS
+#if USE_SLAB_ALLOCATOR == 1
+    slabs.PrintCondition();
+#endif // USE_SLAB_ALLOCATOR
+#if USE_HANDLE_SPACE == 1
+    std::cout << "Handle space: ";
+    handleSpace.PrintCondition();
+#endif // USE_HANDLE_SPACE
+
+    const size_t count = buddyCount;
+    for (size_t i = 0; i < count; i++)
+        buddyAlloc[i]->PrintCondition();
+
+    andi::lock_guard lock{ hugemtx };
+    size_t hugeCount = 0, hugeSize = 0;
+    for (const HugeHeader* header = hugeAllocs.next; header != &hugeAllocs; header = header->next) {
+        ++hugeCount;
+        hugeSize += header->size;
+    }
+    std::cout << "Huge allocations: " << hugeCount << " (" << hugeSize << " bytes).\n\n";
+#if PROFILE_HEAP == 1
+    heapProfile.PrintCondition();
+#endif // PROFILE_HEAP
+#if USE_ALLOCATION_TAGS == 1
+    AllocationTags::PrintCondition();
+#endif // USE_ALLOCATION_TAGS
+#if USE_DEFRAGMENTATION == 1
+    relocations.PrintCondition();
+#endif // USE_DEFRAGMENTATION
+}
+
+#if PROFILE_HEAP == 1
+void MemoryArena::DumpHeapProfile(std::ostream& os) {
+    vassert(initialized && "MemoryArena must be initialized before dumping its heap profile!");
+    heapProfile.Dump(os);
+}
+#endif // PROFILE_HEAP
+
+size_t MemoryArena::BuddyAllocatorCount() {
+    return buddyCount.load(std::memory_order_acquire);
+}
+
+MemoryArena::BuddyStats MemoryArena::GetBuddyStats(size_t idx) {
+    vassert(idx < BuddyAllocatorCount() && "MemoryArena: No such buddy allocator!");
+    const BuddyEngine* buddy = buddyAlloc[idx];
+    return { buddy->FreeSpace(), buddy->LargestFreeBlock(), buddy->Fragmentation() };
+}
+
+#if PROFILE_LOCKS == 1
+andi::lock_stats MemoryArena::PoolLockStats(size_t idx) {
+    vassert(idx < PoolCount && "MemoryArena: No such pool!");
+#if USE_POOL_ALLOCATORS == 1
+    switch (idx) {
+    case 0: return pool0.LockStats();
+    case 1: return pool1.LockStats();
+    case 2: return pool2.LockStats();
+    case 3: return pool3.LockStats();
+    case 4: return pool4.LockStats();
+    case 5: return pool5.LockStats();
+    case 6: return pool6.LockStats();
+    case 7: return pool7.LockStats();
+    }
+#endif // USE_POOL_ALLOCATORS
+    return {};
+}
+
+andi::lock_stats MemoryArena::SlabLockStats() {
+#if USE_SLAB_ALLOCATOR == 1
+    return slabs.LockStats();
+#else
+    return {};
+#endif // USE_SLAB_ALLOCATOR
+}
+
+andi::lock_stats MemoryArena::BuddyLockStats(size_t idx) {
+    vassert(idx < BuddyAllocatorCount() && "MemoryArena: No such buddy allocator!");
+    return buddyAlloc[idx]->LockStats();
+}
+
+#if USE_HANDLE_SPACE == 1
+andi::lock_stats MemoryArena::HandleLockStats() {
+    return handleSpace.LockStats();
+}
+#endif // USE_HANDLE_SPACE
+
+void MemoryArena::ResetLockStats() {
+#if USE_POOL_ALLOCATORS == 1
+    pool0.mtx.reset_stats();
+    pool1.mtx.reset_stats();
+    pool2.mtx.reset_stats();
+    pool3.mtx.reset_stats();
+    pool4.mtx.reset_stats();
+    pool5.mtx.reset_stats();
+    pool6.mtx.reset_stats();
+    pool7.mtx.reset_stats();
+#endif // USE_POOL_ALLOCATORS
+#if USE_SLAB_ALLOCATOR == 1
+    for (uint32_t c = 0; c < Constants::SlabClassCount; c++)
+        slabs.classes[c].mtx.reset_stats();
+    slabs.slabSpace.mtx.reset_stats();
+#endif // USE_SLAB_ALLOCATOR
+#if USE_HANDLE_SPACE == 1
+    handleSpace.mtx.reset_stats();
+#endif // USE_HANDLE_SPACE
+#if USE_LOCKFREE_BUDDY == 0
+    const size_t count = buddyCount;
+    for (size_t i = 0; i < count; i++)
+        buddyAlloc[i]->mtx.reset_stats();
+#endif // USE_LOCKFREE_BUDDY
+}
+#endif // PROFILE_LOCKS
+
+size_t MemoryArena::MaxSize() {
+    return Constants::MaxHugeAllocationSize;
+}
+
+size_t MemoryArena::trim(size_t retainBytes, size_t hysteresisBytes) {
+    size_t released = 0;
+    // Each allocator may keep whatever is left from the retained memory budget
+    auto trimAllocator = [&](auto& alloc) {
+        const std::pair<size_t, size_t> res = alloc.Trim(retainBytes, hysteresisBytes);
+        released += res.first;
+        retainBytes -= (res.second < retainBytes) ? res.second : retainBytes;
+    };
+#if USE_POOL_ALLOCATORS == 1
+    trimAllocator(pool0);
+    trimAllocator(pool1);
+    trimAllocator(pool2);
+    trimAllocator(pool3);
+    trimAllocator(pool4);
+    trimAllocator(pool5);
+    trimAllocator(pool6);
+    trimAllocator(pool7);
+#endif // USE_POOL_ALLOCATORS
+#if USE_SLAB_ALLOCATOR == 1
+    trimAllocator(slabs);
+#endif // USE_SLAB_ALLOCATOR
+#if USE_HANDLE_SPACE == 1
+    trimAllocator(handleSpace);
+#endif // USE_HANDLE_SPACE
+    const size_t count = buddyCount;
+    for (size_t i = 0; i < count; i++)
+        trimAllocator(*buddyAlloc[i]);
+    return released;
+}
+
+void MemoryArena::scavengerLoop(std::chrono::milliseconds interval, size_t retainBytes, size_t hysteresisBytes) {
+    std::unique_lock<std::mutex> lock{ scavengermtx };
+    while (!scavengercv.wait_for(lock, interval, [this] { return scavengerStop; }))
+        trim(retainBytes, hysteresisBytes);
+}
+
+void MemoryArena::refill([[maybe_unused]] size_t lowBytes, [[maybe_unused]] size_t highBytes) {
+    // The memory is always faulted in before the allocators hand it out, outside of their locks
+#if USE_POOL_ALLOCATORS == 1
+    pool0.Refill(lowBytes, highBytes);
+    pool1.Refill(lowBytes, highBytes);
+    pool2.Refill(lowBytes, highBytes);
+    pool3.Refill(lowBytes, highBytes);
+    pool4.Refill(lowBytes, highBytes);
+    pool5.Refill(lowBytes, highBytes);
+    pool6.Refill(lowBytes, highBytes);
+    pool7.Refill(lowBytes, highBytes);
+#endif // USE_POOL_ALLOCATORS
+#if USE_SLAB_ALLOCATOR == 1
+    slabs.Refill(lowBytes, highBytes);
+#endif // USE_SLAB_ALLOCATOR
+    // The buddy allocators are left alone: they split & merge their blocks in O(1) anyway,
+    // and a prefaulted block would merge back into a large one, whose pages all count as
+    // resident - the next trimming would release it whole.
+}
+
+void MemoryArena::refillerLoop(std::chrono::milliseconds interval, size_t lowBytes, size_t highBytes) {
+    std::unique_lock<std::mutex> lock{ refillermtx };
+    while (!refillercv.wait_for(lock, interval, [this] { return refillerStop; }))
+        refill(lowBytes, highBytes);
+}
+
+#if USE_DEFRAGMENTATION == 1
+template<class Pool>
+size_t MemoryArena::defragmentPool(Pool& pool, const RelocationTable::Entry* candidates, size_t count,
+                                   andi::relocate_callback callback, size_t& budgetBytes) {
+    size_t c = 0;
+    while (c < count && !pool.Contains((void*)candidates[c].ptr))
+        c++;
+    // Sorting the free list is not for free, so the pools without candidates are left alone
+    if (c == count)
+        return 0;
+    uint16_t* usedBlocks = (uint16_t*)andi::page_alloc(Pool::PageCount*sizeof(uint16_t));
+    if (usedBlocks == nullptr)
+        return 0;
+    size_t moved = 0;
+    // The originals are freed only after the pass, so that they aren't taken as replacements.
+    // In the meantime they are chained through their first bytes.
+    void* chain = nullptr;
+    // Now the pool hands out its lowest free blocks first
+    if (pool.SortFreeList(usedBlocks)) {
+        for (; c < count && pool.Contains((void*)candidates[c].ptr); c++) {
+            const RelocationTable::Entry& entry = candidates[c];
+            const size_t page = (entry.ptr - uintptr_t(pool.blocksPtr)) / Constants::PageSize;
+            if (usedBlocks[page]*size_t(100) > Pool::BlocksPerPage*Constants::DefragmentMaxOccupancy
+                || entry.size > budgetBytes)
+                continue;
+            void* target = pool.Allocate();
+            if (target == nullptr)
+                break;
+            // The lowest free block is not below this page, so nothing else can move down either
+            if (target >= (void*)&pool.blocksPtr[Pool::pageBegin(page)]) {
+                pool.Deallocate(target);
+                break;
+            }
+            relocate(entry, target, callback);
+            moved += entry.size;
+            budgetBytes -= entry.size;
+            *(void**)entry.ptr = chain;
+            chain = (void*)entry.ptr;
+        }
+    }
+    while (chain != nullptr) {
+        void* next = *(void**)chain;
+        pool.Deallocate(chain);
+        chain = next;
+    }
+    andi::page_free(usedBlocks, Pool::PageCount*sizeof(uint16_t));
+    return moved;
+}
+
+size_t MemoryArena::defragmentBuddies(const RelocationTable::Entry* candidates, size_t count,
+                                      andi::relocate_callback callback, size_t& budgetBytes) {
+    size_t* usedBytes = (size_t*)andi::page_alloc(BuddyEngine::RegionCount*sizeof(size_t));
+    if (usedBytes == nullptr)
+        return 0;
+    size_t moved = 0;
+    const size_t buddies = buddyCount.load(std::memory_order_acquire);
+    for (size_t b = 0; b < buddies; b++) {
+        BuddyEngine* buddy = buddyAlloc[b];
+        size_t c = 0;
+        while (c < count && !buddy->Contains((void*)candidates[c].ptr))
+            c++;
+        if (c == count)
+            continue;
+        buddy->MeasureOccupancy(usedBytes);
+        for (; c < count && buddy->Contains((void*)candidates[c].ptr); c++) {
+            const RelocationTable::Entry& entry = candidates[c];
+            if (entry.size > budgetBytes)
+                continue;
+            const size_t size = BuddyEngine::GoodSize(entry.size);
+            // A large block is judged by a larger region, which it alone wouldn't make dense
+            size_t regionSize = Constants::DefragmentRegionSize;
+            while (size*100 > regionSize*Constants::DefragmentMaxOccupancy && regionSize < Constants::BuddyAllocatorSize)
+                regionSize *= 2;
+            const uintptr_t regionOffset = (entry.ptr - uintptr_t((uint8_t*)buddy->poolPtr)) & ~uintptr_t(regionSize - 1);
+            size_t used = 0;
+            for (size_t r = 0; r < regionSize / Constants::DefragmentRegionSize; r++)
+                used += usedBytes[regionOffset / Constants::DefragmentRegionSize + r];
+            if (used*100 > regionSize*Constants::DefragmentMaxOccupancy)
+                continue;
+            // The originals, freed so far, are not below the region, so they can't be taken again
+            void* target = buddy->AllocateBelow(entry.size, (uint8_t*)buddy->poolPtr + regionOffset);
+            if (target == nullptr)
+                continue;
+            relocate(entry, target, callback);
+            moved += entry.size;
+            budgetBytes -= entry.size;
+            buddy->Deallocate((void*)entry.ptr);
+        }
+    }
+    andi::page_free(usedBytes, BuddyEngine::RegionCount*sizeof(size_t));
+    return moved;
+}
+
+void MemoryArena::relocate(const RelocationTable::Entry& entry, void* target, andi::relocate_callback callback) {
+    callback(entry.context, (void*)entry.ptr, target, entry.size);
+    relocations.Move((void*)entry.ptr, target);
+#if PROFILE_HEAP == 1
+    // The sample isn't carried over, it's dropped like on any deallocation
+    heapProfile.RecordDeallocation((void*)entry.ptr);
+#endif // PROFILE_HEAP
+}
+#endif // USE_DEFRAGMENTATION
+
+bool MemoryArena::Contains(void* ptr) {
+    return (
+#if USE_POOL_ALLOCATORS == 1
+            pool0.Contains(ptr) || pool1.Contains(ptr) ||
+            pool2.Contains(ptr) || pool3.Contains(ptr) ||
+            pool4.Contains(ptr) || pool5.Contains(ptr) ||
+            pool6.Contains(ptr) || pool7.Contains(ptr) ||
+#endif // USE_POOL_ALLOCATORS
+#if USE_SLAB_ALLOCATOR == 1
+            slabs.Contains(ptr) ||
+#endif // USE_SLAB_ALLOCATOR
+#if USE_HANDLE_SPACE == 1
+            handleSpace.Contains(ptr) ||
+#endif // USE_HANDLE_SPACE
+            findBuddyAllocator(ptr) || isHugeAllocation(ptr));
+}
+
+void* MemoryArena::allocateBuddy(size_t n, bool zeroed) {
+    // Huge allocations are always fresh from the system, so they are zero anyway
+    if (n > BuddyEngine::MaxSize())
+        return allocateHuge(n);
+    // Start from a different allocator each time, so that threads don't contend for the same one
+    const size_t count = buddyCount.load(std::memory_order_acquire);
+    const size_t start = toggle.fetch_add(1) % count;
+    for (size_t t = 0; t < count; t++) {
+        BuddyEngine* buddy = buddyAlloc[(start + t) % count];
+        // Don't even lock the ones that surely cannot fit the request
+        if (buddy->LargestFreeBlockBound() < n)
+            continue;
+        if (void* ptr = zeroed ? buddy->AllocateZeroed(n) : buddy->Allocate(n))
+            return ptr;
+    }
+    // All of them are full (or too fragmented), so the arena has to grow. Other threads
+    // may grow it meanwhile & take the new space first, so this goes on until one fits.
+    for (size_t seen = count; addBuddyAllocator(seen) != nullptr; ) {
+        const size_t grown = buddyCount.load(std::memory_order_acquire);
+        for (; seen < grown; seen++) {
+            BuddyEngine* buddy = buddyAlloc[seen];
+            if (void* ptr = zeroed ? buddy->AllocateZeroed(n) : buddy->Allocate(n))
+                return ptr;
+        }
+    }
+    return nullptr;
+}
+
+void MemoryArena::prefaultBuddy(size_t n, size_t count) {
+    // The blocks are allocated & faulted in, and then freed in reverse order, so that they merge
+    // back & the next allocations of this size are carved from the same, now resident, memory.
+    // In the meantime they are chained through their first bytes.
+    void* chain = nullptr;
+    for (size_t i = 0; i < count; i++) {
+        void* ptr = allocateBuddy(n);
+        if (ptr == nullptr)
+            break;
+        andi::page_prefault(ptr, n);
+        *(void**)ptr = chain;
+        chain = ptr;
+    }
+    while (chain != nullptr) {
+        void* next = *(void**)chain;
+        findBuddyAllocator(chain)->Deallocate(chain);
+        chain = next;
+    }
+}
+
+BuddyEngine* MemoryArena::addBuddyAllocator(size_t seenCount) {
+    andi::lock_guard lock{ growthmtx };
+    const size_t count = buddyCount.load(std::memory_order_relaxed);
+    // Another thread may have already added one in the meantime - try it first
+    if (count != seenCount)
+        return buddyAlloc[count - 1];
+    if (count == Constants::MaxBuddyAllocators)
+        return nullptr;
+    BuddyEngine* buddy = new (andi::aligned_malloc(sizeof(BuddyEngine))) BuddyEngine{};
+#if USE_HARDENING == 1
+    const bool buddyInitialized = buddy->Initialize(hardening);
+#else
+    const bool buddyInitialized = buddy->Initialize();
+#endif // USE_HARDENING
+    if (!buddyInitialized) {
+        andi::aligned_free(buddy);
+        return nullptr;
+    }
+    buddyAlloc[count] = buddy;
+    buddyKeys[count] = uintptr_t((void*)buddy->poolPtr) >> Constants::K;
+    // Publish the new allocator only after its key is in place
+    buddyCount.store(count + 1, std::memory_order_release);
+    return buddy;
+}
+
+BuddyEngine* MemoryArena::findBuddyAllocator(void* ptr) {
+    const uintptr_t key = uintptr_t(ptr) >> Constants::K;
+    const size_t count = buddyCount.load(std::memory_order_acquire);
+    for (size_t i = 0; i < count; i++)
+        if (buddyKeys[i] == key)
+            return buddyAlloc[i];
+    return nullptr;
+}
+
+void* MemoryArena::allocateHuge(size_t n) {
+    if (n > MaxSize())
+        return nullptr;
+    const size_t size = ((n + Constants::PageSize - 1) & ~size_t(Constants::PageSize - 1)) + Constants::PageSize;
+    HugeHeader* header = (HugeHeader*)andi::page_alloc(size);
+    if (header == nullptr)
+        return nullptr;
+    header->size = size;
+    andi::lock_guard lock{ hugemtx };
+    header->next = hugeAllocs.next;
+    header->prev = &hugeAllocs;
+    header->next->prev = header;
+    hugeAllocs.next = header;
+    return (void*)(uintptr_t(header) + Constants::PageSize);
+}
+
+void MemoryArena::deallocateHuge(void* ptr) {
+    vassert((uintptr_t(ptr) % Constants::PageSize == 0)
+        && "MemoryArena: Attempting to free a non-aligned pointer!");
+    HugeHeader* header = (HugeHeader*)(uintptr_t(ptr) - Constants::PageSize);
+    {
+        andi::lock_guard lock{ hugemtx };
+        header->prev->next = header->next;
+        header->next->prev = header->prev;
+    }
+    andi::page_free(header, header->size);
+}
+
+bool MemoryArena::isHugeAllocation(void* ptr) {
+    andi::lock_guard lock{ hugemtx };
+    for (const HugeHeader* header = hugeAllocs.next; header != &hugeAllocs; header = header->next)
+        if (uintptr_t(header) + Constants::PageSize == uintptr_t(ptr))
+            return true;
+    return false;
+}
+
+#if USE_ALLOCATION_TAGS == 1
+size_t MemoryArena::usefulSize(void* ptr) {
+#if USE_POOL_ALLOCATORS == 1
+    if (pool0.Contains(ptr))
+        return pool0.MaxSize();
+    else if (pool1.Contains(ptr))
+        return pool1.MaxSize();
+    else if (pool2.Contains(ptr))
+        return pool2.MaxSize();
+    else if (pool3.Contains(ptr))
+        return pool3.MaxSize();
+    else if (pool4.Contains(ptr))
+        return pool4.MaxSize();
+    else if (pool5.Contains(ptr))
+        return pool5.MaxSize();
+    else if (pool6.Contains(ptr))
+        return pool6.MaxSize();
+    else if (pool7.Contains(ptr))
+        return pool7.MaxSize();
+#endif // USE_POOL_ALLOCATORS
+#if USE_SLAB_ALLOCATOR == 1
+    if (slabs.Contains(ptr))
+        return slabs.UsefulSize(ptr);
+#endif // USE_SLAB_ALLOCATOR
+#if USE_HANDLE_SPACE == 1
+    if (handleSpace.Contains(ptr))
+        return handleSpace.UsefulSize(ptr);
+#endif // USE_HANDLE_SPACE
+    if (BuddyEngine* buddy = findBuddyAllocator(ptr))
+        return buddy->UsefulSize(ptr);
+#if USE_HARDENING == 1
+    // A foreign pointer will only be reported, it has no header to read
+    if (hardening && !isHugeAllocation(ptr))
+        return 0;
+#endif // USE_HARDENING
+    // A huge allocation's size includes the header page
+    return ((HugeHeader*)(uintptr_t(ptr) - Constants::PageSize))->size - Constants::PageSize;
+}
+#endif // USE_ALLOCATION_TAGS
+
+#if (USE_ALLOCATION_TAGS == 1 || PROFILE_HEAP == 1) && USE_HARDENING == 1
+bool MemoryArena::acceptsFree(void* ptr) {
+    // The same dispatch as in Deallocate(), but only asking the hardened allocators
+    if (!hardening)
+        return true;
+#if USE_POOL_ALLOCATORS == 1
+    if (pool0.Contains(ptr))
+        return pool0.IsAllocated(ptr);
+    else if (pool1.Contains(ptr))
+        return pool1.IsAllocated(ptr);
+    else if (pool2.Contains(ptr))
+        return pool2.IsAllocated(ptr);
+    else if (pool3.Contains(ptr))
+        return pool3.IsAllocated(ptr);
+    else if (pool4.Contains(ptr))
+        return pool4.IsAllocated(ptr);
+    else if (pool5.Contains(ptr))
+        return pool5.IsAllocated(ptr);
+    else if (pool6.Contains(ptr))
+        return pool6.IsAllocated(ptr);
+    else if (pool7.Contains(ptr))
+        return pool7.IsAllocated(ptr);
+#endif // USE_POOL_ALLOCATORS
+#if USE_SLAB_ALLOCATOR == 1
+    if (slabs.Contains(ptr))
+        return slabs.IsAllocated(ptr);
+#endif // USE_SLAB_ALLOCATOR
+#if USE_HANDLE_SPACE == 1
+    if (handleSpace.Contains(ptr))
+        return handleSpace.IsAllocated(ptr);
+#endif // USE_HANDLE_SPACE
+    if (BuddyEngine* buddy = findBuddyAllocator(ptr))
+        return buddy->IsAllocated(ptr);
+    return isHugeAllocation(ptr);
+}
+#endif // (USE_ALLOCATION_TAGS || PROFILE_HEAP) && USE_HARDENING
+
+// iei
@@ -1,50 +1,337 @@
-﻿#pragma once
-#include "PoolAllocator.h"
-#include "BuddyAllocator.h"
-
-// Forward declaration of the allocator, which can access the arena's methods. Of course, memory
-// can always be allocated & deallocated using MemoryArena::Allocate() and MemoryArena::Deallocate()
-namespace andi { template<class> class allocator; }
-
-// The MemoryArena is a singleton (!) and all memory operations go through it.
-// It manages several memory pools and is the only one that can access them directly.
-class MemoryArena {
-    template<class> friend class andi::allocator;
-
-#if USE_POOL_ALLOCATORS == 1
-    PoolAllocator<  32, Constants::PoolSize0> pool0;
-    PoolAllocator<  64, Constants::PoolSize1> pool1;
-    PoolAllocator< 128, Constants::PoolSize2> pool2;
-    PoolAllocator< 256, Constants::PoolSize3> pool3;
-    PoolAllocator< 512, Constants::PoolSize4> pool4;
-    PoolAllocator<1024, Constants::PoolSize5> pool5;
-#endif // USE_POOL_ALLOCATORS
-
-    BuddyAllocator buddyAlloc[2];
-    std::atomic<uint32_t> toggle;
-    andi::mutex initializationmtx;
-    std::atomic<bool> initialized;
-
-    // look-up "static initialization fiasco"
-    static MemoryArena arena;
-
-    MemoryArena();
-    static bool Contains(void*);
-public:
-    // moving or copying of arenas is forbidden
-    MemoryArena(const MemoryArena&) = delete;
-    MemoryArena& operator=(const MemoryArena&) = delete;
-    MemoryArena(MemoryArena&&) = delete;
-    MemoryArena& operator=(MemoryArena&&) = delete;
-
-    static bool Initialize();
-    static bool Deinitialize();
-    static void* Allocate(size_t);
-    static void Deallocate(void*);
-    static size_t MaxSize();
-    // Returns the number of bytes that the user can actually use before needing a
-    // reallocation (f.e. after an inexact allocation by the internal allocators)
-    static std::pair<void*, size_t> AllocateUseful(size_t);
-    // A very helpful method to print the buddy allocator's state
-    static void PrintCondition();
-};
+﻿#pragma once
+#include "PoolAllocator.h"
+#include "BuddyAllocator.h"
+#include "LockFreeBuddyAllocator.h"
+#include "SlabAllocator.h"
+#include "HeapProfiler.h"
+#include "AllocationTags.h"
+#include "RelocationTable.h"
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+// The engine, managing the arena's large address spaces. Both have the same interface, the
+// lock-free one scales better with many threads, at the cost of rounding up to whole pages.
+#if USE_LOCKFREE_BUDDY == 1
+using BuddyEngine = LockFreeBuddyAllocator;
+#else
+using BuddyEngine = BuddyAllocator;
+#endif // USE_LOCKFREE_BUDDY
+
+// Forward declarations of the allocators, which can access the arena's methods. Of course, memory
+// can always be allocated & deallocated using MemoryArena::Allocate() and MemoryArena::Deallocate()
+namespace andi {
+    template<class> class allocator;
+    template<class> class arena_allocator;
+    template<class> class handle_allocator;
+    template<class> class offset_ptr;
+}
+
+// All memory operations go through a MemoryArena. It manages several memory pools
+// and is the only one that can access them directly.
+// Arenas are independent of each other: each has its own pools, locks & address spaces,
+// so a subsystem with a private arena doesn't contend with the rest of the program, and
+// all its memory can be released at once with Deinitialize(). Memory has to be freed to
+// the same arena it was allocated from. The default arena is used by andi::allocator.
+class MemoryArena {
+    template<class> friend class andi::allocator;
+    template<class> friend class andi::arena_allocator;
+    template<class> friend class andi::handle_allocator;
+    template<class> friend class andi::offset_ptr;
+
+#if USE_POOL_ALLOCATORS == 1
+    PoolAllocator<   8, Constants::PoolSize0> pool0;
+    PoolAllocator<  16, Constants::PoolSize1> pool1;
+    PoolAllocator<  32, Constants::PoolSize2> pool2;
+    PoolAllocator<  64, Constants::PoolSize3> pool3;
+    PoolAllocator< 128, Constants::PoolSize4> pool4;
+    PoolAllocator< 256, Constants::PoolSize5> pool5;
+    PoolAllocator< 512, Constants::PoolSize6> pool6;
+    PoolAllocator<1024, Constants::PoolSize7> pool7;
+#endif // USE_POOL_ALLOCATORS
+#if USE_SLAB_ALLOCATOR == 1
+    SlabAllocator slabs;
+#endif // USE_SLAB_ALLOCATOR
+#if USE_HANDLE_SPACE == 1
+    // A separate buddy allocator, whose blocks are addressed by their 32-bit offsets from
+    // handleBase. Its address space is reserved on initialization and never moves.
+    BuddyAllocator handleSpace;
+    uintptr_t handleBase;
+#endif // USE_HANDLE_SPACE
+#if PROFILE_HEAP == 1
+    HeapProfiler heapProfile;
+#endif // PROFILE_HEAP
+#if USE_DEFRAGMENTATION == 1
+    RelocationTable relocations;
+#endif // USE_DEFRAGMENTATION
+
+    // The buddy allocators' address spaces are aligned at their size, so a pointer's
+    // owner is found by comparing (ptr >> K) against a short array of keys.
+    // New allocators are only ever appended, so lookups need no locking.
+    BuddyEngine* buddyAlloc[Constants::MaxBuddyAllocators];
+    uintptr_t buddyKeys[Constants::MaxBuddyAllocators];
+    std::atomic<size_t> buddyCount;
+    andi::mutex growthmtx;
+    std::atomic<uint32_t> toggle;
+
+    // Allocations too large for the buddy allocators are mapped directly from the system.
+    // Each is preceded by a page with this header, so that they can be listed & unmapped.
+    struct HugeHeader {
+        HugeHeader* prev;
+        HugeHeader* next;
+        size_t size;
+    };
+    HugeHeader hugeAllocs; // sentinel of a cyclic list, just like in the BuddyAllocator
+    andi::mutex hugemtx;
+    andi::mutex initializationmtx;
+    std::atomic<bool> initialized;
+#if USE_HARDENING == 1
+    bool hardening;
+#endif // USE_HARDENING
+    // The optional background thread, returning free memory to the system
+    std::thread scavenger;
+    std::mutex scavengermtx;
+    std::condition_variable scavengercv;
+    bool scavengerStop;
+    // The optional background thread, preparing memory ahead of the requests
+    std::thread refiller;
+    std::mutex refillermtx;
+    std::condition_variable refillercv;
+    bool refillerStop;
+
+    // look-up "static initialization fiasco"
+    static MemoryArena defaultArena;
+
+    bool Contains(void*);
+    // Deinitializes all the allocators & frees the remaining huge allocations.
+    // Works after a failed initialization, too.
+    void deinitializeAllocators();
+    void* allocateBuddy(size_t, bool = false);
+    void prefaultBuddy(size_t, size_t);
+    BuddyEngine* addBuddyAllocator(size_t);
+    BuddyEngine* findBuddyAllocator(void*);
+    void* allocateHuge(size_t);
+    void deallocateHuge(void*);
+    bool isHugeAllocation(void*);
+    size_t trim(size_t, size_t);
+    void scavengerLoop(std::chrono::milliseconds, size_t, size_t);
+    void refill(size_t, size_t);
+    void refillerLoop(std::chrono::milliseconds, size_t, size_t);
+#if USE_ALLOCATION_TAGS == 1
+    // The size of the block, that serves an allocation, as charged to its tag
+    size_t usefulSize(void*);
+#endif // USE_ALLOCATION_TAGS
+#if USE_ALLOCATION_TAGS == 1 || PROFILE_HEAP == 1
+    // Whether Deallocate() would free the pointer, instead of reporting it. It's checked first,
+    // so that the rejected frees are neither credited to their tag nor recorded by the profiler.
+    // It doesn't take the allocators' locks, so two threads freeing the same block at once may
+    // both pass it: only one of the frees is accepted, but both are credited to the tag &
+    // recorded by the profiler. Tag counts & profiles are best-effort after such a double free.
+#if USE_HARDENING == 1
+    bool acceptsFree(void*);
+#else
+    bool acceptsFree(void*) { return true; }
+#endif // USE_HARDENING
+#endif // USE_ALLOCATION_TAGS || PROFILE_HEAP
+#if USE_DEFRAGMENTATION == 1
+    // The passes over the candidates of each allocator, which are adjacent in the snapshot, since
+    // it's sorted by address. They return the bytes moved & take the replacements from the budget.
+    template<class Pool>
+    size_t defragmentPool(Pool&, const RelocationTable::Entry*, size_t, andi::relocate_callback, size_t&);
+    size_t defragmentBuddies(const RelocationTable::Entry*, size_t, andi::relocate_callback, size_t&);
+    void relocate(const RelocationTable::Entry&, void*, andi::relocate_callback);
+#endif // USE_DEFRAGMENTATION
+
+    // The pool, that Allocate() picks for n bytes, or NoPool if it goes to the other allocators
+    static constexpr size_t NoPool = ~size_t(0);
+    static constexpr size_t poolIndex([[maybe_unused]] size_t n) {
+#if USE_POOL_ALLOCATORS == 1
+        for (size_t idx = 0, size = 8; idx < 8; idx++, size *= 2)
+            if (n <= size)
+                return idx;
+#endif // USE_POOL_ALLOCATORS
+        return NoPool;
+    }
+#if USE_POOL_ALLOCATORS == 1
+    template<size_t Idx>
+    auto& pool() {
+        if constexpr (Idx == 0) return pool0;
+        else if constexpr (Idx == 1) return pool1;
+        else if constexpr (Idx == 2) return pool2;
+        else if constexpr (Idx == 3) return pool3;
+        else if constexpr (Idx == 4) return pool4;
+        else if constexpr (Idx == 5) return pool5;
+        else if constexpr (Idx == 6) return pool6;
+        else return pool7;
+    }
+#endif // USE_POOL_ALLOCATORS
+    // Allocation of a size known at compile time, f.e. a single container node. Its pool is
+    // bound statically, so there is no size dispatch, and on deallocation the only pool to
+    // check is that one. A full pool's requests still go to the other allocators, though.
+    template<size_t N>
+    void* allocateFixed() {
+#if USE_POOL_ALLOCATORS == 1
+        if constexpr (poolIndex(N) != NoPool) {
+            vassert(initialized && "MemoryArena must be initialized before allocation!");
+#if USE_ALLOCATION_TAGS == 1
+            if (!AllocationTags::admit(N))
+                return nullptr;
+#endif // USE_ALLOCATION_TAGS
+            auto& owner = pool<poolIndex(N)>();
+            if (void* ptr = owner.Allocate()) {
+#if USE_ALLOCATION_TAGS == 1
+                AllocationTags::charge(owner.MaxSize());
+#endif // USE_ALLOCATION_TAGS
+#if PROFILE_HEAP == 1
+                heapProfile.RecordAllocation(ptr, N);
+#endif // PROFILE_HEAP
+                return ptr;
+            }
+        }
+#endif // USE_POOL_ALLOCATORS
+        return Allocate(N);
+    }
+    template<size_t N>
+    void deallocateFixed(void* ptr) {
+#if USE_POOL_ALLOCATORS == 1
+        if constexpr (poolIndex(N) != NoPool) {
+            auto& owner = pool<poolIndex(N)>();
+            if (owner.Contains(ptr)) {
+                vassert(initialized && "MemoryArena must be initialized before deallocation!");
+#if USE_ALLOCATION_TAGS == 1 || PROFILE_HEAP == 1
+                if (acceptsFree(ptr)) {
+#if USE_ALLOCATION_TAGS == 1
+                    AllocationTags::credit(owner.MaxSize());
+#endif // USE_ALLOCATION_TAGS
+#if PROFILE_HEAP == 1
+                    heapProfile.RecordDeallocation(ptr);
+#endif // PROFILE_HEAP
+                }
+#endif // USE_ALLOCATION_TAGS || PROFILE_HEAP
+                owner.Deallocate(ptr);
+                return;
+            }
+        }
+#endif // USE_POOL_ALLOCATORS
+        Deallocate(ptr);
+    }
+public:
+    MemoryArena(); // no destructor, we rely on Deinitialize
+    // moving or copying of arenas is forbidden
+    MemoryArena(const MemoryArena&) = delete;
+    MemoryArena& operator=(const MemoryArena&) = delete;
+    MemoryArena(MemoryArena&&) = delete;
+    MemoryArena& operator=(MemoryArena&&) = delete;
+
+    static MemoryArena& Default();
+#if USE_HARDENING == 1
+    // Hardening catches invalid, misaligned & double frees, and free list links overwritten
+    // after a use after free, reporting them through andi::set_corruption_handler() & ignoring
+    // the operation instead of corrupting the heap. Every free is checked in O(1): the pools &
+    // slabs keep bitmaps of their allocated blocks, the buddy allocators check their block
+    // tables. It can be selected at runtime, f.e. from a configuration, but only before
+    // Initialize(), since the blocks have to be tracked from the start. It doesn't need
+    // HPC_DEBUG & has a low enough cost for production builds. The allocation tags & the heap
+    // profiler skip the rejected frees, except for a block freed by two threads at the same time.
+    bool SetHardening(bool);
+#endif // USE_HARDENING
+    bool Initialize();
+    bool Deinitialize();
+    void* Allocate(size_t);
+    // Like Allocate(), but the memory is zero-initialized. Memory that is known to be
+    // zero, since it's fresh from the system, is not touched, so large zeroed
+    // allocations cost nothing until they're actually used.
+    void* AllocateZeroed(size_t);
+    void Deallocate(void*);
+    static size_t MaxSize();
+    // Returns the number of bytes that the user can actually use before needing a
+    // reallocation (f.e. after an inexact allocation by the internal allocators)
+    std::pair<void*, size_t> AllocateUseful(size_t);
+    // The number of bytes, that AllocateUseful() would normally return for a request of n
+    // bytes. Requesting exactly that much in the first place wastes no rounding slack.
+    static size_t GoodSize(size_t);
+#if USE_HANDLE_SPACE == 1
+    // Allocations in the handle space, identified by their offset from its base instead of an
+    // address. A handle takes 4 bytes instead of 8, see andi::offset_ptr. The space is a single
+    // buddy allocator, so it holds up to BuddyAllocatorSize bytes & each allocation is at most
+    // MaxAllocationSize bytes. Its memory can also be freed by Deallocate() as a raw pointer.
+    static constexpr uint32_t NullHandle = ~uint32_t(0);
+    uint32_t AllocateHandle(size_t);
+    uint32_t AllocateZeroedHandle(size_t);
+    void DeallocateHandle(uint32_t);
+    void* FromHandle(uint32_t) const;
+    uint32_t ToHandle(const void*) const;
+#endif // USE_HANDLE_SPACE
+    // Returns free memory to the system, until no more than retainBytes of it remain
+    // resident. The pools get to retain their memory first. Returns the bytes released.
+    size_t Trim(size_t retainBytes = 0);
+    // Warm-up for latency-critical startup, so that the first requests don't pay for page faults.
+    // Prepares the memory for the next count allocations of n bytes - a recorded allocation
+    // profile can be replayed by calling it for each size. Huge allocations are not affected.
+    void Prefault(size_t n, size_t count);
+    // Faults in bytes of the buddy allocators' memory, from which the next allocations are carved
+    void Reserve(size_t bytes);
+    // Starts a background thread, which periodically trims the arena whenever the resident
+    // free memory of any allocator exceeds retainBytes + hysteresisBytes. The hysteresis
+    // keeps it from repeatedly releasing & refaulting the same pages under steady load.
+    bool StartScavenger(
+        std::chrono::milliseconds interval = std::chrono::milliseconds{ Constants::ScavengerInterval },
+        size_t retainBytes = Constants::ScavengerRetainedBytes,
+        size_t hysteresisBytes = Constants::ScavengerHysteresisBytes);
+    void StopScavenger();
+    // Starts a background thread, which keeps the free memory of each pool & slab class in use
+    // between the watermarks. Below lowBytes it faults in new memory & links it into the free
+    // lists, so that the requests find it ready, instead of paying for page faults & taking new
+    // slabs on the spot. Above highBytes it returns the excess to the system. The buddy allocators
+    // are not affected, they are still trimmed by the scavenger, which can run alongside.
+    bool StartRefiller(
+        std::chrono::milliseconds interval = std::chrono::milliseconds{ Constants::RefillerInterval },
+        size_t lowBytes = Constants::RefillerLowWatermark,
+        size_t highBytes = Constants::RefillerHighWatermark);
+    void StopRefiller();
+#if USE_DEFRAGMENTATION == 1
+    // Relocatable allocations, which Defragment() may move to another address. The context is
+    // passed to its callback, f.e. the object's owner, which has to update its pointers. They
+    // have to be freed by DeallocateRelocatable(). Only the ones served by the pools & the buddy
+    // allocators are ever moved, and not those made while MaxRelocatableAllocations are tracked.
+    void* AllocateRelocatable(size_t, void* context);
+    void DeallocateRelocatable(void*);
+    // A few live blocks can pin many pool pages & buddy blocks, so that neither merging nor Trim()
+    // can reclaim them. This moves the relocatable allocations out of the pool pages & the buddy
+    // allocators' regions, which are sparse (see DefragmentMaxOccupancy), into free blocks at lower
+    // addresses, from the highest addresses down. The pages & blocks left behind become free, and
+    // can merge & be returned to the system by the next Trim(). No more than budgetBytes are moved,
+    // so that the pass can be spread over time. Returns the bytes moved. Meanwhile the relocatable
+    // allocations must not be freed by other threads, the rest of the arena is used as usual.
+    size_t Defragment(andi::relocate_callback, size_t budgetBytes);
+#endif // USE_DEFRAGMENTATION
+    // Occupancy of the buddy allocators, f.e. for monitoring fragmentation. These take no locks, and are O(1)
+    // except with USE_LOCKFREE_BUDDY, where the largest free block is searched for in the allocator's tree.
+    struct BuddyStats {
+        size_t freeSpace;
+        size_t largestFreeBlock;
+        double fragmentation;
+    };
+    size_t BuddyAllocatorCount();
+    BuddyStats GetBuddyStats(size_t);
+#if PROFILE_LOCKS == 1
+    // Contention of the allocators' locks, f.e. for deciding which size classes need
+    // caching or sharding. Each call locks the respective allocator briefly.
+    static constexpr size_t PoolCount = 8;
+    andi::lock_stats PoolLockStats(size_t);
+    andi::lock_stats SlabLockStats();
+    andi::lock_stats BuddyLockStats(size_t);
+#if USE_HANDLE_SPACE == 1
+    andi::lock_stats HandleLockStats();
+#endif // USE_HANDLE_SPACE
+    void ResetLockStats();
+#endif // PROFILE_LOCKS
+#if PROFILE_HEAP == 1
+    // Writes the sampled allocations, that are still live, & all the sampled so far, by call
+    // stack, in the legacy pprof heap format (see "pprof -inuse_space <binary> <file>").
+    void DumpHeapProfile(std::ostream&);
+#endif // PROFILE_HEAP
+    // A very helpful method to print the buddy allocator's state
+    void PrintCondition();
+};
@@ -0,0 +1,91 @@
+#pragma once
+#include "MemoryArena.h"
+#include <cstddef>
+#include <iterator>
+#include <type_traits>
+
+#if USE_HANDLE_SPACE == 1
+namespace andi
+{
+    // A pointer into the default arena's handle space, stored as a 32-bit offset from its base.
+    // Structures with lots of links (graphs, trees, indices) get half as large this way.
+    // The null pointer is all ones, since offset 0 is the start of the first block.
+    // Raw pointers convert to & from it only explicitly, and have to be in the handle space.
+    // Dereferencing costs a load of the base and an addition. The offsets stay valid only
+    // for as long as the arena stays initialized.
+    template<class T>
+    class offset_ptr {
+        template<class> friend class offset_ptr;
+        uint32_t offset;
+
+        static uintptr_t base() noexcept { return MemoryArena::defaultArena.handleBase; }
+        explicit offset_ptr(uint32_t offset, int) noexcept : offset(offset) {}
+    public:
+        using element_type      = T;
+        using value_type        = std::remove_cv_t<T>;
+        using difference_type   = std::ptrdiff_t;
+        using pointer           = offset_ptr;
+        using reference         = std::add_lvalue_reference_t<T>;
+        using iterator_category = std::random_access_iterator_tag;
+        template<class U> using rebind = offset_ptr<U>;
+
+        offset_ptr() noexcept : offset(MemoryArena::NullHandle) {}
+        offset_ptr(std::nullptr_t) noexcept : offset(MemoryArena::NullHandle) {}
+        explicit offset_ptr(T* ptr) noexcept
+            : offset(ptr ? uint32_t(uintptr_t(ptr) - base()) : MemoryArena::NullHandle) {
+            vassert((!ptr || uintptr_t(ptr) - base() < Constants::BuddyAllocatorSize)
+                && "andi::offset_ptr: The pointer is not in the handle space!");
+        }
+        offset_ptr(const offset_ptr&) = default;
+        offset_ptr& operator=(const offset_ptr&) = default;
+        // Conversions follow the raw pointers' ones, so that f.e. a base class pointer gets adjusted
+        template<class U, class = std::enable_if_t<std::is_convertible_v<U*, T*>>>
+        offset_ptr(const offset_ptr<U>& other) noexcept : offset_ptr(static_cast<T*>(other.get())) {}
+
+        // The handles, returned by MemoryArena::AllocateHandle(), are exactly the offsets
+        static offset_ptr from_handle(uint32_t handle) noexcept { return offset_ptr{ handle, 0 }; }
+        uint32_t handle() const noexcept { return offset; }
+
+        template<class U = T, class = std::enable_if_t<!std::is_void_v<U>>>
+        static offset_ptr pointer_to(U& ref) noexcept { return offset_ptr{ std::addressof(ref) }; }
+
+        T* get() const noexcept {
+            return (offset == MemoryArena::NullHandle) ? nullptr : (T*)(base() + offset);
+        }
+        reference operator*() const noexcept { return *(T*)(base() + offset); }
+        T* operator->() const noexcept { return (T*)(base() + offset); }
+        reference operator[](difference_type i) const noexcept { return ((T*)(base() + offset))[i]; }
+        explicit operator bool() const noexcept { return offset != MemoryArena::NullHandle; }
+
+        offset_ptr& operator+=(difference_type i) noexcept { offset += uint32_t(i * difference_type(sizeof(T))); return *this; }
+        offset_ptr& operator-=(difference_type i) noexcept { offset -= uint32_t(i * difference_type(sizeof(T))); return *this; }
+        offset_ptr& operator++() noexcept { offset += uint32_t(sizeof(T)); return *this; }
+        offset_ptr& operator--() noexcept { offset -= uint32_t(sizeof(T)); return *this; }
+        offset_ptr operator++(int) noexcept { offset_ptr res = *this; ++*this; return res; }
+        offset_ptr operator--(int) noexcept { offset_ptr res = *this; --*this; return res; }
+        friend offset_ptr operator+(offset_ptr p, difference_type i) noexcept { return p += i; }
+        friend offset_ptr operator+(difference_type i, offset_ptr p) noexcept { return p += i; }
+        friend offset_ptr operator-(offset_ptr p, difference_type i) noexcept { return p -= i; }
+        friend difference_type operator-(const offset_ptr& lhs, const offset_ptr& rhs) noexcept {
+            return (difference_type(lhs.offset) - difference_type(rhs.offset)) / difference_type(sizeof(T));
+        }
+
+        // Offsets are ordered like the addresses, nullptr being greater than all others
+        friend bool operator==(const offset_ptr& lhs, const offset_ptr& rhs) noexcept { return lhs.offset == rhs.offset; }
+        friend bool operator!=(const offset_ptr& lhs, const offset_ptr& rhs) noexcept { return lhs.offset != rhs.offset; }
+        friend bool operator< (const offset_ptr& lhs, const offset_ptr& rhs) noexcept { return lhs.offset <  rhs.offset; }
+        friend bool operator> (const offset_ptr& lhs, const offset_ptr& rhs) noexcept { return lhs.offset >  rhs.offset; }
+        friend bool operator<=(const offset_ptr& lhs, const offset_ptr& rhs) noexcept { return lhs.offset <= rhs.offset; }
+        friend bool operator>=(const offset_ptr& lhs, const offset_ptr& rhs) noexcept { return lhs.offset >= rhs.offset; }
+        friend bool operator==(const offset_ptr& lhs, std::nullptr_t) noexcept { return !lhs; }
+        friend bool operator!=(const offset_ptr& lhs, std::nullptr_t) noexcept { return bool(lhs); }
+        friend bool operator==(std::nullptr_t, const offset_ptr& rhs) noexcept { return !rhs; }
+        friend bool operator!=(std::nullptr_t, const offset_ptr& rhs) noexcept { return bool(rhs); }
+    };
+
+    static_assert(sizeof(offset_ptr<int>) == sizeof(uint32_t));
+    static_assert(Constants::BuddyAllocatorSize < MemoryArena::NullHandle); // even one past the end should fit
+}
+#endif // USE_HANDLE_SPACE
+
+// iei
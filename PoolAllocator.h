@@ -1,163 +1,550 @@
-#pragma once
-#include "Defines.h"
-#include "Utilities.h"
-
-template<size_t N, size_t Count>
-class PoolAllocator {
-    // forward declaration...
-    friend class MemoryArena;
-
-    static_assert(N >= Constants::Alignment && !(N&(N - 1)),
-        "N has to be a power of two, no less than the alignment requirement!");
-    static_assert(N >= 2 * sizeof(size_t));
-    struct Smallblock {
-        size_t next;
-        size_t signature;
-        size_t pad[N / sizeof(size_t) - 2];
-    };
-
-    Smallblock* blocksPtr;
-    size_t headIdx;
-    size_t allocatedBlocks;
-    andi::mutex mtx;
-
-    PoolAllocator(); // no destructor, we rely on Deinitialize
-    void Reset();
-    void Initialize();
-    void Deinitialize();
-
-    void* Allocate();
-    void Deallocate(void*);
-    std::pair<void*, size_t> AllocateUseful();
-    void PrintCondition() const;
-    bool Contains(void*) const;
-    static size_t MaxSize();
-#if HPC_DEBUG == 1
-    // Here the signatures work in the other way - only the free blocks are signed
-    static void signFreeBlock(Smallblock&);
-    static void unsignFreeBlock(Smallblock&);
-    static size_t getSignature(const Smallblock&);
-    static bool isSigned(const Smallblock&);
-#endif // HPC_DEBUG
-
-public:
-    // moving or copying of pools is forbidden
-    PoolAllocator(const PoolAllocator&) = delete;
-    PoolAllocator& operator=(const PoolAllocator&) = delete;
-    PoolAllocator(PoolAllocator&&) = delete;
-    PoolAllocator& operator=(PoolAllocator&&) = delete;
-};
-
-template<size_t N, size_t Count>
-PoolAllocator<N, Count>::PoolAllocator() {
-    Reset();
-}
-
-template<size_t N, size_t Count>
-void PoolAllocator<N, Count>::Reset() {
-    blocksPtr = nullptr;
-    headIdx = Constants::InvalidIdx;
-    allocatedBlocks = 0;
-}
-
-template<size_t N, size_t Count>
-void PoolAllocator<N, Count>::Initialize() {
-    andi::lock_guard lock{ mtx };
-    blocksPtr = (Smallblock*)andi::aligned_malloc(N*Count);
-    for (size_t i = 0; i < Count; i++) {
-        blocksPtr[i].next = i + 1;
-#if HPC_DEBUG == 1
-        signFreeBlock(blocksPtr[i]);
-#endif // HPC_DEBUG
-    }
-    blocksPtr[Count - 1].next = Constants::InvalidIdx;
-    headIdx = 0;
-    allocatedBlocks = 0;
-}
-
-template<size_t N, size_t Count>
-void PoolAllocator<N, Count>::Deinitialize() {
-    andi::lock_guard lock{ mtx };
-    andi::aligned_free(blocksPtr);
-    Reset();
-}
-
-template<size_t N, size_t Count>
-void* PoolAllocator<N, Count>::Allocate() {
-    andi::lock_guard lock{ mtx };
-    if (headIdx == Constants::InvalidIdx)
-        return nullptr;
-
-    Smallblock& sblk = blocksPtr[headIdx];
-    headIdx = sblk.next;
-    ++allocatedBlocks;
-#if HPC_DEBUG == 1
-    unsignFreeBlock(sblk);
-#endif // HPC_DEBUG
-    return &sblk;
-}
-
-template<size_t N, size_t Count>
-void PoolAllocator<N, Count>::Deallocate(void* sblk) {
-    vassert((uintptr_t(sblk) - uintptr_t(blocksPtr)) % sizeof(Smallblock) == 0
-        && "MemoryArena: Attempting to free a non-aligned pointer!");
-    vassert(!isSigned(*(Smallblock*)sblk)
-        && "MemoryArena: attempting to free memory that has already been freed!");
-    andi::lock_guard lock{ mtx };
-    size_t idx = (Smallblock*)sblk - blocksPtr;
-#if HPC_DEBUG == 1
-    signFreeBlock(blocksPtr[idx]);
-#endif // HPC_DEBUG
-    --allocatedBlocks;
-    blocksPtr[idx].next = headIdx;
-    headIdx = idx;
-}
-
-template<size_t N, size_t Count>
-std::pair<void*, size_t> PoolAllocator<N, Count>::AllocateUseful() {
-    return { Allocate(), N };
-}
-
-template<size_t N, size_t Count>
-void PoolAllocator<N, Count>::PrintCondition() const {
-    std::cout << "PoolAllocator<" << N << "," << Count << ">:\n"
-        << "  pool size:  " << Count * N << " bytes (" << Count << " blocks)\n"
-        << "  free space: " << (Count - allocatedBlocks)*N << " bytes (" << Count - allocatedBlocks << " blocks)\n"
-        << "  used space: " << allocatedBlocks*N << " bytes (" << allocatedBlocks << " blocks)\n\n";
-}
-
-template<size_t N, size_t Count>
-bool PoolAllocator<N, Count>::Contains(void* ptr) const {
-    return ptr >= blocksPtr && ptr < &blocksPtr[Count];
-}
-
-template<size_t N, size_t Count>
-size_t PoolAllocator<N, Count>::MaxSize() {
-    return N;
-}
-
-#if HPC_DEBUG == 1
-template<size_t N, size_t Count>
-void PoolAllocator<N, Count>::signFreeBlock(Smallblock& sblk) {
-    sblk.signature = getSignature(sblk);
-}
-
-template<size_t N, size_t Count>
-void PoolAllocator<N, Count>::unsignFreeBlock(Smallblock& sblk) {
-    sblk.signature = 0;
-}
-
-template<size_t N, size_t Count>
-size_t PoolAllocator<N, Count>::getSignature(const Smallblock& sblk) {
-    return ~size_t(&sblk);
-}
-
-template<size_t N, size_t Count>
-bool PoolAllocator<N, Count>::isSigned(const Smallblock& sblk) {
-    // There is a 1 in 2^64 chance of a false positive,
-    // decreasing exponentially every time the program is ran.
-    return (sblk.signature == getSignature(sblk));
-}
-#endif // HPC_DEBUG
-
-// iei
+#pragma once
+#include "Defines.h"
+#include "Utilities.h"
+#include <cstring> // std::memset
+
+/*
+ - The pool is a contiguous array of Count blocks of N bytes, reserved
+ directly from the system. Its pages are only backed by memory when used.
+ - Freed blocks are kept in a singly-linked list, threaded through the blocks.
+ - The blocks are aligned at their size, so the 8 & 16 byte ones still satisfy
+ the alignment of anything that fits them. The list link & the debug signature
+ are packed in 8 bytes, so that they fit even the smallest blocks.
+ - Pages that have never been used, or have been returned to the system by
+ Trim(), are kept in a stack. The free blocks of each resident page are counted
+ on every operation, so Trim() finds the fully free pages without walking the
+ list. When the free list runs out, the next released page becomes the "fresh"
+ range, from which blocks are handed out sequentially.
+ - The arena's refiller thread may link released pages into the free list ahead
+ of time with Refill(), faulting them in outside of the lock, so that requests
+ don't have to.
+ - For defragmentation, the free list can be sorted by address, so that the next
+ allocations take the lowest free blocks - the live ones from the sparse pages at
+ the top can then be moved down, until their pages are free & can be trimmed.
+ - A hardened pool (see MemoryArena::SetHardening) keeps a bitmap of its allocated
+ blocks, so that invalid & double frees are caught in O(1), along with the free
+ list links, that point to allocated blocks after a use after free.
+*/
+template<size_t N, size_t Count>
+class PoolAllocator {
+    // forward declaration...
+    friend class MemoryArena;
+
+    static constexpr uint32_t InvalidBlockIdx = ~uint32_t(0);
+    static_assert(N >= 8 && !(N&(N - 1)),
+        "N has to be a power of two, large enough for the free list link!");
+    static_assert(N <= Constants::PageSize);
+    static_assert(Count < InvalidBlockIdx); // block indices should fit in the links
+    struct alignas(N) Smallblock {
+        uint32_t next;
+        uint32_t signature;
+    };
+    static_assert(sizeof(Smallblock) == N);
+    static constexpr size_t BlocksPerPage = Constants::PageSize / N;
+    static constexpr size_t PageCount = (Count + BlocksPerPage - 1) / BlocksPerPage;
+    static_assert(BlocksPerPage < 0xFFFF); // should fit in the page counters
+
+    Smallblock* blocksPtr;
+    uint32_t headIdx;
+    size_t allocatedBlocks;
+    // The range of never used blocks in the page taken last from the released ones
+    size_t freshIdx;
+    size_t freshEnd;
+    // Stack of the pages, not backed by memory, and their count
+    uint32_t* releasedPages;
+    size_t releasedCount;
+    // Number of blocks in the pages, that are backed by memory
+    size_t residentBlocks;
+    // Per-page free block counters (the fresh ones included, 0 for the released pages),
+    // and the number of resident pages, that are fully free
+    uint16_t* pageCounters;
+    size_t freePages;
+#if USE_HARDENING == 1
+    // One bit per block, set while it's allocated. Only a hardened pool has it.
+    uint64_t* allocatedBits;
+    static constexpr size_t BitmapSize = (Count + 63) / 64 * sizeof(uint64_t);
+#endif // USE_HARDENING
+    mutable andi::mutex mtx;
+
+    PoolAllocator(); // no destructor, we rely on Deinitialize
+    void Reset();
+    bool Initialize(bool hardened = false);
+    void Deinitialize();
+
+    void* Allocate();
+    // The never used blocks are still zero, so only the reused ones are cleared
+    void* AllocateZeroed();
+    void Deallocate(void*);
+#if USE_HARDENING == 1
+    // Whether Deallocate() would accept the pointer - always, unless the pool is hardened.
+    // It's read without locking, which is exact for the caller's own block.
+    bool IsAllocated(void*) const;
+#endif // USE_HARDENING
+    std::pair<void*, size_t> AllocateUseful();
+    // Returns fully free pages to the system, until no more than retainBytes of
+    // free memory remain resident. Does nothing if the resident free memory does
+    // not exceed retainBytes + hysteresisBytes. Returns { released, retained } bytes.
+    std::pair<size_t, size_t> Trim(size_t retainBytes, size_t hysteresisBytes);
+    // Faults in the released pages, that the next count allocations would use.
+    // They still contain only zeroes, so they can stay in the stack.
+    void Prefault(size_t count);
+    // Keeps the resident free memory of a pool in use between the watermarks: below lowBytes
+    // released pages are faulted in & linked into the free list, above highBytes it's trimmed.
+    void Refill(size_t lowBytes, size_t highBytes);
+#if USE_DEFRAGMENTATION == 1
+    // Sorts the free list by address & stores the number of allocated blocks in each page
+    // to usedBlocks, which has room for PageCount counters. Returns false if out of memory.
+    bool SortFreeList(uint16_t* usedBlocks);
+#endif // USE_DEFRAGMENTATION
+    void PrintCondition() const;
+    bool Contains(void*) const;
+    static size_t MaxSize();
+#if PROFILE_LOCKS == 1
+    andi::lock_stats LockStats() const;
+#endif // PROFILE_LOCKS
+#if HPC_DEBUG == 1
+    // Here the signatures work in the other way - only the free blocks are signed
+    static void signFreeBlock(Smallblock&);
+    static void unsignFreeBlock(Smallblock&);
+    static uint32_t getSignature(const Smallblock&);
+    static bool isSigned(const Smallblock&);
+#endif // HPC_DEBUG
+#if USE_HARDENING == 1
+    bool isAllocated(uint32_t) const;
+    void markAllocated(uint32_t);
+    // Returns false if the block wasn't allocated
+    bool markFree(uint32_t);
+#endif // USE_HARDENING
+
+    void* allocateBlock(bool&);
+    bool refillFreshBlocks();
+    void countAllocated(uint32_t);
+    void countFreed(uint32_t);
+    static size_t pageBegin(size_t);
+    static size_t pageEnd(size_t);
+
+public:
+    // moving or copying of pools is forbidden
+    PoolAllocator(const PoolAllocator&) = delete;
+    PoolAllocator& operator=(const PoolAllocator&) = delete;
+    PoolAllocator(PoolAllocator&&) = delete;
+    PoolAllocator& operator=(PoolAllocator&&) = delete;
+};
+
+template<size_t N, size_t Count>
+PoolAllocator<N, Count>::PoolAllocator() {
+    Reset();
+}
+
+template<size_t N, size_t Count>
+void PoolAllocator<N, Count>::Reset() {
+    blocksPtr = nullptr;
+    headIdx = InvalidBlockIdx;
+    allocatedBlocks = 0;
+    freshIdx = freshEnd = 0;
+    releasedPages = nullptr;
+    releasedCount = 0;
+    residentBlocks = 0;
+    pageCounters = nullptr;
+    freePages = 0;
+#if USE_HARDENING == 1
+    allocatedBits = nullptr;
+#endif // USE_HARDENING
+}
+
+template<size_t N, size_t Count>
+bool PoolAllocator<N, Count>::Initialize([[maybe_unused]] bool hardened) {
+    andi::lock_guard lock{ mtx };
+    Smallblock* blocks = (Smallblock*)andi::page_alloc(PageCount*Constants::PageSize);
+    uint32_t* released = (uint32_t*)andi::page_alloc(PageCount*sizeof(uint32_t));
+    uint16_t* counters = (uint16_t*)andi::page_alloc(PageCount*sizeof(uint16_t));
+    bool reserved = blocks && released && counters;
+#if USE_HARDENING == 1
+    uint64_t* bits = hardened ? (uint64_t*)andi::page_alloc(BitmapSize) : nullptr;
+    reserved = reserved && (bits || !hardened);
+#endif // USE_HARDENING
+    if (!reserved) {
+        if (blocks)
+            andi::page_free(blocks, PageCount*Constants::PageSize);
+        if (released)
+            andi::page_free(released, PageCount*sizeof(uint32_t));
+        if (counters)
+            andi::page_free(counters, PageCount*sizeof(uint16_t));
+#if USE_HARDENING == 1
+        if (bits)
+            andi::page_free(bits, BitmapSize);
+#endif // USE_HARDENING
+        Reset();
+        return false;
+    }
+    blocksPtr = blocks;
+    releasedPages = released;
+    pageCounters = counters;
+#if USE_HARDENING == 1
+    allocatedBits = bits;
+#endif // USE_HARDENING
+    // No page has been touched yet, so all of them start as released.
+    // They are pushed in reverse, so that the first ones are used first.
+    for (size_t i = 0; i < PageCount; i++)
+        releasedPages[i] = uint32_t(PageCount - 1 - i);
+    releasedCount = PageCount;
+    headIdx = InvalidBlockIdx;
+    allocatedBlocks = 0;
+    freshIdx = freshEnd = 0;
+    residentBlocks = 0;
+    freePages = 0;
+    return true;
+}
+
+template<size_t N, size_t Count>
+void PoolAllocator<N, Count>::Deinitialize() {
+    andi::lock_guard lock{ mtx };
+    // Nothing is reserved, if the initialization has failed
+    if (blocksPtr == nullptr)
+        return;
+    andi::page_free(blocksPtr, PageCount*Constants::PageSize);
+    andi::page_free(releasedPages, PageCount*sizeof(uint32_t));
+    andi::page_free(pageCounters, PageCount*sizeof(uint16_t));
+#if USE_HARDENING == 1
+    if (allocatedBits != nullptr)
+        andi::page_free(allocatedBits, BitmapSize);
+#endif // USE_HARDENING
+    Reset();
+}
+
+template<size_t N, size_t Count>
+void* PoolAllocator<N, Count>::Allocate() {
+    bool fresh;
+    return allocateBlock(fresh);
+}
+
+template<size_t N, size_t Count>
+void* PoolAllocator<N, Count>::AllocateZeroed() {
+    bool fresh;
+    void* ptr = allocateBlock(fresh);
+    if (ptr != nullptr && !fresh)
+        std::memset(ptr, 0, N);
+    return ptr;
+}
+
+template<size_t N, size_t Count>
+void PoolAllocator<N, Count>::Deallocate(void* sblk) {
+#if USE_HARDENING == 1
+    // The invalid frees are reported & ignored, instead of corrupting the free list
+    if (allocatedBits != nullptr && (uintptr_t(sblk) - uintptr_t(blocksPtr)) % sizeof(Smallblock) != 0) {
+        andi::report_corruption(andi::corruption::misaligned_free, sblk, "PoolAllocator");
+        return;
+    }
+#endif // USE_HARDENING
+    vassert((uintptr_t(sblk) - uintptr_t(blocksPtr)) % sizeof(Smallblock) == 0
+        && "MemoryArena: Attempting to free a non-aligned pointer!");
+    andi::lock_guard lock{ mtx };
+    const uint32_t idx = uint32_t((Smallblock*)sblk - blocksPtr);
+#if USE_HARDENING == 1
+    if (allocatedBits != nullptr && !markFree(idx)) {
+        andi::report_corruption(andi::corruption::invalid_free, sblk, "PoolAllocator");
+        return;
+    }
+#endif // USE_HARDENING
+    vassert(!isSigned(blocksPtr[idx])
+        && "MemoryArena: attempting to free memory that has already been freed!");
+#if HPC_DEBUG == 1
+    signFreeBlock(blocksPtr[idx]);
+#endif // HPC_DEBUG
+    --allocatedBlocks;
+    countFreed(idx);
+    blocksPtr[idx].next = headIdx;
+    headIdx = idx;
+}
+
+#if USE_HARDENING == 1
+template<size_t N, size_t Count>
+bool PoolAllocator<N, Count>::IsAllocated(void* ptr) const {
+    const uintptr_t offset = uintptr_t(ptr) - uintptr_t(blocksPtr);
+    return allocatedBits == nullptr
+        || (offset % sizeof(Smallblock) == 0 && isAllocated(uint32_t(offset / sizeof(Smallblock))));
+}
+#endif // USE_HARDENING
+
+template<size_t N, size_t Count>
+std::pair<void*, size_t> PoolAllocator<N, Count>::AllocateUseful() {
+    return { Allocate(), N };
+}
+
+template<size_t N, size_t Count>
+std::pair<size_t, size_t> PoolAllocator<N, Count>::Trim(size_t retainBytes, size_t hysteresisBytes) {
+    andi::lock_guard lock{ mtx };
+    size_t residentFree = residentBlocks - allocatedBlocks;
+    // Without fully free pages there's nothing to release, however much is free
+    if (residentFree*N <= retainBytes + hysteresisBytes || freePages == 0)
+        return { 0, residentFree*N };
+
+    // Select the fully free pages for release, starting from the highest addresses...
+    const size_t firstReleased = releasedCount;
+    size_t listedBlocks = 0;
+    for (size_t p = PageCount; p-- > 0 && residentFree*N > retainBytes && freePages != 0; ) {
+        const size_t pageBlocks = pageEnd(p) - pageBegin(p);
+        if (pageCounters[p] != pageBlocks)
+            continue;
+        pageCounters[p] = 0xFFFF; // mark as released
+        --freePages;
+        releasedPages[releasedCount++] = uint32_t(p);
+        residentBlocks -= pageBlocks;
+        residentFree -= pageBlocks;
+        listedBlocks += pageBlocks;
+    }
+    if (freshIdx != freshEnd && pageCounters[freshIdx / BlocksPerPage] == 0xFFFF) {
+        listedBlocks -= freshEnd - freshIdx;
+        freshIdx = freshEnd = 0;
+    }
+    // ...remove their blocks from the free list, keeping its order, until all are found...
+    for (uint32_t* link = &headIdx; *link != InvalidBlockIdx && listedBlocks != 0; ) {
+        if (pageCounters[*link / BlocksPerPage] == 0xFFFF) {
+            *link = blocksPtr[*link].next;
+            --listedBlocks;
+        } else {
+            link = &blocksPtr[*link].next;
+        }
+    }
+    // ...and only then give them back, since the list is threaded through them
+    size_t released = 0;
+    for (size_t i = firstReleased; i < releasedCount; i++) {
+        const size_t p = releasedPages[i];
+        pageCounters[p] = 0;
+        andi::page_release(&blocksPtr[pageBegin(p)], (pageEnd(p) - pageBegin(p))*N);
+        released += (pageEnd(p) - pageBegin(p))*N;
+    }
+    return { released, residentFree*N };
+}
+
+template<size_t N, size_t Count>
+void PoolAllocator<N, Count>::Prefault(size_t count) {
+    andi::lock_guard lock{ mtx };
+    // The free list & the fresh range are resident already
+    size_t ready = residentBlocks - allocatedBlocks;
+    for (size_t i = releasedCount; i-- > 0 && ready < count; ) {
+        const size_t p = releasedPages[i];
+        andi::page_prefault(&blocksPtr[pageBegin(p)], (pageEnd(p) - pageBegin(p))*N);
+        ready += pageEnd(p) - pageBegin(p);
+    }
+}
+
+template<size_t N, size_t Count>
+void PoolAllocator<N, Count>::Refill(size_t lowBytes, size_t highBytes) {
+    Trim(highBytes, Constants::RefillerHysteresisBytes);
+    for (;;) {
+        size_t p;
+        {
+            andi::lock_guard lock{ mtx };
+            // Pools, that have never been used, are left alone
+            if (residentBlocks == 0 || (residentBlocks - allocatedBlocks)*N >= lowBytes || releasedCount == 0)
+                return;
+            p = releasedPages[--releasedCount];
+        }
+        // The page is in neither the stack nor the free list, so no one else can touch it meanwhile
+        const size_t begin = pageBegin(p), end = pageEnd(p);
+        andi::page_prefault(&blocksPtr[begin], (end - begin)*N);
+        for (size_t idx = begin; idx < end; idx++) {
+            blocksPtr[idx].next = uint32_t(idx + 1);
+#if HPC_DEBUG == 1
+            signFreeBlock(blocksPtr[idx]);
+#endif // HPC_DEBUG
+        }
+        andi::lock_guard lock{ mtx };
+        blocksPtr[end - 1].next = headIdx;
+        headIdx = uint32_t(begin);
+        residentBlocks += end - begin;
+        pageCounters[p] = uint16_t(end - begin);
+        ++freePages;
+    }
+}
+
+#if USE_DEFRAGMENTATION == 1
+template<size_t N, size_t Count>
+bool PoolAllocator<N, Count>::SortFreeList(uint16_t* usedBlocks) {
+    // A bit per block, set for the free ones in the list
+    constexpr size_t FreeBitsSize = (Count + 63) / 64 * sizeof(uint64_t);
+    uint64_t* freeBits = (uint64_t*)andi::page_alloc(FreeBitsSize);
+    if (freeBits == nullptr)
+        return false;
+    {
+        andi::lock_guard lock{ mtx };
+        for (size_t p = 0; p < PageCount; p++)
+            usedBlocks[p] = uint16_t(pageEnd(p) - pageBegin(p));
+        for (size_t i = 0; i < releasedCount; i++)
+            usedBlocks[releasedPages[i]] = 0;
+        if (freshIdx != freshEnd)
+            usedBlocks[freshIdx / BlocksPerPage] -= uint16_t(freshEnd - freshIdx);
+        for (uint32_t idx = headIdx; idx != InvalidBlockIdx; idx = blocksPtr[idx].next) {
+            freeBits[idx / 64] |= uint64_t(1) << (idx % 64);
+            --usedBlocks[idx / BlocksPerPage];
+        }
+        // Relink the blocks in the order of their bits. The signatures depend only on the
+        // addresses, and so stay valid.
+        uint32_t* link = &headIdx;
+        for (size_t w = 0; w < FreeBitsSize / sizeof(uint64_t); w++) {
+            for (uint64_t bits = freeBits[w]; bits != 0; bits &= bits - 1) {
+                const uint32_t idx = uint32_t(w*64 + leastSetBit(bits));
+                *link = idx;
+                link = &blocksPtr[idx].next;
+            }
+        }
+        *link = InvalidBlockIdx;
+    }
+    andi::page_free(freeBits, FreeBitsSize);
+    return true;
+}
+#endif // USE_DEFRAGMENTATION
+
+template<size_t N, size_t Count>
+void PoolAllocator<N, Count>::PrintCondition() const {
+    std::cout << "PoolAllocator<" << N << "," << Count << ">:\n"
+        << "  pool size:  " << Count * N << " bytes (" << Count << " blocks)\n"
+        << "  free space: " << (Count - allocatedBlocks)*N << " bytes (" << Count - allocatedBlocks << " blocks)\n"
+        << "  used space: " << allocatedBlocks*N << " bytes (" << allocatedBlocks << " blocks)\n"
+        << "  resident:   " << residentBlocks*N << " bytes (" << PageCount - releasedCount << " pages)\n";
+#if PROFILE_LOCKS == 1
+    LockStats().print(std::cout);
+#endif // PROFILE_LOCKS
+    std::cout << "\n";
+}
+
+template<size_t N, size_t Count>
+bool PoolAllocator<N, Count>::Contains(void* ptr) const {
+    return ptr >= blocksPtr && ptr < &blocksPtr[Count];
+}
+
+template<size_t N, size_t Count>
+size_t PoolAllocator<N, Count>::MaxSize() {
+    return N;
+}
+
+#if PROFILE_LOCKS == 1
+template<size_t N, size_t Count>
+andi::lock_stats PoolAllocator<N, Count>::LockStats() const {
+    return mtx.stats();
+}
+#endif // PROFILE_LOCKS
+
+#if HPC_DEBUG == 1
+template<size_t N, size_t Count>
+void PoolAllocator<N, Count>::signFreeBlock(Smallblock& sblk) {
+    sblk.signature = getSignature(sblk);
+}
+
+template<size_t N, size_t Count>
+void PoolAllocator<N, Count>::unsignFreeBlock(Smallblock& sblk) {
+    sblk.signature = 0;
+}
+
+template<size_t N, size_t Count>
+uint32_t PoolAllocator<N, Count>::getSignature(const Smallblock& sblk) {
+    return ~uint32_t(uintptr_t(&sblk));
+}
+
+template<size_t N, size_t Count>
+bool PoolAllocator<N, Count>::isSigned(const Smallblock& sblk) {
+    // There is a 1 in 2^32 chance of a false positive,
+    // decreasing exponentially every time the program is ran.
+    return (sblk.signature == getSignature(sblk));
+}
+#endif // HPC_DEBUG
+
+#if USE_HARDENING == 1
+template<size_t N, size_t Count>
+bool PoolAllocator<N, Count>::isAllocated(uint32_t idx) const {
+    return (allocatedBits[idx / 64] >> (idx % 64)) & 1;
+}
+
+template<size_t N, size_t Count>
+void PoolAllocator<N, Count>::markAllocated(uint32_t idx) {
+    allocatedBits[idx / 64] |= uint64_t(1) << (idx % 64);
+}
+
+template<size_t N, size_t Count>
+bool PoolAllocator<N, Count>::markFree(uint32_t idx) {
+    if (!isAllocated(idx))
+        return false;
+    allocatedBits[idx / 64] &= ~(uint64_t(1) << (idx % 64));
+    return true;
+}
+#endif // USE_HARDENING
+
+template<size_t N, size_t Count>
+void* PoolAllocator<N, Count>::allocateBlock(bool& fresh) {
+    andi::lock_guard lock{ mtx };
+#if USE_HARDENING == 1
+    // A use after free overwrites the free block's link first. The rest of the
+    // list cannot be trusted then, so it's abandoned for the never used blocks.
+    if (allocatedBits != nullptr && headIdx != InvalidBlockIdx) {
+        const uint32_t next = blocksPtr[headIdx].next;
+        if (next != InvalidBlockIdx && (next >= Count || isAllocated(next))) {
+            andi::report_corruption(andi::corruption::corrupted_free_list, &blocksPtr[headIdx], "PoolAllocator");
+            headIdx = InvalidBlockIdx;
+        }
+    }
+#endif // USE_HARDENING
+    uint32_t idx;
+    if (headIdx == InvalidBlockIdx) {
+        // Fall back to the never used blocks
+        fresh = true;
+        if (freshIdx == freshEnd && !refillFreshBlocks())
+            return nullptr;
+        idx = uint32_t(freshIdx++);
+    } else {
+        fresh = false;
+        idx = headIdx;
+        headIdx = blocksPtr[idx].next;
+#if HPC_DEBUG == 1
+        unsignFreeBlock(blocksPtr[idx]);
+#endif // HPC_DEBUG
+    }
+    ++allocatedBlocks;
+    countAllocated(idx);
+#if USE_HARDENING == 1
+    if (allocatedBits != nullptr)
+        markAllocated(idx);
+#endif // USE_HARDENING
+    return &blocksPtr[idx];
+}
+
+template<size_t N, size_t Count>
+bool PoolAllocator<N, Count>::refillFreshBlocks() {
+    if (releasedCount == 0)
+        return false;
+    // Released pages contain only zeroes, so there's no need to link their blocks
+    const size_t p = releasedPages[--releasedCount];
+    freshIdx = pageBegin(p);
+    freshEnd = pageEnd(p);
+    residentBlocks += freshEnd - freshIdx;
+    pageCounters[p] = uint16_t(freshEnd - freshIdx);
+    ++freePages;
+    return true;
+}
+
+template<size_t N, size_t Count>
+void PoolAllocator<N, Count>::countAllocated(uint32_t idx) {
+    const size_t p = idx / BlocksPerPage;
+    if (pageCounters[p]-- == pageEnd(p) - pageBegin(p))
+        --freePages;
+}
+
+template<size_t N, size_t Count>
+void PoolAllocator<N, Count>::countFreed(uint32_t idx) {
+    const size_t p = idx / BlocksPerPage;
+    if (++pageCounters[p] == pageEnd(p) - pageBegin(p))
+        ++freePages;
+}
+
+template<size_t N, size_t Count>
+size_t PoolAllocator<N, Count>::pageBegin(size_t p) {
+    return p*BlocksPerPage;
+}
+
+template<size_t N, size_t Count>
+size_t PoolAllocator<N, Count>::pageEnd(size_t p) {
+    // The last page may be only partially used
+    return (p + 1 < PageCount) ? (p + 1)*BlocksPerPage : Count;
+}
+
+// iei
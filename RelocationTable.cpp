@@ -0,0 +1,126 @@
+#include "RelocationTable.h"
+
+#if USE_DEFRAGMENTATION == 1
+RelocationTable::RelocationTable() {
+    Reset();
+}
+
+void RelocationTable::Reset() {
+    entries = nullptr;
+    count = 0;
+    untracked = 0;
+}
+
+bool RelocationTable::Initialize() {
+    andi::lock_guard lock{ mtx };
+    // The table starts zeroed, i.e. empty
+    entries = (Entry*)andi::page_alloc(Slots*sizeof(Entry));
+    if (!entries) {
+        Reset();
+        return false;
+    }
+    count = 0;
+    untracked = 0;
+    return true;
+}
+
+void RelocationTable::Deinitialize() {
+    andi::lock_guard lock{ mtx };
+    // Nothing is reserved, if the initialization has failed
+    if (entries == nullptr)
+        return;
+    andi::page_free(entries, Slots*sizeof(Entry));
+    Reset();
+}
+
+bool RelocationTable::Insert(void* ptr, size_t size, void* context) {
+    andi::lock_guard lock{ mtx };
+    if (count == Constants::MaxRelocatableAllocations) {
+        ++untracked;
+        return false;
+    }
+    size_t idx = entryIndex(uintptr_t(ptr));
+    while (entries[idx].ptr != 0)
+        idx = (idx + 1) & (Slots - 1);
+    entries[idx] = { uintptr_t(ptr), size, context };
+    ++count;
+    return true;
+}
+
+bool RelocationTable::Remove(void* ptr) {
+    andi::lock_guard lock{ mtx };
+    const size_t idx = find(uintptr_t(ptr));
+    if (idx == Slots)
+        return false;
+    erase(idx);
+    return true;
+}
+
+bool RelocationTable::Move(void* from, void* to) {
+    andi::lock_guard lock{ mtx };
+    const size_t idx = find(uintptr_t(from));
+    if (idx == Slots)
+        return false;
+    Entry entry = entries[idx];
+    erase(idx);
+    // Removing the entry first guarantees a free slot
+    entry.ptr = uintptr_t(to);
+    size_t newIdx = entryIndex(entry.ptr);
+    while (entries[newIdx].ptr != 0)
+        newIdx = (newIdx + 1) & (Slots - 1);
+    entries[newIdx] = entry;
+    ++count;
+    return true;
+}
+
+size_t RelocationTable::Snapshot(Entry* out, size_t capacity) const {
+    andi::lock_guard lock{ mtx };
+    size_t n = 0;
+    for (size_t idx = 0; idx < Slots && n < capacity; idx++)
+        if (entries[idx].ptr != 0)
+            out[n++] = entries[idx];
+    return n;
+}
+
+size_t RelocationTable::Count() const {
+    andi::lock_guard lock{ mtx };
+    return count;
+}
+
+void RelocationTable::PrintCondition() const {
+    andi::lock_guard lock{ mtx };
+    std::cout << "RelocationTable:\n"
+        << "  relocatable allocations: " << count << " (" << untracked << " untracked)\n\n";
+}
+
+size_t RelocationTable::find(uintptr_t ptr) const {
+    size_t idx = entryIndex(ptr);
+    while (entries[idx].ptr != ptr) {
+        if (entries[idx].ptr == 0)
+            return Slots;
+        idx = (idx + 1) & (Slots - 1);
+    }
+    return idx;
+}
+
+void RelocationTable::erase(size_t idx) {
+    --count;
+    // Backward-shift deletion: the following entries, which may move into the
+    // hole without passing their home slot, do so.
+    size_t hole = idx;
+    for (size_t next = (hole + 1) & (Slots - 1); entries[next].ptr != 0; next = (next + 1) & (Slots - 1)) {
+        const size_t home = entryIndex(entries[next].ptr);
+        if (((next - home) & (Slots - 1)) >= ((next - hole) & (Slots - 1))) {
+            entries[hole] = entries[next];
+            hole = next;
+        }
+    }
+    entries[hole].ptr = 0;
+}
+
+size_t RelocationTable::entryIndex(uintptr_t ptr) {
+    return size_t((uint64_t(ptr) * 0x9E3779B97F4A7C15ui64) >> 32) & (Slots - 1);
+}
+#endif // USE_DEFRAGMENTATION
+
+// iei
@@ -0,0 +1,69 @@
+#pragma once
+#include "Defines.h"
+#include "Utilities.h"
+
+/*
+ - The relocation table keeps the arena's relocatable allocations, i.e. the ones
+ that MemoryArena::Defragment() may move (see MemoryArena::AllocateRelocatable).
+ It is compiled in only with USE_DEFRAGMENTATION, and each arena has its own.
+ - Each allocation is kept with its requested size & the context, that the user
+ passed for it, in an open-addressing hash table, keyed by address. Deletion
+ shifts the following entries back, so no tombstones are needed.
+ - The table has a fixed capacity and is reserved from the system on initialization,
+ so it never allocates from the arena it serves. Allocations, that don't fit anymore,
+ are still served - they are just never moved, and counted.
+*/
+#if USE_DEFRAGMENTATION == 1
+namespace andi
+{
+    // Called by MemoryArena::Defragment() for each moved allocation: it has to move the object
+    // to the new block & update all the references to it. The old block is freed after it returns.
+    using relocate_callback = void(*)(void* context, void* from, void* to, size_t size);
+}
+
+class RelocationTable {
+    // forward declaration...
+    friend class MemoryArena;
+
+    struct Entry {
+        uintptr_t ptr; // 0 for an empty slot
+        size_t size;
+        void* context;
+    };
+    static constexpr size_t Slots = 2 * Constants::MaxRelocatableAllocations;
+
+    Entry* entries;
+    size_t count;
+    uint64_t untracked;
+    mutable andi::mutex mtx;
+
+    RelocationTable(); // no destructor, we rely on Deinitialize
+    void Reset();
+    bool Initialize();
+    void Deinitialize();
+
+    // Returns false if the table is full
+    bool Insert(void* ptr, size_t size, void* context);
+    // Returns false if the allocation isn't in the table
+    bool Remove(void*);
+    // Keys the entry of a moved allocation by its new address
+    bool Move(void* from, void* to);
+    // Copies up to capacity entries to the array & returns their number
+    size_t Snapshot(Entry*, size_t capacity) const;
+    size_t Count() const;
+    void PrintCondition() const;
+
+    size_t find(uintptr_t) const;
+    void erase(size_t);
+    static size_t entryIndex(uintptr_t);
+
+public:
+    // moving or copying of tables is forbidden
+    RelocationTable(const RelocationTable&) = delete;
+    RelocationTable& operator=(const RelocationTable&) = delete;
+    RelocationTable(RelocationTable&&) = delete;
+    RelocationTable& operator=(RelocationTable&&) = delete;
+};
+#endif // USE_DEFRAGMENTATION
+
+// iei
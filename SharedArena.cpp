@@ -0,0 +1,226 @@
+#include "SharedArena.h"
+#include <new> // placement new
+#include <thread>
+#include <cstring>
+#if !defined(_MSC_VER)
+#include <cerrno>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+SharedArena::SharedArena() {
+    reset();
+}
+
+void SharedArena::reset() {
+    header = nullptr;
+    space = nullptr;
+    fd = -1;
+}
+
+bool SharedArena::InitializeFile(const char* path) {
+#if defined(_MSC_VER)
+    return false;
+#else
+    return map(open(path, O_RDWR | O_CREAT, 0600));
+#endif
+}
+
+bool SharedArena::InitializeShared(const char* name) {
+#if defined(_MSC_VER)
+    return false;
+#else
+    return map(shm_open(name, O_RDWR | O_CREAT, 0600));
+#endif
+}
+
+bool SharedArena::InitializeAnonymous() {
+#if defined(_MSC_VER)
+    return false;
+#else
+    // Not closed on exec, so that child processes can inherit it
+    return map(memfd_create("andi::SharedArena", 0));
+#endif
+}
+
+bool SharedArena::InitializeDescriptor(int otherfd) {
+#if defined(_MSC_VER)
+    return false;
+#else
+    return map(dup(otherfd));
+#endif
+}
+
+bool SharedArena::Deinitialize() {
+    if (header == nullptr) {
+        vassert(false && "SharedArena has already been deinitialized!");
+        return false;
+    }
+#if !defined(_MSC_VER)
+    munmap(header, MappingSize);
+    close(fd);
+#endif
+    reset();
+    return true;
+}
+
+int SharedArena::Descriptor() const {
+    return fd;
+}
+
+void* SharedArena::Allocate(size_t n) {
+    if (n == 0)
+        return nullptr;
+    vassert(header && "SharedArena must be initialized before allocation!");
+    return space->Allocate(n);
+}
+
+void* SharedArena::AllocateZeroed(size_t n) {
+    if (n == 0)
+        return nullptr;
+    vassert(header && "SharedArena must be initialized before allocation!");
+    return space->AllocateZeroed(n);
+}
+
+void SharedArena::Deallocate(void* ptr) {
+    if (!ptr)
+        return;
+    vassert(header && "SharedArena must be initialized before deallocation!");
+    vassert(Contains(ptr) && "SharedArena: pointer is outside of the arena's address space!");
+    space->Deallocate(ptr);
+}
+
+size_t SharedArena::MaxSize() {
+    return BuddyAllocator::MaxSize();
+}
+
+bool SharedArena::Contains(void* ptr) const {
+    return space != nullptr && space->Contains(ptr);
+}
+
+uint32_t SharedArena::ToOffset(const void* ptr) const {
+    if (ptr == nullptr)
+        return NullOffset;
+    vassert(Contains((void*)ptr) && "SharedArena: pointer is outside of the arena's address space!");
+    return uint32_t((const uint8_t*)ptr - (const uint8_t*)space->poolPtr);
+}
+
+void* SharedArena::FromOffset(uint32_t offset) const {
+    return (offset == NullOffset) ? nullptr : (void*)((uint8_t*)space->poolPtr + offset);
+}
+
+void SharedArena::SetRoot(uint32_t offset) {
+    header->root.store(offset, std::memory_order_release);
+}
+
+uint32_t SharedArena::Root() const {
+    return header->root.load(std::memory_order_acquire);
+}
+
+size_t SharedArena::Trim(size_t retainBytes) {
+    vassert(header && "SharedArena must be initialized before trimming!");
+    return space->Trim(retainBytes, 0).first;
+}
+
+void SharedArena::PrintCondition() const {
+    std::cout << "SharedArena (descriptor " << fd << "):\n";
+    space->PrintCondition();
+}
+
+bool SharedArena::map(int newfd) {
+#if defined(_MSC_VER)
+    return false;
+#else
+    if (newfd < 0)
+        return false;
+    vassert(header == nullptr && "SharedArena has already been initialized!");
+    // A new file is extended to the whole mapping - it's sparse, so this costs nothing.
+    // Two processes may do this at once, which is harmless.
+    struct stat st;
+    if (fstat(newfd, &st) != 0 || (st.st_size == 0 && ftruncate(newfd, off_t(MappingSize)) != 0)
+        || (st.st_size != 0 && size_t(st.st_size) != MappingSize)) {
+        close(newfd);
+        return false;
+    }
+    void* ptr = mmap(nullptr, MappingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_NORESERVE, newfd, 0);
+    if (ptr == MAP_FAILED) {
+        close(newfd);
+        return false;
+    }
+    uint8_t* base = (uint8_t*)ptr;
+    Header* hdr = (Header*)base;
+    BuddyAllocator* buddy = (BuddyAllocator*)(base + SpaceOffset);
+    // The first process to map a new file sets it up, the others wait until it's done. If the
+    // formatting process has died, the file is formatted over again: formatting only writes the
+    // header & the initial Superblock, and nothing else has used the file yet.
+    const auto deadline = std::chrono::steady_clock::now() + FormatTimeout;
+    uint32_t state = hdr->state.load(std::memory_order_acquire);
+    while (state != Ready) {
+        if (state != 0 && !(state & Formatting))
+            break;
+        if (state == 0 || !processAlive(state & ~Formatting)) {
+            if (!hdr->state.compare_exchange_strong(state, Formatting | uint32_t(getpid())))
+                continue;
+            new (buddy) BuddyAllocator{};
+            buddy->format(base + PoolOffset, (SuperblockInfo*)(base + InfoOffset), (uint64_t*)(base + ResidencyOffset));
+            buddy->sharedPages = true;
+            hdr->magic = Magic;
+            hdr->layout = layoutHash();
+            hdr->root.store(NullOffset, std::memory_order_relaxed);
+            hdr->state.store(Ready, std::memory_order_release);
+            break;
+        }
+        if (std::chrono::steady_clock::now() > deadline)
+            break;
+        std::this_thread::yield();
+        state = hdr->state.load(std::memory_order_acquire);
+    }
+    if (hdr->state.load(std::memory_order_acquire) != Ready
+        || hdr->magic != Magic || hdr->layout != layoutHash()) {
+        munmap(ptr, MappingSize);
+        close(newfd);
+        return false;
+    }
+    header = hdr;
+    space = buddy;
+    fd = newfd;
+    return true;
+#endif
+}
+
+uint64_t SharedArena::layoutHash() {
+    // Everything the mapping's contents depend on: the sizes of the structures & tables, the
+    // flags that change them, and the bit positions of SuperblockInfo's fields
+    SuperblockInfo probes[3] = {};
+    probes[0].k = 1;
+    probes[1].free = 1;
+    probes[2].released = 1;
+    uint8_t bits[sizeof(probes)];
+    std::memcpy(bits, probes, sizeof(probes));
+    const uint64_t values[] = {
+        sizeof(BuddyAllocator), sizeof(Superblock), sizeof(SuperblockInfo),
+        Constants::K, Constants::MinAllocationSizeLog, Constants::PageSize, Constants::BuddyAllocatorSize,
+        Constants::SuperblockInfoSize, Constants::ResidencyTableSize, PoolOffset,
+        USE_ADDRESS_ORDERED_BUDDY, USE_HARDENING
+    };
+    uint64_t hash = Magic;
+    for (uint64_t v : values)
+        hash = (hash ^ v) * 0x100000001B3ui64;
+    for (uint8_t b : bits)
+        hash = (hash ^ b) * 0x100000001B3ui64;
+    return hash;
+}
+
+bool SharedArena::processAlive(uint32_t pid) {
+#if defined(_MSC_VER)
+    return true;
+#else
+    // Signal 0 only checks whether the process exists
+    return kill(pid_t(pid), 0) == 0 || errno != ESRCH;
+#endif
+}
+
+// iei
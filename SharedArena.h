@@ -0,0 +1,97 @@
+#pragma once
+#include "Defines.h"
+#include "Utilities.h"
+#include "BuddyAllocator.h"
+#include <chrono>
+
+/*
+ - A single BuddyAllocator space, backed by a file, a POSIX shared memory object
+ or an anonymous memfd instead of private memory. Processes, that map the same
+ one, allocate from the same space & exchange offsets into it instead of copying.
+ - The mapping holds everything: a header, the BuddyAllocator itself, its block
+ & residency tables and the pool, in this order. The allocator's state is
+ position-independent, so each process may map it at a different address.
+ - The BuddyAllocator's lock is a spinlock on an atomic in the mapping, so it
+ works across processes as well. A process that dies while holding it leaves the
+ space locked, though - all processes using it have to be restarted then.
+ - The first process to map a new file formats it, the others wait for it. If it dies
+ meanwhile, which is told by its pid kept in the header, the next one formats the file over
+ again - so the processes have to share a pid namespace. A live one, that doesn't finish
+ within FormatTimeout, makes the others fail to map the file instead of waiting forever.
+ - The header also keeps a hash of the layout: the BuddyAllocator, its tables & the build
+ flags that change them. A file formatted by a different build is refused.
+ - The contents of a file survive the processes, so a restarted one only maps it
+ again & finds its data where it was left. The root offset, kept in the header,
+ is where it can start from.
+ - The file is sparse: only the touched pages take up memory or disk space, and
+ Trim() punches holes in the file for the free ones.
+ - Only POSIX systems are supported - elsewhere initialization fails.
+*/
+class SharedArena {
+    struct Header {
+        uint64_t magic;
+        uint64_t layout;              // layoutHash(), so that different builds don't mix
+        std::atomic<uint32_t> state;  // 0 for a new file, then Formatting | pid & Ready
+        std::atomic<uint32_t> root;
+    };
+    static constexpr uint64_t Magic = 0x616E6469'61726E61ui64;
+    static constexpr uint32_t Formatting = 0x80000000;
+    static constexpr uint32_t Ready = 2;
+    static constexpr std::chrono::seconds FormatTimeout{ 10 };
+    static constexpr size_t SpaceOffset = 64;
+    static constexpr size_t HeaderSize = (SpaceOffset + sizeof(BuddyAllocator) + Constants::PageSize - 1)
+                                       & ~size_t(Constants::PageSize - 1);
+    static constexpr size_t InfoOffset = HeaderSize;
+    static constexpr size_t ResidencyOffset = InfoOffset + Constants::SuperblockInfoSize;
+    static constexpr size_t PoolOffset = ResidencyOffset + Constants::ResidencyTableSize;
+    static constexpr size_t MappingSize = PoolOffset + Constants::BuddyAllocatorSize;
+    static_assert(sizeof(Header) <= SpaceOffset && SpaceOffset % alignof(BuddyAllocator) == 0);
+
+    Header* header;
+    BuddyAllocator* space;
+    int fd;
+
+    bool map(int);
+    void reset();
+    static uint64_t layoutHash();
+    static bool processAlive(uint32_t pid);
+public:
+    SharedArena(); // no destructor, we rely on Deinitialize
+    // moving or copying of arenas is forbidden
+    SharedArena(const SharedArena&) = delete;
+    SharedArena& operator=(const SharedArena&) = delete;
+    SharedArena(SharedArena&&) = delete;
+    SharedArena& operator=(SharedArena&&) = delete;
+
+    // Maps the arena in a file, creating it if it doesn't exist yet
+    bool InitializeFile(const char* path);
+    // Maps the arena in a POSIX shared memory object (see shm_open), creating it if needed.
+    // The object stays until it's removed with shm_unlink(), even if no process maps it.
+    bool InitializeShared(const char* name);
+    // Creates a new, anonymous arena. Other processes can map it through its Descriptor(),
+    // inherited or passed over a UNIX socket, and it goes away when all of them close it.
+    bool InitializeAnonymous();
+    // Maps the arena behind a descriptor, f.e. another process' Descriptor(). It is duplicated,
+    // so the caller still owns the original one.
+    bool InitializeDescriptor(int);
+    // Unmaps the arena. Its contents stay in the file or the shared memory object.
+    bool Deinitialize();
+    int Descriptor() const;
+
+    void* Allocate(size_t);
+    void* AllocateZeroed(size_t);
+    void Deallocate(void*);
+    static size_t MaxSize();
+    bool Contains(void*) const;
+    // Offsets from the pool's start are the same in every process, unlike the addresses
+    static constexpr uint32_t NullOffset = ~uint32_t(0);
+    uint32_t ToOffset(const void*) const;
+    void* FromOffset(uint32_t) const;
+    // The offset, from which a process can find the data structures in the arena
+    void SetRoot(uint32_t);
+    uint32_t Root() const;
+    size_t Trim(size_t retainBytes = 0);
+    void PrintCondition() const;
+};
+
+// iei
@@ -0,0 +1,347 @@
+#include "SlabAllocator.h"
+#include <cstring> // std::memset
+
+SlabAllocator::SlabAllocator() {
+    Reset();
+}
+
+void SlabAllocator::Reset() {
+    headers = nullptr;
+#if USE_HARDENING == 1
+    allocatedBits = nullptr;
+#endif // USE_HARDENING
+    for (uint32_t c = 0; c < Constants::SlabClassCount; c++) {
+        classes[c].partialHead = InvalidSlabIdx;
+        classes[c].slabCount = 0;
+        classes[c].allocatedObjects = 0;
+    }
+}
+
+bool SlabAllocator::Initialize([[maybe_unused]] bool hardened) {
+    if (!slabSpace.Initialize())
+        return false;
+    headers = (SlabHeader*)andi::page_alloc(SlabCount*sizeof(SlabHeader));
+    if (!headers) {
+        slabSpace.Deinitialize();
+        return false;
+    }
+#if USE_HARDENING == 1
+    if (hardened) {
+        allocatedBits = (uint64_t*)andi::page_alloc(SlabCount*BitmapWords*sizeof(uint64_t));
+        if (!allocatedBits) {
+            andi::page_free(headers, SlabCount*sizeof(SlabHeader));
+            slabSpace.Deinitialize();
+            Reset();
+            return false;
+        }
+    }
+#endif // USE_HARDENING
+    for (uint32_t c = 0; c < Constants::SlabClassCount; c++) {
+        andi::lock_guard lock{ classes[c].mtx };
+        classes[c].partialHead = InvalidSlabIdx;
+        classes[c].slabCount = 0;
+        classes[c].allocatedObjects = 0;
+    }
+    return true;
+}
+
+void SlabAllocator::Deinitialize() {
+    // Nothing is reserved, if the initialization has failed
+    if (headers == nullptr)
+        return;
+    slabSpace.Deinitialize();
+    andi::page_free(headers, SlabCount*sizeof(SlabHeader));
+#if USE_HARDENING == 1
+    if (allocatedBits != nullptr)
+        andi::page_free(allocatedBits, SlabCount*BitmapWords*sizeof(uint64_t));
+#endif // USE_HARDENING
+    Reset();
+}
+
+void* SlabAllocator::Allocate(size_t n) {
+    if (n > MaxSize())
+        return nullptr;
+    bool clean;
+    return allocateObject(calculateClass(n), clean);
+}
+
+void* SlabAllocator::AllocateZeroed(size_t n) {
+    if (n > MaxSize())
+        return nullptr;
+    bool clean;
+    void* ptr = allocateObject(calculateClass(n), clean);
+    if (ptr != nullptr && !clean)
+        std::memset(ptr, 0, n);
+    return ptr;
+}
+
+void SlabAllocator::Deallocate(void* ptr) {
+    // The slab cannot go away while one of its objects is in use, so its class can be read without locking
+    const uint32_t s = slabIndex(ptr);
+    SlabHeader& slab = headers[s];
+    const uint32_t c = slab.sizeClass;
+    const size_t offset = uintptr_t(ptr) - slabAddress(s);
+#if USE_HARDENING == 1
+    // The invalid frees are reported & ignored. A slab, that's not in use anymore, has no bits set.
+    if (allocatedBits != nullptr && offset % classSize(c) != 0) {
+        andi::report_corruption(andi::corruption::misaligned_free, ptr, "SlabAllocator");
+        return;
+    }
+#endif // USE_HARDENING
+    vassert(offset % classSize(c) == 0
+        && "MemoryArena: Attempting to free a non-aligned pointer!");
+    SlabClass& cls = classes[c];
+    andi::lock_guard lock{ cls.mtx };
+#if USE_HARDENING == 1
+    if (allocatedBits != nullptr) {
+        uint64_t& word = allocatedBits[s*BitmapWords + offset / classSize(c) / 64];
+        const uint64_t bit = uint64_t(1) << (offset / classSize(c) % 64);
+        if (!(word & bit)) {
+            andi::report_corruption(andi::corruption::invalid_free, ptr, "SlabAllocator");
+            return;
+        }
+        word &= ~bit;
+    }
+#endif // USE_HARDENING
+    vassert(!isSigned((FreeObject*)ptr)
+        && "MemoryArena: attempting to free memory that has already been freed!");
+    if (slab.usedCount-- == slabCapacity(c))
+        linkPartialSlab(s);
+    FreeObject* obj = (FreeObject*)ptr;
+    obj->next = slab.freeHead;
+    slab.freeHead = uint32_t(offset / classSize(c));
+#if HPC_DEBUG == 1
+    signFreeObject(obj);
+#endif // HPC_DEBUG
+    --cls.allocatedObjects;
+    // Empty slabs go back to the buddy allocator, so that they can be merged and trimmed.
+    // The class always keeps one, though, to avoid thrashing around a slab boundary.
+    if (slab.usedCount == 0 && !(cls.partialHead == s && slab.next == InvalidSlabIdx))
+        removeSlab(s);
+}
+
+#if USE_HARDENING == 1
+bool SlabAllocator::IsAllocated(void* ptr) const {
+    if (allocatedBits == nullptr)
+        return true;
+    const uint32_t s = slabIndex(ptr);
+    const size_t size = classSize(headers[s].sizeClass);
+    const size_t offset = uintptr_t(ptr) - slabAddress(s);
+    return offset % size == 0
+        && ((allocatedBits[s*BitmapWords + offset / size / 64] >> (offset / size % 64)) & 1);
+}
+#endif // USE_HARDENING
+
+std::pair<void*, size_t> SlabAllocator::AllocateUseful(size_t n) {
+    void* ptr = Allocate(n);
+    if (ptr == nullptr)
+        return { nullptr, 0 };
+    return { ptr, GoodSize(n) };
+}
+
+size_t SlabAllocator::UsefulSize(void* ptr) const {
+    // Like on deallocation, the slab's class cannot change while the object is in use
+    return classSize(headers[slabIndex(ptr)].sizeClass);
+}
+
+size_t SlabAllocator::GoodSize(size_t n) {
+    return classSize(calculateClass(n));
+}
+
+std::pair<size_t, size_t> SlabAllocator::Trim(size_t retainBytes, size_t hysteresisBytes) {
+    // Only the free slabs can be trimmed, and they are all back in the buddy allocator
+    return slabSpace.Trim(retainBytes, hysteresisBytes);
+}
+
+void SlabAllocator::Prefault(size_t n, size_t count) {
+    if (n > MaxSize())
+        return;
+    const uint32_t c = calculateClass(n);
+    SlabClass& cls = classes[c];
+    andi::lock_guard lock{ cls.mtx };
+    size_t ready = cls.slabCount*slabCapacity(c) - cls.allocatedObjects;
+    while (ready < count && addSlab(c)) {
+        // The new slab is at the head of the class' list
+        andi::page_prefault((void*)slabAddress(cls.partialHead), Constants::SlabSize);
+        ready += slabCapacity(c);
+    }
+}
+
+void SlabAllocator::Refill(size_t lowBytes, size_t highBytes) {
+    for (uint32_t c = 0; c < Constants::SlabClassCount; c++) {
+        SlabClass& cls = classes[c];
+        for (;;) {
+            {
+                andi::lock_guard lock{ cls.mtx };
+                if (cls.slabCount == 0 || (cls.slabCount*slabCapacity(c) - cls.allocatedObjects)*classSize(c) >= lowBytes)
+                    break;
+            }
+            // The slab is faulted in before it's visible to the class, so requests never wait for it
+            bool released;
+            void* ptr = slabSpace.Allocate(Constants::SlabSize, released);
+            if (ptr == nullptr)
+                return;
+            andi::page_prefault(ptr, Constants::SlabSize);
+            andi::lock_guard lock{ cls.mtx };
+            installSlab(c, ptr, released);
+        }
+    }
+    slabSpace.Trim(highBytes, Constants::RefillerHysteresisBytes);
+}
+
+size_t SlabAllocator::MaxSize() {
+    return Constants::MaxSlabAllocationSize;
+}
+
+bool SlabAllocator::Contains(void* ptr) const {
+    return slabSpace.Contains(ptr);
+}
+
+void SlabAllocator::PrintCondition() const {
+    std::cout << "SlabAllocator:\n";
+    for (uint32_t c = 0; c < Constants::SlabClassCount; c++) {
+        const SlabClass& cls = classes[c];
+        if (cls.slabCount != 0) {
+            std::cout << "  " << classSize(c) << "B: " << cls.slabCount << " slabs, "
+                      << cls.allocatedObjects << " used of " << cls.slabCount*slabCapacity(c) << " objects\n";
+#if PROFILE_LOCKS == 1
+            cls.mtx.stats().print(std::cout);
+#endif // PROFILE_LOCKS
+        }
+    }
+    std::cout << "Slab space: ";
+    slabSpace.PrintCondition();
+}
+
+#if PROFILE_LOCKS == 1
+andi::lock_stats SlabAllocator::LockStats() const {
+    andi::lock_stats res{};
+    for (uint32_t c = 0; c < Constants::SlabClassCount; c++)
+        res += classes[c].mtx.stats();
+    return res;
+}
+#endif // PROFILE_LOCKS
+
+#if HPC_DEBUG == 1
+void SlabAllocator::signFreeObject(FreeObject* obj) {
+    obj->signature = getSignature(obj);
+}
+
+size_t SlabAllocator::getSignature(const FreeObject* obj) {
+    return ~size_t(obj);
+}
+
+bool SlabAllocator::isSigned(const FreeObject* obj) {
+    return (obj->signature == getSignature(obj));
+}
+#endif // HPC_DEBUG
+
+void* SlabAllocator::allocateObject(uint32_t c, bool& clean) {
+    SlabClass& cls = classes[c];
+    andi::lock_guard lock{ cls.mtx };
+    if (cls.partialHead == InvalidSlabIdx && !addSlab(c))
+        return nullptr;
+
+    const uint32_t s = cls.partialHead;
+    SlabHeader& slab = headers[s];
+    uint32_t idx;
+    if (slab.freeHead != InvalidSlabIdx) {
+        idx = slab.freeHead;
+        FreeObject* obj = (FreeObject*)(slabAddress(s) + idx*classSize(c));
+        slab.freeHead = obj->next;
+#if HPC_DEBUG == 1
+        obj->signature = 0;
+#endif // HPC_DEBUG
+        clean = false;
+    } else {
+        idx = slab.freshIdx++;
+        clean = (idx*classSize(c) >= slab.cleanFrom);
+#if HPC_DEBUG == 1
+        // The slab's memory may have held objects of another class, whose signatures are still there
+        if (!clean)
+            ((FreeObject*)(slabAddress(s) + idx*classSize(c)))->signature = 0;
+#endif // HPC_DEBUG
+    }
+#if USE_HARDENING == 1
+    if (allocatedBits != nullptr)
+        allocatedBits[s*BitmapWords + idx / 64] |= uint64_t(1) << (idx % 64);
+#endif // USE_HARDENING
+    // Full slabs are not kept in any list, they'll be found again on deallocation
+    if (++slab.usedCount == slabCapacity(c))
+        unlinkPartialSlab(s);
+    ++cls.allocatedObjects;
+    return (void*)(slabAddress(s) + idx*classSize(c));
+}
+
+bool SlabAllocator::addSlab(uint32_t c) {
+    // Slabs are exact powers of two, so the buddy allocator returns them aligned at their size
+    bool released;
+    void* ptr = slabSpace.Allocate(Constants::SlabSize, released);
+    if (ptr == nullptr)
+        return false;
+    installSlab(c, ptr, released);
+    return true;
+}
+
+void SlabAllocator::installSlab(uint32_t c, void* ptr, bool released) {
+    const uint32_t s = slabIndex(ptr);
+    // In a released slab, all but the first page are known to be zero
+    const uint32_t cleanFrom = uint32_t(released ? Constants::PageSize : Constants::SlabSize);
+    headers[s] = { InvalidSlabIdx, 0, 0, c, InvalidSlabIdx, InvalidSlabIdx, cleanFrom };
+    linkPartialSlab(s);
+    ++classes[c].slabCount;
+}
+
+void SlabAllocator::removeSlab(uint32_t s) {
+    unlinkPartialSlab(s);
+    --classes[headers[s].sizeClass].slabCount;
+    slabSpace.Deallocate((void*)slabAddress(s));
+}
+
+void SlabAllocator::linkPartialSlab(uint32_t s) {
+    SlabClass& cls = classes[headers[s].sizeClass];
+    headers[s].prev = InvalidSlabIdx;
+    headers[s].next = cls.partialHead;
+    if (cls.partialHead != InvalidSlabIdx)
+        headers[cls.partialHead].prev = s;
+    cls.partialHead = s;
+}
+
+void SlabAllocator::unlinkPartialSlab(uint32_t s) {
+    SlabHeader& slab = headers[s];
+    if (slab.prev != InvalidSlabIdx)
+        headers[slab.prev].next = slab.next;
+    else
+        classes[slab.sizeClass].partialHead = slab.next;
+    if (slab.next != InvalidSlabIdx)
+        headers[slab.next].prev = slab.prev;
+    slab.prev = slab.next = InvalidSlabIdx;
+}
+
+uintptr_t SlabAllocator::slabAddress(uint32_t s) const {
+    return slabSpace.virtualZero + (uintptr_t(s) << Constants::SlabSizeLog);
+}
+
+uint32_t SlabAllocator::slabIndex(void* ptr) const {
+    return uint32_t((uintptr_t(ptr) - slabSpace.virtualZero) >> Constants::SlabSizeLog);
+}
+
+uint32_t SlabAllocator::calculateClass(size_t n) {
+    if (n <= Constants::MinSlabAllocationSize)
+        return 0;
+    // For 2^m < n <= 2^(m+1), the two bits after the leading one select the quarter
+    const uint32_t m = fastlog2(uint32_t(n - 1));
+    const uint32_t quarter = uint32_t((n - 1) >> (m - 2)) & 3;
+    return (m - fastlog2(uint32_t(Constants::MinSlabAllocationSize))) * 4 + quarter;
+}
+
+size_t SlabAllocator::classSize(uint32_t c) {
+    // Class 4m+q has size (5+q)/4 * 2^m * MinSlabAllocationSize
+    return (5 + size_t(c % 4)) * (Constants::MinSlabAllocationSize / 4) << (c / 4);
+}
+
+uint32_t SlabAllocator::slabCapacity(uint32_t c) {
+    return uint32_t(Constants::SlabSize / classSize(c));
+}
+
+// iei
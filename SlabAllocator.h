@@ -0,0 +1,124 @@
+#pragma once
+#include "Defines.h"
+#include "Utilities.h"
+#include "BuddyAllocator.h"
+
+/*
+ - The slab allocator serves the medium sizes, between the largest pool and
+ the point where power-of-two rounding stops mattering. The sizes are split
+ into SlabClassCount classes, 4 per power of two, so at most 25% is wasted.
+ - Memory comes in fixed-size slabs, allocated from a dedicated BuddyAllocator.
+ Each slab holds objects of a single class: freed objects are kept in a list,
+ threaded through them, and the never used ones are handed out sequentially.
+ - The slab headers are out-of-band, in a table indexed by the slab's offset
+ in the buddy allocator's address space. This way the objects can span the whole
+ slab, and a pointer's slab is found with a single subtraction & shift.
+ - Each size class has its own lock and a list of its slabs with free objects,
+ so different sizes never contend. The buddy allocator is only locked when a
+ slab is taken or given back.
+ - The arena's refiller thread may add slabs ahead of time with Refill(). They
+ are faulted in before they're linked into their class, outside of its lock.
+ - A hardened slab allocator (see MemoryArena::SetHardening) keeps a bitmap of the
+ allocated objects of each slab, so that invalid & double frees are caught in O(1).
+*/
+class SlabAllocator {
+    // forward declaration...
+    friend class MemoryArena;
+
+    struct SlabHeader {
+        uint32_t freeHead;  // first free object, or InvalidSlabIdx
+        uint32_t freshIdx;  // all objects from here on have never been used
+        uint32_t usedCount;
+        uint32_t sizeClass;
+        uint32_t prev;      // neighbours in the size class' list of slabs with free objects
+        uint32_t next;
+        uint32_t cleanFrom; // the never used objects from this offset on contain only zeroes
+    };
+    struct FreeObject {
+        uint32_t next;
+#if HPC_DEBUG == 1
+        uint32_t pad;
+        size_t signature;
+#endif // HPC_DEBUG
+    };
+    // Each size class is on a separate cache line, so that their locks don't interfere
+    struct alignas(64) SlabClass {
+        mutable andi::mutex mtx;
+        uint32_t partialHead;
+        size_t slabCount;
+        size_t allocatedObjects;
+    };
+    static constexpr uint32_t InvalidSlabIdx = ~uint32_t(0);
+    static constexpr size_t SlabCount = Constants::BuddyAllocatorSize >> Constants::SlabSizeLog;
+#if USE_HARDENING == 1
+    // Enough for the objects of the smallest class, which has the most of them in a slab
+    static constexpr size_t BitmapWords = (Constants::SlabSize / (Constants::MinSlabAllocationSize * 5 / 4) + 63) / 64;
+#endif // USE_HARDENING
+
+    BuddyAllocator slabSpace;
+    SlabHeader* headers;
+#if USE_HARDENING == 1
+    // BitmapWords per slab, a bit set for each allocated object. Only when hardened.
+    uint64_t* allocatedBits;
+#endif // USE_HARDENING
+    SlabClass classes[Constants::SlabClassCount];
+
+    SlabAllocator(); // no destructor, we rely on Deinitialize
+    void Reset();
+    bool Initialize(bool hardened = false);
+    void Deinitialize();
+
+    void* Allocate(size_t);
+    void* AllocateZeroed(size_t);
+    void Deallocate(void*);
+#if USE_HARDENING == 1
+    // Whether Deallocate() would accept the pointer, read without locking like in the pools
+    bool IsAllocated(void*) const;
+#endif // USE_HARDENING
+    std::pair<void*, size_t> AllocateUseful(size_t);
+    static size_t GoodSize(size_t);
+    // The size of the object's class
+    size_t UsefulSize(void*) const;
+    std::pair<size_t, size_t> Trim(size_t, size_t);
+    // Adds & faults in enough slabs, so that the next count objects of n bytes are ready.
+    // The empty slabs stay in their class until one of their objects is freed.
+    void Prefault(size_t n, size_t count);
+    // Adds slabs, already faulted in, to the classes in use with less than lowBytes of free objects.
+    // Empty slabs are given back right away, so only the slab space's free memory can be above
+    // highBytes - it's trimmed then.
+    void Refill(size_t lowBytes, size_t highBytes);
+    static size_t MaxSize();
+    bool Contains(void*) const;
+    void PrintCondition() const;
+#if PROFILE_LOCKS == 1
+    // The figures of all size classes' locks together
+    andi::lock_stats LockStats() const;
+#endif // PROFILE_LOCKS
+#if HPC_DEBUG == 1
+    // Like in the pools, only the free objects are signed
+    static void signFreeObject(FreeObject*);
+    static size_t getSignature(const FreeObject*);
+    static bool isSigned(const FreeObject*);
+#endif // HPC_DEBUG
+
+    void* allocateObject(uint32_t, bool&);
+    bool addSlab(uint32_t);
+    void installSlab(uint32_t, void*, bool);
+    void removeSlab(uint32_t);
+    void linkPartialSlab(uint32_t);
+    void unlinkPartialSlab(uint32_t);
+    uintptr_t slabAddress(uint32_t) const;
+    uint32_t slabIndex(void*) const;
+    static uint32_t calculateClass(size_t);
+    static size_t classSize(uint32_t);
+    static uint32_t slabCapacity(uint32_t);
+
+public:
+    // moving or copying of slab allocators is forbidden
+    SlabAllocator(const SlabAllocator&) = delete;
+    SlabAllocator& operator=(const SlabAllocator&) = delete;
+    SlabAllocator(SlabAllocator&&) = delete;
+    SlabAllocator& operator=(SlabAllocator&&) = delete;
+};
+
+// iei
@@ -1,118 +1,288 @@
-#include "Allocator.h"
-#include <thread>
-// STL, used for comparison
-#include <vector>
-#include <map>
-#include <string>
-// for benchmarking
-#include <utility>
-#include <chrono>
-#include <random>
-
-/* TO-DO:
- - implement vassert() w/ DebugBreak()
- - make minimal andi::allocator (Bob Steagall 2017, 43:56)
- */
-
-// For convenience: andi::string instead of std::string, andi::vector<int>, andi::map<...>, etc.
-namespace andi {
-    using string = std::basic_string<char, std::char_traits<char>, andi::allocator<char>>;
-
-    template<class T>
-    using vector = std::vector<T, andi::allocator<T>>;
-    
-    template<class Key, class Value, class Pred = std::less<Key>>
-    using map = std::map<Key, Value, Pred, andi::allocator<std::pair<const Key, Value>>>;
-}
-
-// A simple benchmark + some helper functions
-using std::chrono::microseconds;
-void testRandomStringAllocation(size_t, size_t, size_t, size_t);
-template<template<class> class Allocator>
-microseconds singleTestTimer(const andi::vector<size_t>&);
-
-int main() {
-    MemoryArena::Initialize();
-
-    // 1 thread: up to ~70% faster
-    // 4 threads: up to ~40%
-    std::vector<std::thread> ths;
-    const int nthreads = 1; // the # of threads running in parallel
-    for (int i = 0; i < nthreads; i++)
-        ths.emplace_back(testRandomStringAllocation, 25, 500000, 20, 1000);
-
-    for (auto& th : ths)
-        th.join();
-    
-    MemoryArena::PrintCondition();
-    MemoryArena::Deinitialize();
-}
-
-void testRandomStringAllocation(size_t numReps, size_t nStrings, size_t minLength, size_t maxLength) {
-    // numReps iterations of the following procedure: allocate nStrings
-    // char* arrays with random length between minLength and maxLength,
-    // and then deallocate about a quarter of them. Afterwards, allocate
-    // again the previously deallocated, and stop the timer. The deallocation
-    // of everything at the end of the function is not included in the time.
-    std::mt19937 gen{ static_cast<unsigned>(std::chrono::steady_clock::now().time_since_epoch().count()) };
-    std::uniform_int_distribution<size_t> distr(minLength, maxLength);
-    andi::vector<std::pair<microseconds, microseconds>> times(numReps);
-    andi::vector<size_t> lengths(nStrings);
-
-    for (auto& p : times) {
-        // generate the arrays lengths beforehand
-        for (auto& len : lengths)
-            len = distr(gen);
-        // run a single test
-        p = { singleTestTimer<andi::allocator>(lengths),
-              singleTestTimer<std::allocator>(lengths) };
-    }
-
-    static andi::mutex coutmtx;
-    andi::lock_guard lock{ coutmtx };
-    std::cout << "Testing " << nStrings << " string allocations and ~" << nStrings / 4 << " reallocations...\n";
-    std::cout << "String length between " << minLength << " and " << maxLength << ".\n";
-    // Print the timings from the tests
-    double a = 0., s = 0.;
-    std::cout << "andi::allocator\tstd::allocator\tdifference\t(%)\n";
-    for (const auto& p : times) {
-        const double a_ = double(p.first.count()) / 1000.;
-        const double s_ = double(p.second.count()) / 1000.;
-        a += a_; s += s_;
-        std::cout << "  " << a_ << "ms\t  " << s_ << "ms\t" << a_ - s_
-            << "ms\t(" << 100 * (a_ - s_) / s_ << "%)\n";
-    }
-    a /= times.size();
-    s /= times.size();
-    std::cout << "Average:\n  " << a << "ms\t  " << s << "ms\t" << a - s << "ms\t(" << 100 * (a - s) / s << "%)\n";
-    std::cout << "\n";
-}
-
-template<template<class> class Allocator>
-microseconds singleTestTimer(const andi::vector<size_t>& lengths) {
-    const size_t n = lengths.size();
-
-    auto start = std::chrono::steady_clock::now();
-    char** strings = Allocator<char*>().allocate(n);
-    Allocator<char> al;
-    for (size_t i = 0; i < n; i++)
-        strings[i] = al.allocate(lengths[i]);
-    
-    for (size_t i = 0; i < n; i++)
-        if (lengths[i] % 4 == 0)
-            al.deallocate(strings[i], lengths[i]);
-    
-    for (size_t i = 0; i < n; i++)
-        if (lengths[i] % 4 == 0)
-            strings[i] = al.allocate(lengths[i]);
-    
-    auto end = std::chrono::steady_clock::now();
-
-    for (size_t i = 0; i < n; i++)
-        al.deallocate(strings[i], lengths[i]);
-    Allocator<char*>().deallocate(strings, n);
-
-    return std::chrono::duration_cast<microseconds>(end - start);
-}
-
-// iei
+#include "Allocator.h"
+#include <thread>
+// STL, used for comparison
+#include <vector>
+#include <map>
+#include <string>
+// for benchmarking
+#include <utility>
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include <cstring> // std::memset
+
+/* TO-DO:
+ - implement vassert() w/ DebugBreak()
+ - make minimal andi::allocator (Bob Steagall 2017, 43:56)
+ */
+
+// A simple benchmark + some helper functions
+using std::chrono::microseconds;
+void testRandomStringAllocation(size_t, size_t, size_t, size_t);
+void testBuddyScaling(size_t);
+void testFirstAllocations(size_t);
+void testRefiller(size_t);
+#if USE_DEFRAGMENTATION == 1
+void testDefragmentation(size_t);
+#endif // USE_DEFRAGMENTATION
+template<template<class> class Allocator>
+microseconds singleTestTimer(const andi::vector<size_t>&);
+
+int main() {
+    MemoryArena::Default().Initialize();
+
+    // 1 thread: up to ~70% faster
+    // 4 threads: up to ~40%
+    std::vector<std::thread> ths;
+    const int nthreads = 1; // the # of threads running in parallel
+    for (int i = 0; i < nthreads; i++)
+        ths.emplace_back(testRandomStringAllocation, 25, 500000, 20, 1000);
+
+    for (auto& th : ths)
+        th.join();
+
+    testBuddyScaling(20000);
+    testFirstAllocations(20000);
+    testRefiller(200);
+#if USE_DEFRAGMENTATION == 1
+    testDefragmentation(100000);
+#endif // USE_DEFRAGMENTATION
+    
+    MemoryArena::Default().PrintCondition();
+    MemoryArena::Default().Deinitialize();
+}
+
+void testRandomStringAllocation(size_t numReps, size_t nStrings, size_t minLength, size_t maxLength) {
+    // numReps iterations of the following procedure: allocate nStrings
+    // char* arrays with random length between minLength and maxLength,
+    // and then deallocate about a quarter of them. Afterwards, allocate
+    // again the previously deallocated, and stop the timer. The deallocation
+    // of everything at the end of the function is not included in the time.
+    std::mt19937 gen{ static_cast<unsigned>(std::chrono::steady_clock::now().time_since_epoch().count()) };
+    std::uniform_int_distribution<size_t> distr(minLength, maxLength);
+    andi::vector<std::pair<microseconds, microseconds>> times(numReps);
+    andi::vector<size_t> lengths(nStrings);
+
+    for (auto& p : times) {
+        // generate the arrays lengths beforehand
+        for (auto& len : lengths)
+            len = distr(gen);
+        // run a single test
+        p = { singleTestTimer<andi::allocator>(lengths),
+              singleTestTimer<std::allocator>(lengths) };
+    }
+
+    static andi::mutex coutmtx;
+    andi::lock_guard lock{ coutmtx };
+    std::cout << "Testing " << nStrings << " string allocations and ~" << nStrings / 4 << " reallocations...\n";
+    std::cout << "String length between " << minLength << " and " << maxLength << ".\n";
+    // Print the timings from the tests
+    double a = 0., s = 0.;
+    std::cout << "andi::allocator\tstd::allocator\tdifference\t(%)\n";
+    for (const auto& p : times) {
+        const double a_ = double(p.first.count()) / 1000.;
+        const double s_ = double(p.second.count()) / 1000.;
+        a += a_; s += s_;
+        std::cout << "  " << a_ << "ms\t  " << s_ << "ms\t" << a_ - s_
+            << "ms\t(" << 100 * (a_ - s_) / s_ << "%)\n";
+    }
+    a /= times.size();
+    s /= times.size();
+    std::cout << "Average:\n  " << a << "ms\t  " << s << "ms\t" << a - s << "ms\t(" << 100 * (a - s) / s << "%)\n";
+    std::cout << "\n";
+}
+
+void testBuddyScaling(size_t nOps) {
+    // Each thread keeps 16 blocks of 4KB-1MB alive, replacing a random one nOps times.
+    // Build with USE_LOCKFREE_BUDDY set to 0 and 1 to compare the buddy engines (with
+    // USE_SLAB_ALLOCATOR, the sizes up to 64KB are served by the slabs instead).
+    auto worker = [nOps](unsigned seed) {
+        std::mt19937 gen{ seed };
+        void* blocks[16] = {};
+        for (size_t i = 0; i < nOps; i++) {
+            void*& ptr = blocks[gen() % 16];
+            MemoryArena::Default().Deallocate(ptr);
+            // log-uniformly distributed sizes
+            const size_t size = size_t(1) << (12 + gen() % 8);
+            ptr = MemoryArena::Default().Allocate(size + gen() % size);
+        }
+        for (void* ptr : blocks)
+            MemoryArena::Default().Deallocate(ptr);
+    };
+
+    std::cout << "Testing " << nOps << " reallocations of 4KB-1MB per thread, using the "
+        << ((USE_LOCKFREE_BUDDY == 1) ? "lock-free" : "locking") << " buddy allocators...\n";
+    std::cout << "threads\ttime\t\tthroughput\n";
+    for (unsigned nthreads = 1; nthreads <= 32; nthreads *= 2) {
+        std::vector<std::thread> ths;
+        auto start = std::chrono::steady_clock::now();
+        for (unsigned i = 0; i < nthreads; i++)
+            ths.emplace_back(worker, i + 1);
+        for (auto& th : ths)
+            th.join();
+        auto end = std::chrono::steady_clock::now();
+
+        const double ms = double(std::chrono::duration_cast<microseconds>(end - start).count()) / 1000.;
+        std::cout << "  " << nthreads << "\t" << ms << "ms\t" << double(nthreads*nOps) / ms << " ops/ms\n";
+    }
+    std::cout << "\n";
+}
+
+void testFirstAllocations(size_t nAllocs) {
+    // Times each of the first nAllocs allocations (32B-1MB) in a new arena, with and without
+    // warming it up first. The warm-up replays the same allocation profile with Prefault().
+    std::mt19937 gen{ 1 };
+    std::vector<size_t> sizes(nAllocs);
+    for (auto& size : sizes) {
+        const size_t base = size_t(1) << (5 + gen() % 15);
+        size = base + gen() % base;
+    }
+    std::map<size_t, size_t> profile;
+    for (size_t size : sizes)
+        ++profile[MemoryArena::GoodSize(size)];
+
+    std::cout << "Testing the latency of the first " << nAllocs << " allocations of 32B-1MB in a new arena...\n";
+    std::cout << "warm-up\t\tp50\tp99\tp99.9\tmax\ttotal\n";
+    std::vector<void*> ptrs(nAllocs);
+    std::vector<uint64_t> latencies(nAllocs);
+    for (int warm = 0; warm < 2; warm++) {
+        MemoryArena arena;
+        arena.Initialize();
+        auto start = std::chrono::steady_clock::now();
+        if (warm)
+            for (const auto& entry : profile)
+                arena.Prefault(entry.first, entry.second);
+        const double warmupMs = double(std::chrono::duration_cast<microseconds>(std::chrono::steady_clock::now() - start).count()) / 1000.;
+
+        for (size_t i = 0; i < nAllocs; i++) {
+            start = std::chrono::steady_clock::now();
+            // the memory is written to as well, since that's where the page faults happen
+            ptrs[i] = arena.Allocate(sizes[i]);
+            std::memset(ptrs[i], 0xAB, sizes[i]);
+            latencies[i] = uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+        }
+        for (void* ptr : ptrs)
+            arena.Deallocate(ptr);
+        arena.Deinitialize();
+
+        uint64_t total = 0;
+        for (uint64_t ns : latencies)
+            total += ns;
+        std::sort(latencies.begin(), latencies.end());
+        auto percentile = [&](double p) { return double(latencies[size_t(p * double(nAllocs - 1))]) / 1000.; };
+        std::cout << "  ";
+        if (warm)
+            std::cout << warmupMs << "ms";
+        else
+            std::cout << "none";
+        std::cout << "\t\t" << percentile(0.5) << "us\t" << percentile(0.99) << "us\t" << percentile(0.999) << "us\t"
+            << double(latencies.back()) / 1000. << "us\t" << double(total) / 1e6 << "ms\n";
+    }
+    std::cout << "\n";
+}
+
+void testRefiller(size_t nBursts) {
+    // A service that keeps growing: every millisecond a burst of 100 allocations of 8B-64KB
+    // arrives & is kept. Each allocation is timed, with and without the background refiller.
+    const size_t burst = 100;
+    std::mt19937 gen{ 2 };
+    std::vector<size_t> sizes(nBursts*burst);
+    for (auto& size : sizes)
+        size = size_t(8) << (gen() % 13);
+
+    std::cout << "Testing the latency of " << nBursts << " bursts of " << burst << " allocations of 8B-64KB...\n";
+    std::cout << "refiller\tp50\tp99\tp99.9\tmax\n";
+    std::vector<void*> ptrs(sizes.size());
+    std::vector<uint64_t> latencies(sizes.size());
+    for (int refill = 0; refill < 2; refill++) {
+        MemoryArena arena;
+        arena.Initialize();
+        if (refill)
+            arena.StartRefiller(std::chrono::milliseconds{ 1 }, 1024 * 1024);
+        for (size_t b = 0; b < nBursts; b++) {
+            for (size_t i = b*burst; i < (b + 1)*burst; i++) {
+                auto start = std::chrono::steady_clock::now();
+                ptrs[i] = arena.Allocate(sizes[i]);
+                std::memset(ptrs[i], 0xAB, sizes[i]);
+                latencies[i] = uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds{ 1 });
+        }
+        arena.StopRefiller();
+        for (void* ptr : ptrs)
+            arena.Deallocate(ptr);
+        arena.Deinitialize();
+
+        std::sort(latencies.begin(), latencies.end());
+        auto percentile = [&](double p) { return double(latencies[size_t(p * double(latencies.size() - 1))]) / 1000.; };
+        std::cout << "  " << (refill ? "on" : "off") << "\t\t" << percentile(0.5) << "us\t" << percentile(0.99) << "us\t"
+            << percentile(0.999) << "us\t" << double(latencies.back()) / 1000. << "us\n";
+    }
+    std::cout << "\n";
+}
+
+#if USE_DEFRAGMENTATION == 1
+void testDefragmentation(size_t nObjects) {
+    // A long-running service: its objects of 64B-256KB are mostly gone, but the few that are
+    // left pin their pool pages & buddy blocks. Each object's context is its slot in the table,
+    // which is all that has to be updated, when it's moved.
+    std::mt19937 gen{ 3 };
+    std::vector<void*> objects(nObjects);
+    std::vector<size_t> sizes(nObjects);
+    MemoryArena arena;
+    arena.Initialize();
+    for (size_t i = 0; i < nObjects; i++) {
+        sizes[i] = (i % 10 == 0) ? (size_t(128) << (gen() % 12)) : 64;
+        objects[i] = arena.AllocateRelocatable(sizes[i], &objects[i]);
+        std::memset(objects[i], 0xAB, sizes[i]);
+    }
+    for (size_t i = 0; i < nObjects; i++) {
+        if (gen() % 10 != 0) {
+            arena.DeallocateRelocatable(objects[i]);
+            objects[i] = nullptr;
+        }
+    }
+    std::cout << "Testing the defragmentation of " << nObjects << " objects of 64B-256KB, 90% of them freed...\n";
+    std::cout << "  trimmed before:\t" << arena.Trim() / 1024 << "KB\n";
+    auto start = std::chrono::steady_clock::now();
+    const size_t moved = arena.Defragment([](void* slot, void* from, void* to, size_t size) {
+        std::memcpy(to, from, size);
+        *(void**)slot = to;
+    }, ~size_t(0));
+    auto end = std::chrono::steady_clock::now();
+    std::cout << "  moved:\t\t" << moved / 1024 << "KB in " << std::chrono::duration_cast<microseconds>(end - start).count() << "us\n";
+    std::cout << "  trimmed after:\t" << arena.Trim() / 1024 << "KB\n\n";
+    for (void* ptr : objects)
+        arena.DeallocateRelocatable(ptr);
+    arena.Deinitialize();
+}
+#endif // USE_DEFRAGMENTATION
+
+template<template<class> class Allocator>
+microseconds singleTestTimer(const andi::vector<size_t>& lengths) {
+    const size_t n = lengths.size();
+
+    auto start = std::chrono::steady_clock::now();
+    char** strings = Allocator<char*>().allocate(n);
+    Allocator<char> al;
+    for (size_t i = 0; i < n; i++)
+        strings[i] = al.allocate(lengths[i]);
+    
+    for (size_t i = 0; i < n; i++)
+        if (lengths[i] % 4 == 0)
+            al.deallocate(strings[i], lengths[i]);
+    
+    for (size_t i = 0; i < n; i++)
+        if (lengths[i] % 4 == 0)
+            strings[i] = al.allocate(lengths[i]);
+    
+    auto end = std::chrono::steady_clock::now();
+
+    for (size_t i = 0; i < n; i++)
+        al.deallocate(strings[i], lengths[i]);
+    Allocator<char*>().deallocate(strings, n);
+
+    return std::chrono::duration_cast<microseconds>(end - start);
+}
+
+// iei
@@ -1,78 +1,300 @@
-﻿#include "Defines.h"
-#include <malloc.h>
-
-void* andi::aligned_malloc(size_t size) {
-#if defined(_MSC_VER)
-    return _aligned_malloc(size, Constants::Alignment);
-#else
-    void* ptr;
-    posix_memalign(&ptr, allocAlignment, size);
-    return ptr;
-#endif
-}
-
-void andi::aligned_free(void* ptr) {
-#if defined(_MSC_VER)
-    _aligned_free(ptr);
-#else
-    free(ptr);
-#endif
-}
-
-#if HPC_DEBUG == 1
-void andi::vassert_impl(const char* expr, const char* function, const char* file, const unsigned line) {
-    static andi::mutex cerrmtx;
-    andi::lock_guard lock{ cerrmtx };
-    std::cerr << "Assert failed: "   << expr
-              << "\n  in function: " << function
-              << "\n  in file:     " << file
-              << "\n  line:        " << line << "\n\n";
-    int* p = nullptr;
-    *p = 5;
-}
-#endif // HPC_DEBUG
-
-uint32_t min(uint32_t a, uint32_t b) { return (a < b) ? a : b; }
-uint32_t max(uint32_t a, uint32_t b) { return (a > b) ? a : b; }
-uint64_t max(uint64_t a, uint64_t b) { return (a > b) ? a : b; }
-
-uint32_t leastSetBit(uint32_t x) {
-    static const uint32_t DeBruijnLeastSetBit[32] = {
-        0, 1, 28, 2, 29, 14, 24, 3, 30, 22, 20, 15, 25, 17, 4, 8,
-        31, 27, 13, 23, 21, 19, 16, 7, 26, 12, 18, 6, 11, 5, 10, 9
-    };
-    return DeBruijnLeastSetBit[((x & (~x + 1U)) * 0x077CB531U) >> 27];
-}
-
-uint32_t leastSetBit(uint64_t x) {
-    if (x & 0xFFFF'FFFFui64)
-        return leastSetBit(uint32_t(x & 0xFFFF'FFFFui64));
-    else if (x != 0)
-        return leastSetBit(uint32_t(x >> 32)) + 32;
-    else
-        return 64;
-}
-// calculates floor(log2(x)) for every х
-uint32_t fastlog2(uint32_t x) {
-    static const uint32_t DeBruijnLog2Inexact[32] = {
-        0, 9, 1, 10, 13, 21, 2, 29, 11, 14, 16, 18, 22, 25, 3, 30,
-        8, 12, 20, 28, 15, 17, 24, 7, 19, 27, 23, 6, 26, 5, 4, 31
-    };
-
-    x |= x >> 1; // first round down to one less than a power of 2 
-    x |= x >> 2;
-    x |= x >> 4;
-    x |= x >> 8;
-    x |= x >> 16;
-
-    return DeBruijnLog2Inexact[(x * 0x07C4ACDDU) >> 27];
-}
-// calculates floor(log2(x)) for every x
-uint32_t fastlog2(uint64_t x) {
-    if (x < 0x1'0000'0000ui64)
-        return fastlog2(uint32_t(x));
-    else
-        return 32 + fastlog2(uint32_t(x >> 32));
-}
-
-// iei
+﻿#include "Defines.h"
+#include <malloc.h>
+#include <chrono>
+#include <cstring> // std::memset
+#if defined(_MSC_VER)
+#define NOMINMAX // we have our own min & max
+#include <Windows.h>
+#else
+#include <sys/mman.h>
+#if PROFILE_HEAP == 1
+#include <execinfo.h>
+#endif // PROFILE_HEAP
+#endif
+
+void* andi::aligned_malloc(size_t size) {
+#if defined(_MSC_VER)
+    return _aligned_malloc(size, Constants::Alignment);
+#else
+    void* ptr;
+    posix_memalign(&ptr, Constants::Alignment, size);
+    return ptr;
+#endif
+}
+
+void andi::aligned_free(void* ptr) {
+#if defined(_MSC_VER)
+    _aligned_free(ptr);
+#else
+    free(ptr);
+#endif
+}
+
+void* andi::page_alloc(size_t size) {
+#if defined(_MSC_VER)
+    return VirtualAlloc(nullptr, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#else
+    void* ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    return (ptr == MAP_FAILED) ? nullptr : ptr;
+#endif
+}
+
+void* andi::page_alloc_aligned(size_t size, size_t alignment) {
+#if defined(_MSC_VER)
+    // Reserve more than needed to find an aligned address, and then try to
+    // reserve exactly there. Another thread may get there first, so retry.
+    for (int attempt = 0; attempt < 8; attempt++) {
+        void* ptr = VirtualAlloc(nullptr, size + alignment, MEM_RESERVE, PAGE_NOACCESS);
+        if (!ptr)
+            return nullptr;
+        VirtualFree(ptr, 0, MEM_RELEASE);
+        void* aligned = (void*)((uintptr_t(ptr) + alignment - 1) & ~uintptr_t(alignment - 1));
+        ptr = VirtualAlloc(aligned, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+        if (ptr)
+            return ptr;
+    }
+    return nullptr;
+#else
+    // Reserve more than needed and unmap the excess on both sides
+    void* ptr = mmap(nullptr, size + alignment, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (ptr == MAP_FAILED)
+        return nullptr;
+    const uintptr_t from = uintptr_t(ptr);
+    const uintptr_t aligned = (from + alignment - 1) & ~uintptr_t(alignment - 1);
+    if (aligned != from)
+        munmap(ptr, aligned - from);
+    if (aligned + size != from + size + alignment)
+        munmap((void*)(aligned + size), from + alignment - aligned);
+    return (void*)aligned;
+#endif
+}
+
+void andi::page_free(void* ptr, size_t size) {
+#if defined(_MSC_VER)
+    VirtualFree(ptr, 0, MEM_RELEASE);
+#else
+    munmap(ptr, size);
+#endif
+}
+
+void andi::page_release(void* ptr, size_t size) {
+#if defined(_MSC_VER)
+    // Decommitting & recommitting right away guarantees zeroed pages on next access (unlike MEM_RESET)
+    VirtualFree(ptr, size, MEM_DECOMMIT);
+    VirtualAlloc(ptr, size, MEM_COMMIT, PAGE_READWRITE);
+#else
+    // MADV_FREE is cheaper, but does not guarantee the pages will be zeroed
+    madvise(ptr, size, MADV_DONTNEED);
+#endif
+}
+
+void andi::page_remove(void* ptr, size_t size) {
+#if defined(_MSC_VER)
+    std::memset(ptr, 0, size);
+#else
+    // Punches a hole in the file, which reads as zeroes afterwards
+    if (madvise(ptr, size, MADV_REMOVE) != 0)
+        std::memset(ptr, 0, size);
+#endif
+}
+
+void andi::page_prefault(void* ptr, size_t size) {
+#if defined(MADV_POPULATE_WRITE)
+    // Faults in all the pages with a single system call (Linux 5.14+)
+    if (madvise(ptr, size, MADV_POPULATE_WRITE) == 0)
+        return;
+#endif
+    // Otherwise a byte of each page is written to, without changing it. The range
+    // is not in use by anyone else, so this doesn't need to be atomic.
+    uint8_t* const end = (uint8_t*)ptr + size;
+    for (uint8_t* byte = (uint8_t*)ptr; byte < end; byte = (uint8_t*)((uintptr_t(byte) | (Constants::PageSize - 1)) + 1))
+        *(volatile uint8_t*)byte = *(volatile uint8_t*)byte;
+}
+
+#if PROFILE_HEAP == 1
+size_t andi::capture_stack(void** frames, size_t maxDepth, size_t skip) {
+#if defined(_MSC_VER)
+    return CaptureStackBackTrace(DWORD(skip + 1), DWORD(maxDepth), frames, nullptr);
+#else
+    void* buffer[64];
+    vassert(maxDepth + skip + 1 <= 64 && "andi::capture_stack: The stack is too deep!");
+    const size_t depth = size_t(backtrace(buffer, int(maxDepth + skip + 1)));
+    if (depth <= skip + 1)
+        return 0;
+    for (size_t i = skip + 1; i < depth; i++)
+        frames[i - skip - 1] = buffer[i];
+    return depth - skip - 1;
+#endif
+}
+#endif // PROFILE_HEAP
+
+#if PROFILE_LOCKS == 1
+static uint64_t lockClock() {
+    return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+static size_t lockBucket(uint64_t ns) {
+    const size_t b = (ns == 0) ? 0 : fastlog2(ns) + 1;
+    return (b < andi::lock_stats::Buckets) ? b : andi::lock_stats::Buckets - 1;
+}
+
+void andi::mutex::lock() {
+    bool isLocked = false;
+    if (locked.compare_exchange_strong(isLocked, true)) {
+        ++statistics.acquisitions;
+        ++statistics.waitHistogram[0];
+        acquiredAt = lockClock();
+        return;
+    }
+    const uint64_t start = lockClock();
+    uint64_t spins = 0;
+    do {
+        isLocked = false;
+        ++spins;
+    } while (!locked.compare_exchange_strong(isLocked, true));
+    acquiredAt = lockClock();
+    ++statistics.acquisitions;
+    ++statistics.contended;
+    statistics.spins += spins;
+    ++statistics.waitHistogram[lockBucket(acquiredAt - start)];
+}
+
+void andi::mutex::unlock() {
+    ++statistics.holdHistogram[lockBucket(lockClock() - acquiredAt)];
+    release();
+}
+
+andi::lock_stats andi::mutex::stats() {
+    acquire();
+    const lock_stats res = statistics;
+    release();
+    return res;
+}
+
+void andi::mutex::reset_stats() {
+    acquire();
+    statistics = {};
+    release();
+}
+
+andi::lock_stats& andi::lock_stats::operator+=(const lock_stats& other) {
+    acquisitions += other.acquisitions;
+    contended += other.contended;
+    spins += other.spins;
+    for (size_t b = 0; b < Buckets; b++) {
+        waitHistogram[b] += other.waitHistogram[b];
+        holdHistogram[b] += other.holdHistogram[b];
+    }
+    return *this;
+}
+
+void andi::lock_stats::print(std::ostream& os) const {
+    os << "  lock: " << acquisitions << " acquisitions, " << contended << " contended ("
+       << (acquisitions ? 100.0*contended / acquisitions : 0.0) << "%), " << spins << " spins\n";
+    // Only the non-empty buckets, by their upper bound
+    auto printHistogram = [&](const char* name, const uint64_t* histogram) {
+        os << "    " << name << " (ns):";
+        for (size_t b = 0; b < Buckets; b++)
+            if (histogram[b] == 0)
+                continue;
+            else if (b + 1 < Buckets)
+                os << " <" << (uint64_t(1) << b) << ": " << histogram[b];
+            else // the last one takes all longer times, too
+                os << " >=" << (uint64_t(1) << (b - 1)) << ": " << histogram[b];
+        os << "\n";
+    };
+    printHistogram("wait", waitHistogram);
+    printHistogram("hold", holdHistogram);
+}
+#endif // PROFILE_LOCKS
+
+#if USE_HARDENING == 1
+static void printCorruption(const andi::corruption_report& report) {
+    static const char* const descriptions[] = {
+        "invalid free (not an allocation, or already freed)",
+        "misaligned free (not the start of a block)",
+        "corrupted free list (a free block has been written to)"
+    };
+    static andi::mutex cerrmtx;
+    andi::lock_guard lock{ cerrmtx };
+    std::cerr << "Heap corruption: " << descriptions[size_t(report.kind)]
+              << "\n  pointer:   " << report.ptr
+              << "\n  allocator: " << report.allocator << "\n\n";
+}
+
+static std::atomic<andi::corruption_handler> corruptionHandler{ printCorruption };
+
+andi::corruption_handler andi::set_corruption_handler(corruption_handler handler) {
+    return corruptionHandler.exchange(handler ? handler : printCorruption);
+}
+
+void andi::report_corruption(corruption kind, const void* ptr, const char* allocator) {
+    corruptionHandler.load()({ kind, ptr, allocator });
+}
+#endif // USE_HARDENING
+
+#if HPC_DEBUG == 1
+void andi::vassert_impl(const char* expr, const char* function, const char* file, const unsigned line) {
+    static andi::mutex cerrmtx;
+    andi::lock_guard lock{ cerrmtx };
+    std::cerr << "Assert failed: "   << expr
+              << "\n  in function: " << function
+              << "\n  in file:     " << file
+              << "\n  line:        " << line << "\n\n";
+    int* p = nullptr;
+    *p = 5;
+}
+#endif // HPC_DEBUG
+
+uint32_t min(uint32_t a, uint32_t b) { return (a < b) ? a : b; }
+uint32_t max(uint32_t a, uint32_t b) { return (a > b) ? a : b; }
+uint64_t max(uint64_t a, uint64_t b) { return (a > b) ? a : b; }
+
+uint32_t leastSetBit(uint32_t x) {
+    static const uint32_t DeBruijnLeastSetBit[32] = {
+        0, 1, 28, 2, 29, 14, 24, 3, 30, 22, 20, 15, 25, 17, 4, 8,
+        31, 27, 13, 23, 21, 19, 16, 7, 26, 12, 18, 6, 11, 5, 10, 9
+    };
+    return DeBruijnLeastSetBit[((x & (~x + 1U)) * 0x077CB531U) >> 27];
+}
+
+uint32_t leastSetBit(uint64_t x) {
+    if (x & 0xFFFF'FFFFui64)
+        return leastSetBit(uint32_t(x & 0xFFFF'FFFFui64));
+    else if (x != 0)
+        return leastSetBit(uint32_t(x >> 32)) + 32;
+    else
+        return 64;
+}
+// calculates floor(log2(x)) for every х
+uint32_t fastlog2(uint32_t x) {
+    static const uint32_t DeBruijnLog2Inexact[32] = {
+        0, 9, 1, 10, 13, 21, 2, 29, 11, 14, 16, 18, 22, 25, 3, 30,
+        8, 12, 20, 28, 15, 17, 24, 7, 19, 27, 23, 6, 26, 5, 4, 31
+    };
+
+    x |= x >> 1; // first round down to one less than a power of 2 
+    x |= x >> 2;
+    x |= x >> 4;
+    x |= x >> 8;
+    x |= x >> 16;
+
+    return DeBruijnLog2Inexact[(x * 0x07C4ACDDU) >> 27];
+}
+// calculates floor(log2(x)) for every x
+uint32_t fastlog2(uint64_t x) {
+    if (x < 0x1'0000'0000ui64)
+        return fastlog2(uint32_t(x));
+    else
+        return 32 + fastlog2(uint32_t(x >> 32));
+}
+// counts the set bits of x
+uint32_t popCount(uint64_t x) {
+    x = x - ((x >> 1) & 0x5555'5555'5555'5555ui64);
+    x = (x & 0x3333'3333'3333'3333ui64) + ((x >> 2) & 0x3333'3333'3333'3333ui64);
+    x = (x + (x >> 4)) & 0x0F0F'0F0F'0F0F'0F0Fui64;
+    return uint32_t((x * 0x0101'0101'0101'0101ui64) >> 56);
+}
+
+// iei
@@ -1,81 +1,182 @@
-#pragma once
-#include "Defines.h"
-#include <atomic>
-#include <cstdint>
-#include <stdlib.h>
-#include <iostream> // for allocator internal state print-out
-#include <utility>  // std::pair
-
-#if !defined(HPC_DEBUG) || !defined(USE_POOL_ALLOCATORS)
-    #error "Please include Defines.h before defining anything."
-#endif // HPC_DEBUG || USE_POOL_ALLOCATORS
-
-// Each BuddyAllocator allocation needs the following header to manage the allocations.
-// In theory this header can be reduced to 7 bits (!) -> O(lglgn)
-struct SuperblockHeader {
-#if HPC_DEBUG == 1
-    union {
-        struct {
-            uint16_t k;
-            uint16_t free;
-        };
-        uint32_t blueprint;
-    };
-    uint32_t signature;
-#else
-    uint32_t k;
-    uint32_t free;
-#endif // HPC_DEBUG
-};
-
-// Used by the BuddyAllocator to manage its free Superblocks
-struct Superblock : SuperblockHeader {
-    Superblock* prev;
-    Superblock* next;
-};
-
-namespace andi
-{
-    void* aligned_malloc(size_t);
-    void aligned_free(void*);
-
-    // A small busy-waiting mutex - replaces the cost of context switching with
-    // that of a thread staying alive, hoping the wait does not take long
-    // (in which case the total processing time will increase)
-    class mutex {
-        friend class lock_guard;
-        std::atomic<bool> locked;
-
-        void lock() {
-            bool isLocked = false;
-            while (!locked.compare_exchange_strong(isLocked, true))
-                isLocked = false;
-        }
-        void unlock() { locked = false; }
-    public:
-        mutex() : locked{ false } {}
-    };
-
-    class lock_guard {
-        mutex& mtx;
-    public:
-        lock_guard(mutex& mtx) : mtx{ mtx } { mtx.lock(); }
-        ~lock_guard() { mtx.unlock(); }
-    };
-
-#if HPC_DEBUG == 1
-    void vassert_impl(const char* expr, const char* function, const char* file, const unsigned line);
-    #define vassert(expr) ((void)(!!(expr) || (andi::vassert_impl(#expr, __FUNCTION__, __FILE__, __LINE__), 0)))
-#else
-    #define vassert(expr) ((void)0)
-#endif // HPC_DEBUG
-}
-
-// Helper math functions
-uint32_t min(uint32_t, uint32_t);
-uint32_t max(uint32_t, uint32_t);
-uint64_t max(uint64_t, uint64_t);
-uint32_t leastSetBit(uint32_t);
-uint32_t leastSetBit(uint64_t);
-uint32_t fastlog2(uint32_t);
-uint32_t fastlog2(uint64_t);
+#pragma once
+#include "Defines.h"
+#include <atomic>
+#include <cstdint>
+#include <stdlib.h>
+#include <iostream> // for allocator internal state print-out
+#include <utility>  // std::pair
+
+#if !defined(HPC_DEBUG) || !defined(USE_POOL_ALLOCATORS) || !defined(USE_SLAB_ALLOCATOR) || !defined(PROFILE_LOCKS) || !defined(USE_LOCKFREE_BUDDY) || !defined(USE_HANDLE_SPACE) || !defined(USE_ADDRESS_ORDERED_BUDDY) || !defined(PROFILE_HEAP) || !defined(USE_ALLOCATION_TAGS) || !defined(USE_HARDENING) || !defined(USE_DEFRAGMENTATION)
+    #error "Please include Defines.h before defining anything."
+#endif // HPC_DEBUG || USE_POOL_ALLOCATORS || USE_SLAB_ALLOCATOR || PROFILE_LOCKS || USE_LOCKFREE_BUDDY || USE_HANDLE_SPACE || USE_ADDRESS_ORDERED_BUDDY || PROFILE_HEAP || USE_ALLOCATION_TAGS || USE_HARDENING || USE_DEFRAGMENTATION
+
+// The BuddyAllocator keeps its block metadata out-of-band, in a table with a single
+// byte per minimum-size block (granule) of its address space. Only the entry for the
+// first granule of a block is meaningful - all others are kept zeroed, so that k == 0
+// marks an address that is not the start of any block.
+struct SuperblockInfo {
+    uint8_t k        : 6;
+    uint8_t free     : 1;
+    // Set for free blocks, whose whole pages (except for the list links)
+    // have been returned to the system, or have never been touched at all.
+    uint8_t released : 1;
+};
+
+namespace andi
+{
+    // A pointer (or an address), stored as its distance from the place it's stored at. Structures,
+    // which only refer to themselves & to memory at a fixed distance from them, can this way be
+    // mapped at different addresses - f.e. a BuddyAllocator, placed in a shared mapping together
+    // with its pool. Assignment recalculates the distance, so it works just like with raw pointers.
+    template<class T>
+    class self_relative {
+        intptr_t distance;
+    public:
+        self_relative() = default;
+        self_relative(T value) noexcept : distance(intptr_t(uintptr_t(value) - uintptr_t(this))) {}
+        self_relative(const self_relative& other) noexcept : self_relative(T(other)) {}
+        self_relative& operator=(T value) noexcept {
+            distance = intptr_t(uintptr_t(value) - uintptr_t(this));
+            return *this;
+        }
+        self_relative& operator=(const self_relative& other) noexcept { return *this = T(other); }
+        operator T() const noexcept { return T(uintptr_t(this) + uintptr_t(distance)); }
+        T operator->() const noexcept { return T(*this); }
+    };
+}
+
+// Used by the BuddyAllocator to manage its free Superblocks. The links are
+// kept inside the free blocks themselves, so they cost no extra memory.
+// They are relative, so that the BuddyAllocator's state is position-independent.
+// With address-ordered placement the blocks form a heap instead of a list: prev is
+// the parent or the left sibling, next is the right sibling & child the leftmost child.
+struct Superblock {
+    andi::self_relative<Superblock*> prev;
+    andi::self_relative<Superblock*> next;
+#if USE_ADDRESS_ORDERED_BUDDY == 1
+    andi::self_relative<Superblock*> child;
+#endif // USE_ADDRESS_ORDERED_BUDDY
+};
+
+namespace andi
+{
+    void* aligned_malloc(size_t);
+    void aligned_free(void*);
+    // Reserve zero-initialized memory directly from the system. The
+    // pages are not backed by physical memory until they are touched.
+    void* page_alloc(size_t);
+    // Same as above, but the address is a multiple of alignment (a power of two)
+    void* page_alloc_aligned(size_t, size_t alignment);
+    void page_free(void*, size_t);
+    // Returns the physical memory behind a range of pages to the system, keeping
+    // the range valid for use. The pages read as zeroes when touched again.
+    void page_release(void*, size_t);
+    // Same as above, for the pages of a shared mapping (of a file or a shared memory object),
+    // whose contents would otherwise be read back from it. Where the underlying file system
+    // cannot free them, the pages are zeroed instead.
+    void page_remove(void*, size_t);
+    // Backs a range of pages with physical memory in advance, so that touching them later
+    // causes no page faults. Their contents are left as they are.
+    void page_prefault(void*, size_t);
+#if PROFILE_HEAP == 1
+    // Writes the return addresses of up to maxDepth calling functions, after skipping
+    // the innermost skip ones (this one not counted). Returns the number written.
+    size_t capture_stack(void** frames, size_t maxDepth, size_t skip);
+#endif // PROFILE_HEAP
+
+#if PROFILE_LOCKS == 1
+    // Contention figures of a single mutex. The wait & hold times are in nanoseconds,
+    // in buckets of powers of two: bucket b counts the times in [2^(b-1), 2^b).
+    struct lock_stats {
+        static constexpr size_t Buckets = 24;
+        uint64_t acquisitions;
+        uint64_t contended; // acquisitions, that had to wait for another thread
+        uint64_t spins;     // failed attempts, while waiting
+        uint64_t waitHistogram[Buckets];
+        uint64_t holdHistogram[Buckets];
+
+        lock_stats& operator+=(const lock_stats&);
+        void print(std::ostream&) const;
+    };
+#endif // PROFILE_LOCKS
+
+    // A small busy-waiting mutex - replaces the cost of context switching with
+    // that of a thread staying alive, hoping the wait does not take long
+    // (in which case the total processing time will increase)
+    class mutex {
+        friend class lock_guard;
+        std::atomic<bool> locked;
+#if PROFILE_LOCKS == 1
+        // Updated only by the lock's owner, so they need no synchronization of their own
+        lock_stats statistics;
+        uint64_t acquiredAt;
+
+        void lock();
+        void unlock();
+        void acquire() {
+#else
+        void lock() {
+#endif // PROFILE_LOCKS
+            bool isLocked = false;
+            while (!locked.compare_exchange_strong(isLocked, true))
+                isLocked = false;
+        }
+#if PROFILE_LOCKS == 1
+        void release() { locked = false; }
+    public:
+        mutex() : locked{ false }, statistics{}, acquiredAt{ 0 } {}
+        // A snapshot of the figures so far, taken without being counted in them
+        lock_stats stats();
+        void reset_stats();
+#else
+        void unlock() { locked = false; }
+    public:
+        mutex() : locked{ false } {}
+#endif // PROFILE_LOCKS
+    };
+
+    class lock_guard {
+        mutex& mtx;
+    public:
+        lock_guard(mutex& mtx) : mtx{ mtx } { mtx.lock(); }
+        ~lock_guard() { mtx.unlock(); }
+    };
+
+#if USE_HARDENING == 1
+    // Heap corruption, caught by a hardened arena (see MemoryArena::SetHardening)
+    enum class corruption {
+        invalid_free,       // the pointer is not an allocation's start, or is already freed
+        misaligned_free,    // the pointer is inside a block, not at its start
+        corrupted_free_list // a free block's link was overwritten, f.e. by a use after free
+    };
+    struct corruption_report {
+        corruption kind;
+        const void* ptr;
+        const char* allocator;
+    };
+    using corruption_handler = void(*)(const corruption_report&);
+    // Sets the process-wide handler & returns the previous one. The default one prints the
+    // report to std::cerr. The arena recovers by ignoring the operation - f.e. the free -
+    // after the handler returns, unless the handler ends the program itself. It is called
+    // with the allocator's lock held, so it must not use the arena.
+    corruption_handler set_corruption_handler(corruption_handler);
+    void report_corruption(corruption, const void* ptr, const char* allocator);
+#endif // USE_HARDENING
+
+#if HPC_DEBUG == 1
+    void vassert_impl(const char* expr, const char* function, const char* file, const unsigned line);
+    #define vassert(expr) ((void)(!!(expr) || (andi::vassert_impl(#expr, __FUNCTION__, __FILE__, __LINE__), 0)))
+#else
+    #define vassert(expr) ((void)0)
+#endif // HPC_DEBUG
+}
+
+// Helper math functions
+uint32_t min(uint32_t, uint32_t);
+uint32_t max(uint32_t, uint32_t);
+uint64_t max(uint64_t, uint64_t);
+uint32_t leastSetBit(uint32_t);
+uint32_t leastSetBit(uint64_t);
+uint32_t fastlog2(uint32_t);
+uint32_t fastlog2(uint64_t);
+uint32_t popCount(uint64_t);